@@ -0,0 +1,187 @@
+// compares the bullet kernels with the original per-item switch
+//
+//     make bench
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <csignal>
+
+#include "constants.h"
+#include "bullets.h"
+
+#define NR_SLOTS 4096
+#define NR_STEPS 2000
+#define NR_TRIALS 5
+
+struct bullet_t {
+    uint8_t kind, dir;
+    uint16_t x, y;
+};
+
+// move_bullets as it used to be in server.cpp
+void reference_move(bullet_t* b, int n) {
+    for (int i = 0; i < n; i++) {
+        bullet_t& cur = b[i];
+        if (cur.kind != ITEM_BULLET)
+            continue;
+        switch (cur.dir) {
+            case DIR_UP: {
+                if (cur.y > 0) { (cur.y)--; break; }
+                else { cur.dir = DIR_DOWN; break;}
+            }
+            case DIR_DOWN: {
+                if (cur.y < BATTLE_H - 1) { (cur.y)++; break; }
+                else { cur.dir = DIR_UP; break;}
+            }
+            case DIR_LEFT: {
+                if (cur.x > 0) { (cur.x)--; break; }
+                else { cur.dir = DIR_RIGHT; break;}
+            }
+            case DIR_RIGHT: {
+                if (cur.x < BATTLE_W - 1) { (cur.x)++; break; }
+                else { cur.dir = DIR_LEFT; break; }
+            }
+            case DIR_UP_LEFT: {
+                if (cur.y > 0) { (cur.y)--; }
+                else { cur.dir = DIR_DOWN_LEFT; break; }
+                if (cur.x > 1) { (cur.x) -= 2; }
+                else { cur.dir = DIR_UP_RIGHT; break; }
+                break;
+            }
+            case DIR_UP_RIGHT: {
+                if (cur.y > 0) { (cur.y)--; }
+                else { cur.dir = DIR_DOWN_RIGHT; break;}
+                if (cur.x < BATTLE_W - 2) { (cur.x) += 2; }
+                else { cur.dir = DIR_UP_LEFT; break; }
+                break;
+            }
+            case DIR_DOWN_LEFT: {
+                if (cur.y < BATTLE_H - 2) { (cur.y)++; }
+                else { cur.dir = DIR_UP_LEFT; break; }
+                if (cur.x > 1) { (cur.x) -= 2; }
+                else { cur.dir = DIR_DOWN_RIGHT; break; }
+                break;
+            }
+            case DIR_DOWN_RIGHT: {
+                if (cur.y < BATTLE_H - 2) { (cur.y)++; }
+                else { cur.dir = DIR_UP_RIGHT; break;}
+                if (cur.x < BATTLE_W - 2) { (cur.x) += 2; }
+                else { cur.dir = DIR_DOWN_LEFT; break; }
+                break;
+            }
+        }
+    }
+}
+
+static bullet_t init_state[NR_SLOTS];
+static uint8_t kind[NR_SLOTS], dir[NR_SLOTS];
+static uint16_t x[NR_SLOTS], y[NR_SLOTS], px[NR_SLOTS], py[NR_SLOTS];
+static uint32_t moved[NR_SLOTS / BULLET_BLOCK];
+
+// mostly bullets, some other items and free slots, every position reachable
+void random_state(int seed) {
+    srand(seed);
+    for (int i = 0; i < NR_SLOTS; i++) {
+        int r = rand() % 10;
+        init_state[i].kind = r < 7 ? ITEM_BULLET : r < 9 ? rand() % ITEM_END : ITEM_NONE;
+        init_state[i].dir = rand() % 8;
+        init_state[i].x = rand() % BATTLE_W;
+        init_state[i].y = rand() % BATTLE_H;
+    }
+}
+
+void load_state() {
+    for (int i = 0; i < NR_SLOTS; i++) {
+        kind[i] = init_state[i].kind;
+        dir[i] = init_state[i].dir;
+        x[i] = init_state[i].x;
+        y[i] = init_state[i].y;
+    }
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int check(const char* name, bullets_kernel_t kernel, const bullet_rules_t* rules) {
+    static bullet_t ref[NR_SLOTS];
+    for (int trial = 0; trial < NR_TRIALS; trial++) {
+        random_state(trial);
+        memcpy(ref, init_state, sizeof(ref));
+        load_state();
+        for (int step = 0; step < NR_STEPS; step++) {
+            reference_move(ref, NR_SLOTS);
+            kernel(rules, ITEM_BULLET, kind, dir, x, y, px, py, moved, NR_SLOTS);
+            for (int i = 0; i < NR_SLOTS; i++) {
+                int was_moved = (moved[i / BULLET_BLOCK] >> (i % BULLET_BLOCK)) & 1;
+                int should_move = px[i] != ref[i].x || py[i] != ref[i].y;
+                if (dir[i] == ref[i].dir && x[i] == ref[i].x && y[i] == ref[i].y
+                    && was_moved == should_move)
+                    continue;
+                printf("%s: slot %d differs at step %d of trial %d: "
+                       "(%d,%d) dir %d, expected (%d,%d) dir %d\n",
+                       name, i, step, trial, x[i], y[i], dir[i], ref[i].x, ref[i].y, ref[i].dir);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+double time_reference() {
+    static bullet_t ref[NR_SLOTS];
+    memcpy(ref, init_state, sizeof(ref));
+    double start = now();
+    for (int step = 0; step < NR_STEPS; step++)
+        reference_move(ref, NR_SLOTS);
+    return now() - start;
+}
+
+double time_kernel(bullets_kernel_t kernel, const bullet_rules_t* rules) {
+    load_state();
+    double start = now();
+    for (int step = 0; step < NR_STEPS; step++)
+        kernel(rules, ITEM_BULLET, kind, dir, x, y, px, py, moved, NR_SLOTS);
+    return now() - start;
+}
+
+int main() {
+    bullet_rules_t rules;
+    bullet_rules_init(&rules, BATTLE_W, BATTLE_H);
+
+    struct {
+        const char* name;
+        bullets_kernel_t kernel;
+        bool supported;
+    } kernels[] = {
+        { "scalar", bullets_advance_scalar, true },
+#ifdef BULLETS_X86
+        { "ssse3", bullets_advance_ssse3, (bool)__builtin_cpu_supports("ssse3") },
+        { "avx2", bullets_advance_avx2, (bool)__builtin_cpu_supports("avx2") },
+#endif
+    };
+
+    int failed = 0;
+    random_state(0);
+    double base = time_reference();
+    printf("%d slots x %d steps\n", NR_SLOTS, NR_STEPS);
+    printf("%-10s %8.2f ns/slot\n", "switch", base * 1e9 / NR_SLOTS / NR_STEPS);
+    for (auto& k : kernels) {
+        if (!k.supported) {
+            printf("%-10s unsupported\n", k.name);
+            continue;
+        }
+        if (check(k.name, k.kernel, &rules)) {
+            failed = 1;
+            continue;
+        }
+        random_state(0);
+        double t = time_kernel(k.kernel, &rules);
+        printf("%-10s %8.2f ns/slot %6.2fx%s\n", k.name, t * 1e9 / NR_SLOTS / NR_STEPS,
+               base / t, k.kernel == bullets_advance ? "  (used by server)" : "");
+    }
+    return failed;
+}
@@ -0,0 +1,68 @@
+// measures the cost of a log call on the calling thread, written out
+// synchronously as before and through the asynchronous logger
+//
+//     make bench
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <csignal>
+#include <fcntl.h>
+
+#include "constants.h"
+#include "common.h"
+
+#define NR_ROUNDS 20
+#define NR_CALLS 1000  // per round, a round fits in the ring of a thread
+#define NR_THREADS 4
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// a line like the ones of every move and shot, the flusher catches up
+// between rounds so no line is dropped
+void* log_calls(void* result) {
+    char user_name[USERNAME_SIZE] = "player01", ip_addr[IPADDR_SIZE] = "127.0.0.1";
+    struct timespec pause = { 0, 20000000 };
+    double sum = 0;
+    for (int round = 0; round < NR_ROUNDS; round++) {
+        double start = now();
+        for (int i = 0; i < NR_CALLS; i++)
+            log("user #%d %s\033[2m(%s)\033[0m move up", i, user_name, ip_addr);
+        sum += now() - start;
+        nanosleep(&pause, NULL);
+    }
+    *(double*)result = sum;
+    return NULL;
+}
+
+double run(int threads) {
+    pthread_t tid[NR_THREADS];
+    double t[NR_THREADS], sum = 0;
+    for (int i = 0; i < threads; i++)
+        pthread_create(&tid[i], NULL, log_calls, &t[i]);
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tid[i], NULL);
+        sum += t[i];
+    }
+    return sum / threads * 1e9 / NR_CALLS / NR_ROUNDS;
+}
+
+int main() {
+    // the lines go to /dev/null, only the calls are timed
+    int out = dup(STDERR_FILENO), null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    FILE* result = fdopen(out, "w");
+
+    fprintf(result, "%d x %d calls per thread\n", NR_ROUNDS, NR_CALLS);
+    fprintf(result, "%-10s %8.1f ns/call\n", "fprintf", run(1));
+    fprintf(result, "%-10s %8.1f ns/call\n", "fprintf x4", run(NR_THREADS));
+    logger_start();
+    fprintf(result, "%-10s %8.1f ns/call\n", "async", run(1));
+    fprintf(result, "%-10s %8.1f ns/call\n", "async x4", run(NR_THREADS));
+    fclose(result);
+    return 0;
+}
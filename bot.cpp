@@ -0,0 +1,429 @@
+// headless players for load testing the server. every bot has its own
+// connection, registers, logs in, joins a battle and then sends the
+// keys of the client at a fixed rate, at random or from a script. each
+// second a line reports the frames received and how far apart they
+// came, frames later than 1.5 ticks count as late.
+//
+//     make bot
+//     ./bot -n 200 -c 20 -r 10 -t 60 127.0.0.1 50000
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdarg>
+#include <ctime>
+#include <vector>
+
+#include "constants.h"
+#include "common.h"
+#include "histogram.h"
+
+#define NS_PER_SEC ((uint64_t)1000000000)
+#define NS_PER_US 1000
+// frames are due every GLOBAL_SPEED ms (server.h)
+#define TICK_US 20000
+#define LATE_US (TICK_US * 3 / 2)
+// keys of a random bot, repeated to weight them
+#define RANDOM_KEYS "wwwwaaaassssddddkjhlyon.KJHLz "
+#define BOT_EVENTS 256
+
+enum {
+    BOT_LOGIN,         // register and login sent
+    BOT_LOBBY,         // logged in, battle not joined yet
+    BOT_WAIT_BATTLE,   // asked to launch or join
+    BOT_BATTLE,
+    BOT_CLOSED,
+};
+
+struct bot_t {
+    int fd, state;
+    char name[USERNAME_SIZE];
+    uint8_t rbuf[4 * MAX_FRAME_SIZE];
+    size_t rlen;
+    uint32_t input_seq;
+    int script_pos;
+    uint64_t next_action;  // ns
+    uint64_t last_frame;   // ns, 0 before the first frame
+    uint64_t frames, bytes, late, dropped;
+    histogram_t interval;  // between frames, us
+};
+
+static const char* server_addr = "127.0.0.1";
+static int port = 50000;
+static int nr_bots = 10, connect_rate = 0, group_size = 4, duration = 0;
+static double action_rate = 5;
+static bool private_mode = false, verbose = false;
+static const char* script = NULL;
+static const char* prefix = "bot";
+
+static std::vector<bot_t*> bots;
+static int key_command[128];
+static histogram_t period;  // intervals of all bots since the last report
+static uint64_t period_frames, period_bytes, period_late;
+static volatile sig_atomic_t stop;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+void init_keys() {
+    for (int i = 0; i < 128; i++) key_command[i] = -1;
+    key_command['w'] = CLIENT_COMMAND_MOVE_UP;
+    key_command['s'] = CLIENT_COMMAND_MOVE_DOWN;
+    key_command['a'] = CLIENT_COMMAND_MOVE_LEFT;
+    key_command['d'] = CLIENT_COMMAND_MOVE_RIGHT;
+    key_command['k'] = CLIENT_COMMAND_FIRE_UP;
+    key_command['j'] = CLIENT_COMMAND_FIRE_DOWN;
+    key_command['h'] = CLIENT_COMMAND_FIRE_LEFT;
+    key_command['l'] = CLIENT_COMMAND_FIRE_RIGHT;
+    key_command['y'] = CLIENT_COMMAND_FIRE_UP_LEFT;
+    key_command['o'] = CLIENT_COMMAND_FIRE_UP_RIGHT;
+    key_command['n'] = CLIENT_COMMAND_FIRE_DOWN_LEFT;
+    key_command['.'] = CLIENT_COMMAND_FIRE_DOWN_RIGHT;
+    key_command['K'] = CLIENT_COMMAND_FIRE_AOE_UP;
+    key_command['J'] = CLIENT_COMMAND_FIRE_AOE_DOWN;
+    key_command['H'] = CLIENT_COMMAND_FIRE_AOE_LEFT;
+    key_command['L'] = CLIENT_COMMAND_FIRE_AOE_RIGHT;
+    key_command['z'] = CLIENT_COMMAND_PUT_LANDMINE;
+    key_command[' '] = CLIENT_COMMAND_MELEE;
+}
+
+void close_bot(bot_t* b) {
+    if (b->state == BOT_CLOSED) return;
+    close(b->fd);
+    b->state = BOT_CLOSED;
+}
+
+// commands are tiny, one that does not fit the socket buffer is dropped
+void bot_send(bot_t* b, client_message_t* cm) {
+    uint8_t frame[MAX_FRAME_SIZE];
+    size_t len = encode_client_message(cm, frame);
+    ssize_t sent = send(b->fd, frame, len, MSG_NOSIGNAL);
+    if (sent == (ssize_t)len) return;
+    if (sent < 0 && errno == EAGAIN) {
+        b->dropped++;
+        return;
+    }
+    if (sent >= 0) {
+        // a partial frame would corrupt the stream, give up on the bot
+        loge("bot %s: short send", b->name);
+    }
+    close_bot(b);
+}
+
+void bot_command(bot_t* b, int command, const char* user_name = NULL) {
+    client_message_t cm;
+    memset(&cm, 0, sizeof(cm));
+    cm.command = command;
+    if (user_name) strncpy(cm.user_name, user_name, USERNAME_SIZE - 1);
+    if (client_payload_kind(command) == PAYLOAD_INPUT_SEQ) cm.input_seq = ++b->input_seq;
+    bot_send(b, &cm);
+}
+
+void bot_credential(bot_t* b, int command) {
+    client_message_t cm;
+    memset(&cm, 0, sizeof(cm));
+    cm.command = command;
+    strncpy(cm.user_name, b->name, USERNAME_SIZE - 1);
+    strncpy(cm.password, b->name, PASSWORD_SIZE - 1);
+    bot_send(b, &cm);
+}
+
+bot_t* leader_of(int i) {
+    return bots[i - i % group_size];
+}
+
+bool is_leader(int i) {
+    return i % group_size == 0;
+}
+
+// ffa bots join on their own, in private mode a leader launches a
+// battle and invites the bots of its group as they show up
+void join_battle(int i) {
+    bot_t* b = bots[i];
+    if (!private_mode) {
+        bot_command(b, CLIENT_COMMAND_LAUNCH_FFA);
+    } else if (is_leader(i)) {
+        bot_command(b, CLIENT_COMMAND_LAUNCH_BATTLE);
+    } else if (leader_of(i)->state == BOT_BATTLE) {
+        bot_command(leader_of(i), CLIENT_COMMAND_INVITE_USER, b->name);
+    } else {
+        return;  // invited once the leader is in
+    }
+    b->state = BOT_WAIT_BATTLE;
+}
+
+void enter_battle(int i) {
+    bot_t* b = bots[i];
+    if (b->state == BOT_BATTLE) return;
+    b->state = BOT_BATTLE;
+    b->next_action = now_ns();
+    if (!private_mode || !is_leader(i)) return;
+    for (int j = i + 1; j < i + group_size && j < (int)bots.size(); j++) {
+        if (bots[j]->state == BOT_LOBBY)
+            join_battle(j);
+    }
+}
+
+void on_frame(bot_t* b, const server_message_t* psm) {
+    uint64_t t = now_ns();
+    if (b->last_frame) {
+        uint64_t us = (t - b->last_frame) / NS_PER_US;
+        hist_record(&b->interval, us);
+        hist_record(&period, us);
+        if (us > LATE_US) b->late++, period_late++;
+    }
+    b->last_frame = t;
+    b->frames++;
+    period_frames++;
+
+    client_message_t cm;
+    memset(&cm, 0, sizeof(cm));
+    cm.command = CLIENT_COMMAND_ACK_FRAME;
+    cm.frame_seq = psm->frame_seq;
+    bot_send(b, &cm);
+}
+
+void on_message(int i, const server_message_t* psm) {
+    bot_t* b = bots[i];
+    switch (psm->message) {
+        case SERVER_RESPONSE_LOGIN_SUCCESS:
+        case SERVER_RESPONSE_YOU_HAVE_LOGINED:
+            b->state = BOT_LOBBY;
+            join_battle(i);
+            break;
+        case SERVER_RESPONSE_LOGIN_FAIL_UNREGISTERED_USERID:
+        case SERVER_RESPONSE_LOGIN_FAIL_ERROR_PASSWORD:
+        case SERVER_RESPONSE_LOGIN_FAIL_DUP_USERID:
+        case SERVER_RESPONSE_LOGIN_FAIL_SERVER_LIMITS:
+            loge("bot %s: login failed (%d)", b->name, psm->message);
+            close_bot(b);
+            break;
+        case SERVER_MESSAGE_INVITE_TO_BATTLE:
+            bot_command(b, CLIENT_COMMAND_ACCEPT_BATTLE);
+            break;
+        case SERVER_RESPONSE_LAUNCH_BATTLE_SUCCESS:
+            enter_battle(i);
+            break;
+        case SERVER_RESPONSE_LAUNCH_BATTLE_FAIL:
+            if (b->state == BOT_WAIT_BATTLE) b->state = BOT_LOBBY;
+            break;
+        case SERVER_MESSAGE_BATTLE_INFORMATION:
+            enter_battle(i);
+            on_frame(b, psm);
+            break;
+        case SERVER_STATUS_QUIT:
+            close_bot(b);
+            break;
+    }
+}
+
+void on_readable(int i) {
+    static server_message_t sm;
+    bot_t* b = bots[i];
+    while (b->state != BOT_CLOSED) {
+        ssize_t len = recv(b->fd, b->rbuf + b->rlen, sizeof(b->rbuf) - b->rlen, 0);
+        if (len < 0 && errno == EINTR) continue;
+        if (len < 0 && errno == EAGAIN) return;
+        if (len <= 0) {
+            close_bot(b);
+            return;
+        }
+        b->rlen += len;
+        b->bytes += len;
+        period_bytes += len;
+
+        size_t head = 0;
+        int size;
+        while ((size = frame_size(b->rbuf + head, b->rlen - head)) > 0) {
+            if (!decode_server_message(b->rbuf + head, size, &sm)) {
+                loge("bot %s: malformed frame", b->name);
+                close_bot(b);
+                return;
+            }
+            on_message(i, &sm);
+            head += size;
+        }
+        if (size < 0) {
+            close_bot(b);
+            return;
+        }
+        memmove(b->rbuf, b->rbuf + head, b->rlen - head);
+        b->rlen -= head;
+    }
+}
+
+void act(bot_t* b, uint64_t t) {
+    if (b->state != BOT_BATTLE || action_rate <= 0) return;
+    uint64_t gap = NS_PER_SEC / action_rate;
+    if (b->next_action + NS_PER_SEC < t)
+        b->next_action = t;  // fell behind, do not send a burst
+    while (b->next_action <= t && b->state == BOT_BATTLE) {
+        int key;
+        if (script) {
+            key = script[b->script_pos++];
+            if (script[b->script_pos] == '\0') b->script_pos = 0;
+        } else {
+            key = RANDOM_KEYS[rand() % (sizeof(RANDOM_KEYS) - 1)];
+        }
+        if (key >= 0 && key < 128 && key_command[key] >= 0)
+            bot_command(b, key_command[key]);
+        // spread the bots, a random bot waits 0.5 to 1.5 gaps
+        b->next_action += script ? gap : gap / 2 + rand() % (gap + 1);
+    }
+}
+
+int connect_bot(int i, int epfd) {
+    bot_t* b = bots[i];
+    snprintf(b->name, USERNAME_SIZE, "%s%d", prefix, i);
+    b->fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(server_addr);
+    if (b->fd < 0 || connect(b->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        loge("bot %s: can not connect to %s:%d", b->name, server_addr, port);
+        if (b->fd >= 0) close(b->fd);
+        b->state = BOT_CLOSED;
+        return -1;
+    }
+    int one = 1;
+    setsockopt(b->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(b->fd, F_SETFL, fcntl(b->fd, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, b->fd, &ev);
+
+    b->state = BOT_LOGIN;
+    bot_credential(b, CLIENT_COMMAND_USER_REGISTER);
+    bot_credential(b, CLIENT_COMMAND_USER_LOGIN);
+    return 0;
+}
+
+void report(double elapsed, int connected) {
+    int in_battle = 0;
+    for (auto b : bots)
+        in_battle += b->state == BOT_BATTLE;
+    printf("%6.0f %6d %6d %8lu %8.1f %7.1f %7.1f %7.1f %7.1f %6lu\n",
+           elapsed, connected, in_battle, period_frames, period_bytes / 1024.0,
+           hist_percentile(&period, 50) / 1e3, hist_percentile(&period, 99) / 1e3,
+           hist_percentile(&period, 99.9) / 1e3, period.max / 1e3, period_late);
+    fflush(stdout);
+    hist_reset(&period);
+    period_frames = period_bytes = period_late = 0;
+}
+
+void summary(double elapsed) {
+    histogram_t all;
+    hist_reset(&all);
+    uint64_t frames = 0, bytes = 0, late = 0, dropped = 0;
+    if (verbose)
+        printf("\n%-12s %8s %8s %7s %7s %7s %6s %6s\n",
+               "bot", "frames", "KB", "p50", "p99", "max", "late", "drop");
+    for (auto b : bots) {
+        hist_merge(&all, &b->interval);
+        frames += b->frames, bytes += b->bytes, late += b->late, dropped += b->dropped;
+        if (verbose)
+            printf("%-12s %8lu %8.1f %7.1f %7.1f %7.1f %6lu %6lu\n",
+                   b->name, b->frames, b->bytes / 1024.0,
+                   hist_percentile(&b->interval, 50) / 1e3, hist_percentile(&b->interval, 99) / 1e3,
+                   b->interval.max / 1e3, b->late, b->dropped);
+    }
+    printf("\n%lu frames in %.1fs, %.1f frames/s, %.1f KB/s, %lu late, %lu commands dropped\n",
+           frames, elapsed, frames / elapsed, bytes / 1024.0 / elapsed, late, dropped);
+    printf("frame interval ms: mean %.2f p50 %.2f p99 %.2f p99.9 %.2f max %.2f\n",
+           hist_mean(&all) / 1e3, hist_percentile(&all, 50) / 1e3, hist_percentile(&all, 99) / 1e3,
+           hist_percentile(&all, 99.9) / 1e3, all.max / 1e3);
+}
+
+void on_signal(int signum) {
+    stop = 1;
+}
+
+int main(int argc, char* argv[]) {
+    init_constants();
+    init_keys();
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:r:m:g:t:s:x:v")) != -1) {
+        switch (opt) {
+            case 'n': nr_bots = atoi(optarg); break;
+            case 'c': connect_rate = atoi(optarg); break;
+            case 'r': action_rate = atof(optarg); break;
+            case 'm': {
+                if (strcmp(optarg, "ffa") == 0) private_mode = false;
+                else if (strcmp(optarg, "private") == 0) private_mode = true;
+                else eprintf("unknown mode `%s`, use ffa or private", optarg);
+                break;
+            }
+            case 'g': group_size = atoi(optarg); break;
+            case 't': duration = atoi(optarg); break;
+            case 's': script = optarg; break;
+            case 'x': prefix = optarg; break;
+            case 'v': verbose = true; break;
+            default:
+                eprintf("usage: %s [-n bots] [-c connects/s] [-r keys/s] [-m ffa|private] [-g group] "
+                        "[-t seconds] [-s keys] [-x prefix] [-v] [host [port]]", argv[0]);
+        }
+    }
+    if (optind < argc) server_addr = argv[optind];
+    if (optind + 1 < argc) port = atoi(argv[optind + 1]);
+    if (nr_bots < 1 || group_size < 1 || (script && !*script))
+        eprintf("bots, group size and script should not be empty");
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    srand(time(NULL));
+
+    for (int i = 0; i < nr_bots; i++) {
+        bot_t* b = new bot_t;
+        memset(b, 0, sizeof(*b));
+        b->fd = -1;
+        b->state = BOT_CLOSED;
+        bots.push_back(b);
+    }
+
+    int epfd = epoll_create1(0);
+    int connected = 0;
+    uint64_t start = now_ns(), next_report = start + NS_PER_SEC;
+    printf("%6s %6s %6s %8s %8s %7s %7s %7s %7s %6s\n",
+           "time", "bots", "battle", "frames", "KB", "p50", "p99", "p99.9", "max", "late");
+    struct epoll_event events[BOT_EVENTS];
+    while (!stop) {
+        uint64_t t = now_ns();
+        if (duration && t - start >= duration * NS_PER_SEC) break;
+
+        // connect all at once, or connect_rate per second
+        int due = connect_rate ? (t - start) * connect_rate / NS_PER_SEC + 1 : nr_bots;
+        for (; connected < nr_bots && connected < due; connected++)
+            connect_bot(connected, epfd);
+
+        int n = epoll_wait(epfd, events, BOT_EVENTS, 1);
+        for (int k = 0; k < n; k++)
+            on_readable(events[k].data.u32);
+
+        t = now_ns();
+        for (auto b : bots)
+            act(b, t);
+        if (t >= next_report) {
+            report((t - start) / 1e9, connected);
+            next_report += NS_PER_SEC;
+        }
+    }
+
+    summary((now_ns() - start) / 1e9);
+    for (auto b : bots)
+        close_bot(b);
+    return 0;
+}
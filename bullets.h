@@ -0,0 +1,256 @@
+// bullet movement for the server, kept apart so that it can be benchmarked
+
+#ifndef BULLETS_H
+#define BULLETS_H
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BULLETS_X86
+#endif
+
+#include "constants.h"
+
+// bullets are advanced in blocks of this many slots
+#define BULLET_BLOCK 32
+
+/* a bullet steps by (dx, dy) of its direction. if y would leave
+ * [ylo, yhi] it turns to `ybounce` without moving. otherwise it moves
+ * vertically, and if x would leave [xlo, xhi] it turns to `xbounce`
+ * instead of moving horizontally. diagonal bullets step two columns, and
+ * stop one row earlier on the way down than straight ones do.
+ *
+ * every table holds one 16 bit word per direction, 16 bytes in all, so
+ * the vector kernels look them up with a single byte shuffle.
+ */
+struct bullet_rules_t {
+    uint16_t ylo[8], yhi[8];
+    uint16_t xlo[8], xhi[8];
+    uint16_t dy[8], dx[8];  // two's complement steps
+    uint16_t ybounce[8], xbounce[8];
+};
+
+void bullet_rules_init(bullet_rules_t* r, int w, int h) {
+    static const struct {
+        int dir, dy, dx, ybounce, xbounce;
+    } moves[8] = {
+        { DIR_UP,          -1,  0, DIR_DOWN,       DIR_UP },
+        { DIR_DOWN,         1,  0, DIR_UP,         DIR_DOWN },
+        { DIR_LEFT,         0, -1, DIR_LEFT,       DIR_RIGHT },
+        { DIR_RIGHT,        0,  1, DIR_RIGHT,      DIR_LEFT },
+        { DIR_UP_LEFT,     -1, -2, DIR_DOWN_LEFT,  DIR_UP_RIGHT },
+        { DIR_UP_RIGHT,    -1,  2, DIR_DOWN_RIGHT, DIR_UP_LEFT },
+        { DIR_DOWN_LEFT,    1, -2, DIR_UP_LEFT,    DIR_DOWN_RIGHT },
+        { DIR_DOWN_RIGHT,   1,  2, DIR_UP_RIGHT,   DIR_DOWN_LEFT },
+    };
+    for (int i = 0; i < 8; i++) {
+        int d = moves[i].dir, dy = moves[i].dy, dx = moves[i].dx;
+        int diagonal = dy != 0 && dx != 0;
+        r->ylo[d] = dy < 0 ? 1 : 0;
+        r->yhi[d] = dy > 0 ? h - 2 - diagonal : UINT16_MAX;
+        r->xlo[d] = dx < 0 ? -dx : 0;
+        r->xhi[d] = dx > 0 ? w - 1 - dx : UINT16_MAX;
+        r->dy[d] = dy;
+        r->dx[d] = dx;
+        r->ybounce[d] = moves[i].ybounce;
+        r->xbounce[d] = moves[i].xbounce;
+    }
+}
+
+/* advance the bullets among slots [0, n) of an item pool, `n` being a
+ * multiple of BULLET_BLOCK. slots of another kind, or with no valid
+ * direction, are left alone. the old position of every slot goes to
+ * px/py, and bit i % 32 of moved[i / 32] tells whether slot i changed
+ * cell.
+ */
+typedef void (*bullets_kernel_t)(const bullet_rules_t* r, uint8_t bullet,
+                                 const uint8_t* kind, uint8_t* dir,
+                                 uint16_t* x, uint16_t* y,
+                                 uint16_t* px, uint16_t* py,
+                                 uint32_t* moved, int n);
+
+void bullets_advance_scalar(const bullet_rules_t* r, uint8_t bullet,
+                            const uint8_t* kind, uint8_t* dir,
+                            uint16_t* x, uint16_t* y,
+                            uint16_t* px, uint16_t* py,
+                            uint32_t* moved, int n) {
+    for (int i = 0; i < n; i += BULLET_BLOCK) {
+        uint32_t bits = 0;
+        for (int j = 0; j < BULLET_BLOCK; j++) {
+            int k = i + j, d = dir[k];
+            uint16_t cx = x[k], cy = y[k];
+            px[k] = cx;
+            py[k] = cy;
+            if (kind[k] != bullet || d >= 8) continue;
+
+            if (cy < r->ylo[d] || cy > r->yhi[d]) {
+                dir[k] = r->ybounce[d];
+                continue;
+            }
+            y[k] = cy + r->dy[d];
+            if (cx < r->xlo[d] || cx > r->xhi[d]) dir[k] = r->xbounce[d];
+            else x[k] = cx + r->dx[d];
+            if (x[k] != cx || y[k] != cy) bits |= 1u << j;
+        }
+        moved[i / BULLET_BLOCK] = bits;
+    }
+}
+
+#ifdef BULLETS_X86
+/* per lane: lo <= v <= hi. there is no unsigned 16 bit compare before
+ * sse4.1, a saturating subtraction gives zero exactly when it holds.
+ */
+inline __m128i bullets_in_range(__m128i v, __m128i lo, __m128i hi) {
+    __m128i zero = _mm_setzero_si128();
+    return _mm_and_si128(_mm_cmpeq_epi16(_mm_subs_epu16(lo, v), zero),
+                         _mm_cmpeq_epi16(_mm_subs_epu16(v, hi), zero));
+}
+
+__attribute__((target("avx2")))
+inline __m256i bullets_in_range(__m256i v, __m256i lo, __m256i hi) {
+    __m256i zero = _mm256_setzero_si256();
+    return _mm256_and_si256(_mm256_cmpeq_epi16(_mm256_subs_epu16(lo, v), zero),
+                            _mm256_cmpeq_epi16(_mm256_subs_epu16(v, hi), zero));
+}
+
+__attribute__((target("ssse3")))
+void bullets_advance_ssse3(const bullet_rules_t* r, uint8_t bullet,
+                           const uint8_t* kind, uint8_t* dir,
+                           uint16_t* x, uint16_t* y,
+                           uint16_t* px, uint16_t* py,
+                           uint32_t* moved, int n) {
+    const __m128i ylo = _mm_loadu_si128((const __m128i*)r->ylo);
+    const __m128i yhi = _mm_loadu_si128((const __m128i*)r->yhi);
+    const __m128i xlo = _mm_loadu_si128((const __m128i*)r->xlo);
+    const __m128i xhi = _mm_loadu_si128((const __m128i*)r->xhi);
+    const __m128i dy = _mm_loadu_si128((const __m128i*)r->dy);
+    const __m128i dx = _mm_loadu_si128((const __m128i*)r->dx);
+    const __m128i ybounce = _mm_loadu_si128((const __m128i*)r->ybounce);
+    const __m128i xbounce = _mm_loadu_si128((const __m128i*)r->xbounce);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i kind_bullet = _mm_set1_epi16(bullet);
+    const __m128i nr_dirs = _mm_set1_epi16(8);
+
+    for (int i = 0; i < n; i += BULLET_BLOCK) {
+        uint32_t bits = 0;
+        for (int j = 0; j < BULLET_BLOCK; j += 8) {
+            int k = i + j;
+            __m128i vx = _mm_loadu_si128((const __m128i*)(x + k));
+            __m128i vy = _mm_loadu_si128((const __m128i*)(y + k));
+            _mm_storeu_si128((__m128i*)(px + k), vx);
+            _mm_storeu_si128((__m128i*)(py + k), vy);
+
+            __m128i vk = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(kind + k)), zero);
+            __m128i vd = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(dir + k)), zero);
+            __m128i active = _mm_and_si128(_mm_cmpeq_epi16(vk, kind_bullet),
+                                           _mm_cmplt_epi16(vd, nr_dirs));
+            if (_mm_movemask_epi8(active) == 0) continue;
+
+            // byte pair (2d, 2d + 1) of a table is the word of direction d
+            __m128i ctrl = _mm_add_epi16(_mm_mullo_epi16(vd, _mm_set1_epi16(0x0202)),
+                                         _mm_set1_epi16(0x0100));
+            __m128i yok = _mm_and_si128(active, bullets_in_range(vy,
+                _mm_shuffle_epi8(ylo, ctrl), _mm_shuffle_epi8(yhi, ctrl)));
+            __m128i xok = bullets_in_range(vx,
+                _mm_shuffle_epi8(xlo, ctrl), _mm_shuffle_epi8(xhi, ctrl));
+            __m128i xmove = _mm_and_si128(yok, xok);
+            __m128i ny = _mm_add_epi16(vy, _mm_and_si128(yok, _mm_shuffle_epi8(dy, ctrl)));
+            __m128i nx = _mm_add_epi16(vx, _mm_and_si128(xmove, _mm_shuffle_epi8(dx, ctrl)));
+
+            __m128i ybump = _mm_andnot_si128(yok, active);
+            __m128i xbump = _mm_andnot_si128(xok, yok);
+            __m128i nd = _mm_or_si128(_mm_andnot_si128(ybump, vd),
+                                      _mm_and_si128(ybump, _mm_shuffle_epi8(ybounce, ctrl)));
+            nd = _mm_or_si128(_mm_andnot_si128(xbump, nd),
+                              _mm_and_si128(xbump, _mm_shuffle_epi8(xbounce, ctrl)));
+
+            _mm_storeu_si128((__m128i*)(x + k), nx);
+            _mm_storeu_si128((__m128i*)(y + k), ny);
+            _mm_storel_epi64((__m128i*)(dir + k), _mm_packus_epi16(nd, nd));
+
+            __m128i same = _mm_and_si128(_mm_cmpeq_epi16(nx, vx), _mm_cmpeq_epi16(ny, vy));
+            uint32_t mask = _mm_movemask_epi8(_mm_packs_epi16(same, same)) & 0xFF;
+            bits |= (~mask & 0xFF) << j;
+        }
+        moved[i / BULLET_BLOCK] = bits;
+    }
+}
+
+__attribute__((target("avx2")))
+void bullets_advance_avx2(const bullet_rules_t* r, uint8_t bullet,
+                          const uint8_t* kind, uint8_t* dir,
+                          uint16_t* x, uint16_t* y,
+                          uint16_t* px, uint16_t* py,
+                          uint32_t* moved, int n) {
+    // vpshufb works within 128 bit halves, so each table goes to both
+    const __m256i ylo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)r->ylo));
+    const __m256i yhi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)r->yhi));
+    const __m256i xlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)r->xlo));
+    const __m256i xhi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)r->xhi));
+    const __m256i dy = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)r->dy));
+    const __m256i dx = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)r->dx));
+    const __m256i ybounce = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)r->ybounce));
+    const __m256i xbounce = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)r->xbounce));
+    const __m256i kind_bullet = _mm256_set1_epi16(bullet);
+    const __m256i max_dir = _mm256_set1_epi16(7);
+
+    for (int i = 0; i < n; i += BULLET_BLOCK) {
+        uint32_t bits = 0;
+        for (int j = 0; j < BULLET_BLOCK; j += 16) {
+            int k = i + j;
+            __m256i vx = _mm256_loadu_si256((const __m256i*)(x + k));
+            __m256i vy = _mm256_loadu_si256((const __m256i*)(y + k));
+            _mm256_storeu_si256((__m256i*)(px + k), vx);
+            _mm256_storeu_si256((__m256i*)(py + k), vy);
+
+            __m256i vk = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(kind + k)));
+            __m256i vd = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(dir + k)));
+            __m256i active = _mm256_andnot_si256(_mm256_cmpgt_epi16(vd, max_dir),
+                                                 _mm256_cmpeq_epi16(vk, kind_bullet));
+            if (_mm256_movemask_epi8(active) == 0) continue;
+
+            __m256i ctrl = _mm256_add_epi16(_mm256_mullo_epi16(vd, _mm256_set1_epi16(0x0202)),
+                                            _mm256_set1_epi16(0x0100));
+            __m256i yok = _mm256_and_si256(active, bullets_in_range(vy,
+                _mm256_shuffle_epi8(ylo, ctrl), _mm256_shuffle_epi8(yhi, ctrl)));
+            __m256i xok = bullets_in_range(vx,
+                _mm256_shuffle_epi8(xlo, ctrl), _mm256_shuffle_epi8(xhi, ctrl));
+            __m256i xmove = _mm256_and_si256(yok, xok);
+            __m256i ny = _mm256_add_epi16(vy, _mm256_and_si256(yok, _mm256_shuffle_epi8(dy, ctrl)));
+            __m256i nx = _mm256_add_epi16(vx, _mm256_and_si256(xmove, _mm256_shuffle_epi8(dx, ctrl)));
+
+            __m256i ybump = _mm256_andnot_si256(yok, active);
+            __m256i xbump = _mm256_andnot_si256(xok, yok);
+            __m256i nd = _mm256_blendv_epi8(vd, _mm256_shuffle_epi8(ybounce, ctrl), ybump);
+            nd = _mm256_blendv_epi8(nd, _mm256_shuffle_epi8(xbounce, ctrl), xbump);
+
+            _mm256_storeu_si256((__m256i*)(x + k), nx);
+            _mm256_storeu_si256((__m256i*)(y + k), ny);
+            // packing works per half, gather the two low quarters afterwards
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(nd, nd), 0xD8);
+            _mm_storeu_si128((__m128i*)(dir + k), _mm256_castsi256_si128(packed));
+
+            __m256i same = _mm256_and_si256(_mm256_cmpeq_epi16(nx, vx), _mm256_cmpeq_epi16(ny, vy));
+            same = _mm256_permute4x64_epi64(_mm256_packs_epi16(same, same), 0xD8);
+            uint32_t mask = _mm_movemask_epi8(_mm256_castsi256_si128(same));
+            bits |= (~mask & 0xFFFF) << j;
+        }
+        moved[i / BULLET_BLOCK] = bits;
+    }
+}
+#endif
+
+bullets_kernel_t bullets_pick_kernel() {
+#ifdef BULLETS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return bullets_advance_avx2;
+    if (__builtin_cpu_supports("ssse3")) return bullets_advance_ssse3;
+#endif
+    return bullets_advance_scalar;
+}
+
+bullets_kernel_t bullets_advance = bullets_pick_kernel();
+
+#endif
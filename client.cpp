@@ -7,6 +7,7 @@
 
 #include <csignal>
 #include <cstdarg>
+#include <cerrno>
 
 #include "constants.h"
 #include "common.h"
@@ -15,8 +16,15 @@
 #define LINE_MAX_LEN 40
 #define LOGIN_FILE "login.log"
 
-#define wlog(fmt, ...) write_log("%s:%d: " fmt, user_name, __LINE__, ##__VA_ARGS__)
-#define wlogi(fmt, ...) write_log("%s:%d: ==> " fmt, user_name, __LINE__, ##__VA_ARGS__)
+#define WLOG_DEBUG 0  // wlogi
+#define WLOG_INFO  1  // wlog
+#define WLOG_OFF   2
+
+#define WLOG_BUF_SIZE (1 << 16)
+#define WLOG_FLUSH_MS 500
+
+#define wlog(fmt, ...) write_log(WLOG_INFO, "%s:%d: " fmt, user_name, __LINE__, ##__VA_ARGS__)
+#define wlogi(fmt, ...) write_log(WLOG_DEBUG, "%s:%d: ==> " fmt, user_name, __LINE__, ##__VA_ARGS__)
 
 static int port = 50000, port_range = 100;
 static int scr_actual_w = 0;
@@ -24,12 +32,13 @@ static int scr_actual_h = 0;
 
 static int user_hp = 0;
 static int user_bullets = 0;
+static pos_t user_pos;  // in the arena, the map shows the window around it
 static int user_state = USER_STATE_NOT_LOGIN;
 static char* user_name = (char*)"<unknown>";
 static char* log_file = (char*)"runtime.log";
 static char* global_server_str;
 static int login_failed;
-static int map[BATTLE_H][BATTLE_W];
+static frame_history_t frames;
 
 static char* user_state_s[8];
 
@@ -42,10 +51,11 @@ static char* server_addr;
 static int global_serv_message = -1;
 
 pthread_mutex_t cursor_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
 
 char* readline();
 
-void write_log(const char* format, ...);
+void write_log(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
 
 char* strdup(const char* s);
 
@@ -63,6 +73,10 @@ void resume_and_exit(int status);
 
 void display_user_state();
 
+void send_move(int command);
+
+void reset_prediction();
+
 void flip_screen();
 
 void show_cursor();
@@ -75,10 +89,13 @@ int private_ui();
 
 void terminate(int signum);
 
+// rows of the friend list, online friends beyond it are not shown
+#define CATALOG_ROWS 14
+
 struct catalog_t {
     pos_t pos;
     const char* title;
-    char records[USER_CNT][USERNAME_SIZE];
+    char records[CATALOG_ROWS][USERNAME_SIZE];
 } friend_list = {
     {48, 1},
     "online friends",
@@ -141,27 +158,56 @@ int connect_to_server() {
 }
 
 void wrap_send(client_message_t* pcm) {
+    uint8_t frame[MAX_FRAME_SIZE];
+    size_t frame_len = encode_client_message(pcm, frame);
     size_t total_len = 0;
-    while (total_len < sizeof(client_message_t)) {
-        size_t len = send(client_fd, pcm + total_len, sizeof(client_message_t) - total_len, 0);
+    // the monitor thread acknowledges frames while the ui sends commands
+    pthread_mutex_lock(&send_lock);
+    while (total_len < frame_len) {
+        ssize_t len = send(client_fd, frame + total_len, frame_len - total_len, 0);
         if (len < 0) {
             loge("broken pipe");
+            break;
         }
 
         total_len += len;
     }
+    pthread_mutex_unlock(&send_lock);
 }
 
+/* frames are read in bulk, several of them usually come with one recv.
+ * a lost connection or a malformed frame reads as SERVER_STATUS_QUIT.
+ */
+static uint8_t recv_buf[4 * MAX_FRAME_SIZE];
+static size_t recv_head = 0, recv_tail = 0;
+
 void wrap_recv(server_message_t* psm) {
-    size_t total_len = 0;
-    while (total_len < sizeof(server_message_t)) {
-        size_t len = recv(client_fd, psm + total_len, sizeof(server_message_t) - total_len, 0);
-        if (len < 0) {
+    int size;
+    while ((size = frame_size(recv_buf + recv_head, recv_tail - recv_head)) == 0) {
+        if (recv_head > 0) {
+            memmove(recv_buf, recv_buf + recv_head, recv_tail - recv_head);
+            recv_tail -= recv_head;
+            recv_head = 0;
+        }
+
+        ssize_t len = recv(client_fd, recv_buf + recv_tail, sizeof(recv_buf) - recv_tail, 0);
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) {
             loge("broken pipe");
+            size = -1;
+            break;
         }
 
-        total_len += len;
+        recv_tail += len;
     }
+
+    if (size < 0 || !decode_server_message(recv_buf + recv_head, size, psm)) {
+        memset(psm, 0, sizeof(server_message_t));
+        psm->message = SERVER_STATUS_QUIT;
+        recv_head = recv_tail = 0;
+        return;
+    }
+    recv_head += size;
 }
 
 void send_command(int command) {
@@ -495,6 +541,220 @@ void unlock_cursor() {
     pthread_mutex_unlock(&cursor_lock);
 }
 
+/* a screen update is composed here and written with a single write().
+ * the composer follows the cursor and the attributes in effect so that
+ * it can move relatively when that is shorter and skip repeated SGR
+ * changes. both are unknown when a frame begins, other output may have
+ * happened in between. callers hold cursor_lock.
+ */
+#define FRAME_BUF_SIZE (64 * 1024)
+struct frame_composer_t {
+    char buf[FRAME_BUF_SIZE];
+    int len;
+    int x, y;         // cursor, x < 0 if unknown
+    const char* sgr;  // attributes, NULL if unknown
+} composer;
+
+void fc_write(frame_composer_t* fc) {
+    fflush(stdout);  // what went through printf comes first
+    for (int done = 0, n; done < fc->len; done += n) {
+        n = write(STDOUT_FILENO, fc->buf + done, fc->len - done);
+        if (n < 0 && errno != EINTR) break;
+        if (n < 0) n = 0;
+    }
+    fc->len = 0;
+}
+
+void fc_raw(frame_composer_t* fc, const char* s, int n) {
+    if (fc->len + n > FRAME_BUF_SIZE)
+        fc_write(fc);
+    memcpy(fc->buf + fc->len, s, n);
+    fc->len += n;
+}
+
+void fc_begin(frame_composer_t* fc) {
+    fc->len = 0;
+    fc->x = fc->y = -1;
+    fc->sgr = NULL;
+}
+
+void fc_end(frame_composer_t* fc) {
+    if (fc->sgr != NULL && fc->sgr != color_s[0])
+        fc_raw(fc, color_s[0], strlen(color_s[0]));
+    if (fc->len > 0)
+        fc_write(fc);
+}
+
+// `\033[<n><c>`, n is left out when it is 1
+int csi_n(char* buf, int n, char c) {
+    return n == 1 ? sprintf(buf, "\033[%c", c) : sprintf(buf, "\033[%d%c", n, c);
+}
+
+void fc_move(frame_composer_t* fc, int x, int y) {
+    if (fc->x == x && fc->y == y)
+        return;
+    char abs_s[32], rel_s[64];
+    int abs_n = sprintf(abs_s, "\033[%d;%df", y + 1, x + 1), rel_n = 0;
+    if (fc->x >= 0) {
+        int dx = x - fc->x, dy = y - fc->y;
+        if (dy != 0)
+            rel_n += csi_n(rel_s + rel_n, dy > 0 ? dy : -dy, dy > 0 ? 'B' : 'A');
+        if (dx != 0 && x == 0)
+            rel_s[rel_n++] = '\r';
+        else if (dx != 0)
+            rel_n += csi_n(rel_s + rel_n, dx > 0 ? dx : -dx, dx > 0 ? 'C' : 'D');
+    }
+    if (fc->x >= 0 && rel_n < abs_n)
+        fc_raw(fc, rel_s, rel_n);
+    else
+        fc_raw(fc, abs_s, abs_n);
+    fc->x = x;
+    fc->y = y;
+}
+
+void fc_sgr(frame_composer_t* fc, const char* sgr) {
+    if (fc->sgr != NULL && (fc->sgr == sgr || strcmp(fc->sgr, sgr) == 0))
+        return;
+    // a change starts from the defaults, attributes do not pile up
+    if (sgr != color_s[0] && fc->sgr != color_s[0])
+        fc_raw(fc, color_s[0], strlen(color_s[0]));
+    fc_raw(fc, sgr, strlen(sgr));
+    fc->sgr = sgr;
+}
+
+// text without escapes, one column per character
+void fc_text(frame_composer_t* fc, const char* sgr, const char* text) {
+    fc_sgr(fc, sgr);
+    int n = strlen(text);
+    fc_raw(fc, text, n);
+    for (int i = 0; i < n && fc->x >= 0; i++)
+        if ((text[i] & 0xc0) != 0x80)
+            fc->x++;
+    // a write into the last column leaves the cursor undefined
+    if (fc->x >= scr_actual_w)
+        fc->x = -1;
+}
+
+void fc_put(frame_composer_t* fc, int x, int y, const char* sgr, const char* glyph) {
+    fc_move(fc, x, y);
+    fc_text(fc, sgr, glyph);
+}
+
+void fc_printf(frame_composer_t* fc, const char* sgr, const char* format, ...) __attribute__((format(printf, 3, 4)));
+void fc_printf(frame_composer_t* fc, const char* sgr, const char* format, ...) {
+    char s[256];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(s, sizeof(s), format, ap);
+    va_end(ap);
+    fc_text(fc, sgr, s);
+}
+
+// erase to the end of the line with the default background
+void fc_erase_line(frame_composer_t* fc) {
+    fc_sgr(fc, color_s[0]);
+    fc_raw(fc, "\033[K", 3);
+}
+
+/* the battle screen as cells, the map on the left and the players on
+ * the right. `back` is what the next frame shows and `front` what the
+ * terminal shows, compose_cells() writes the difference. callers hold
+ * cursor_lock for both.
+ */
+struct cell_t {
+    char glyph[4];    // one column of utf-8, not terminated when full
+    const char* sgr;  // color_s[...] or GRASS_SGR
+};
+static cell_t front[BATTLE_H][SCR_W], back[BATTLE_H][SCR_W];
+static char shown_state[256];  // the status line below, written again only when it changes
+
+static const char* const GRASS_SGR = "\033[2;37m";
+
+void set_cell(cell_t* c, const char* glyph, const char* sgr) {
+    int n = 1;
+    while (n < 4 && (glyph[n] & 0xc0) == 0x80) n++;
+    memset(c->glyph, 0, sizeof(c->glyph));
+    memcpy(c->glyph, glyph, n);
+    c->sgr = sgr;
+}
+
+bool same_cell(const cell_t& a, const cell_t& b) {
+    return a.sgr == b.sgr && memcmp(a.glyph, b.glyph, sizeof(a.glyph)) == 0;
+}
+
+bool blank_cell(const cell_t& c) {
+    return c.glyph[0] == ' ' && c.sgr == color_s[0];
+}
+
+void clear_cells(cell_t (*grid)[SCR_W], int x0, int x1) {
+    for (int y = 0; y < BATTLE_H; y++)
+        for (int x = x0; x < x1; x++)
+            set_cell(&grid[y][x], " ", color_s[0]);
+}
+
+// writes text into a row of `back`, one column per character
+void put_cells(int x, int y, const char* sgr, const char* text) {
+    for (const char* p = text; *p && x < SCR_W; p++)
+        if ((*p & 0xc0) != 0x80)
+            set_cell(&back[y][x++], p, sgr);
+}
+
+void fc_cell(frame_composer_t* fc, int x, int y, const cell_t& c) {
+    fc_move(fc, x, y);
+    fc_sgr(fc, c.sgr);
+    fc_raw(fc, c.glyph, strnlen(c.glyph, sizeof(c.glyph)));
+    fc->x = x + 1 < scr_actual_w ? x + 1 : -1;
+}
+
+/* per row: blank tails go with one erase to the end of the line, longer
+ * blank runs with an erase of n characters, unchanged gaps of at most
+ * RUN_GAP cells in the current attributes are written over instead of
+ * moved across, the rest cell by cell.
+ */
+#define RUN_GAP 2
+#define ERASE_RUN 5
+void compose_cells(frame_composer_t* fc) {
+    for (int y = 0; y < BATTLE_H; y++) {
+        cell_t* b = back[y];
+        cell_t* f = front[y];
+        int last = SCR_W - 1;
+        while (last >= 0 && blank_cell(b[last])) last--;
+
+        for (int x = 0; x < SCR_W; x++) {
+            if (same_cell(b[x], f[x])) continue;
+
+            int run = x, changed = 0;
+            for (; run < SCR_W && blank_cell(b[run]); run++)
+                changed += !same_cell(b[run], f[run]);
+            if (run == SCR_W && changed > 1) {
+                fc_move(fc, x, y);
+                fc_erase_line(fc);
+            } else if (changed >= ERASE_RUN) {
+                char s[16];
+                fc_move(fc, x, y);
+                fc_sgr(fc, color_s[0]);
+                fc_raw(fc, s, csi_n(s, run - x, 'X'));  // the cursor stays
+            } else {
+                run = x;
+            }
+            if (run > x) {
+                for (; x < run; x++) f[x] = b[x];
+                x--;
+                continue;
+            }
+
+            if (fc->y == y && fc->x >= 0 && fc->x < x && x - fc->x <= RUN_GAP) {
+                int k = fc->x;
+                while (k < x && f[k].sgr == fc->sgr) k++;
+                for (k = k == x ? fc->x : x; k < x; k++)
+                    fc_cell(fc, k, y, f[k]);
+            }
+            fc_cell(fc, x, y, b[x]);
+            f[x] = b[x];
+        }
+    }
+}
+
 void init_scr_wh() {
     struct winsize ws;
     ioctl(STDIN_FILENO, TIOCGWINSZ, &ws);
@@ -553,38 +813,139 @@ char* readline() {
     return strdup(line);
 }
 
+void compose_bottom_bar(frame_composer_t* fc, int line, const char* s) {
+    fc_move(fc, 0, SCR_H - 1 + line);
+    fc_erase_line(fc);
+    // the line may carry its own escapes, so the composer loses track
+    // of the cursor and resets the attributes
+    fc_raw(fc, s, strlen(s));
+    fc_raw(fc, color_s[0], strlen(color_s[0]));
+    fc->x = -1;
+    fc->sgr = color_s[0];
+}
+
 void bottom_bar_output(int line, const char* format, ...) {
     assert(line <= 0);
     lock_cursor();
-    set_cursor(0, SCR_H - 1 + line);
-    for (int i = 0; i < scr_actual_w; i++)
-        printf(" ");
-    set_cursor(0, SCR_H - 1 + line);
-
+    char s[1024];
     va_list ap;
     va_start(ap, format);
-    vfprintf(stdout, format, ap);
+    vsnprintf(s, sizeof(s), format, ap);
     va_end(ap);
 
-    fflush(stdout);
-
+    fc_begin(&composer);
+    compose_bottom_bar(&composer, line, s);
+    fc_end(&composer);
     unlock_cursor();
 }
 
-void write_log(const char* format, ...) {
-    FILE* fp = fopen(log_file, "a+");
-
+/* the runtime log. lines are formatted into `buf`, the flusher moves
+ * them to `out` and writes that to the file, which stays open. it wakes
+ * every WLOG_FLUSH_MS, or sooner once `buf` is half full. lines that
+ * find `buf` full are dropped, counted in `dropped`.
+ */
+static struct {
+    FILE* fp;
+    int level;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  // buf is half full
+    char buf[WLOG_BUF_SIZE], out[WLOG_BUF_SIZE];
+    size_t len, dropped;
+} wlog_state = { NULL, WLOG_INFO, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, "", "", 0, 0 };
+
+void write_log(int level, const char* format, ...) {
+    if (level < wlog_state.level || wlog_state.fp == NULL)
+        return;
+
+    pthread_mutex_lock(&wlog_state.lock);
+    size_t room = WLOG_BUF_SIZE - wlog_state.len;
     va_list ap;
     va_start(ap, format);
-    vfprintf(fp, format, ap);
+    int n = vsnprintf(wlog_state.buf + wlog_state.len, room, format, ap);
     va_end(ap);
+    if (n < 0 || (size_t)n >= room) {
+        wlog_state.dropped++;
+    } else {
+        wlog_state.len += n;
+        if (wlog_state.len >= WLOG_BUF_SIZE / 2)
+            pthread_cond_signal(&wlog_state.cond);
+    }
+    pthread_mutex_unlock(&wlog_state.lock);
+}
+
+// the caller holds wlog_state.lock, it is released while writing
+void flush_wlog_locked() {
+    size_t len = wlog_state.len, dropped = wlog_state.dropped;
+    memcpy(wlog_state.out, wlog_state.buf, len);
+    wlog_state.len = wlog_state.dropped = 0;
+    pthread_mutex_unlock(&wlog_state.lock);
+    fwrite(wlog_state.out, 1, len, wlog_state.fp);
+    if (dropped) fprintf(wlog_state.fp, "(%zu lines dropped)\n", dropped);
+    fflush(wlog_state.fp);
+    pthread_mutex_lock(&wlog_state.lock);
+}
+
+void* wlog_flusher(void*) {
+    pthread_mutex_lock(&wlog_state.lock);
+    for (;;) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WLOG_FLUSH_MS % 1000 * 1000000L;
+        deadline.tv_sec += WLOG_FLUSH_MS / 1000 + deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&wlog_state.cond, &wlog_state.lock, &deadline);
+        if (wlog_state.len || wlog_state.dropped)
+            flush_wlog_locked();
+    }
+    return NULL;
+}
 
-    fclose(fp);
+/* at exit, possibly from a signal handler that interrupted write_log,
+ * so do not wait for the lock.
+ */
+void flush_wlog() {
+    bool locked = pthread_mutex_trylock(&wlog_state.lock) == 0;
+    fwrite(wlog_state.buf, 1, wlog_state.len, wlog_state.fp);
+    wlog_state.len = 0;
+    fflush(wlog_state.fp);
+    if (locked) pthread_mutex_unlock(&wlog_state.lock);
 }
 
-void display_user_state() {
+void start_wlog() {
+    pthread_t thread;
+    wlog_state.fp = fopen(log_file, "a");
+    if (wlog_state.fp == NULL) return;
+    if (pthread_create(&thread, NULL, wlog_flusher, NULL) != 0) {
+        fclose(wlog_state.fp);
+        wlog_state.fp = NULL;
+        return;
+    }
+    atexit(flush_wlog);
+}
+
+void format_user_state(char* s, size_t n) {
     assert(user_state <= (int)sizeof(user_state_s) / (int)sizeof(user_state_s[0]));
-    bottom_bar_output(-1, "name: %s  HP: %d  energy: %d  state: %s", user_name, user_hp, user_bullets, user_state_s[user_state]);
+    if (user_state == USER_STATE_BATTLE)
+        snprintf(s, n, "name: %s  HP: %d  energy: %d  pos: (%d, %d)  state: %s", user_name, user_hp, user_bullets, user_pos.x, user_pos.y, user_state_s[user_state]);
+    else
+        snprintf(s, n, "name: %s  HP: %d  energy: %d  state: %s", user_name, user_hp, user_bullets, user_state_s[user_state]);
+}
+
+void compose_user_state(frame_composer_t* fc) {
+    char s[sizeof(shown_state)];
+    format_user_state(s, sizeof(s));
+    if (strcmp(s, shown_state) == 0) return;
+    strcpy(shown_state, s);
+    compose_bottom_bar(fc, -1, s);
+}
+
+void display_user_state() {
+    lock_cursor();
+    shown_state[0] = 0;
+    fc_begin(&composer);
+    compose_user_state(&composer);
+    fc_end(&composer);
+    unlock_cursor();
 }
 
 void server_say(const char* message) {
@@ -713,10 +1074,27 @@ int cmd_admin(char* args) {
     return 0;
 }
 
+int cmd_loglevel(char* args) {
+    wlog("call func %s with args %s\n", __func__, args);
+    static const char* level_s[] = { "debug", "info", "off" };
+    if (args) {
+        int level = -1;
+        for (int i = 0; i < (int)(sizeof(level_s) / sizeof(level_s[0])); i++)
+            if (strcmp(args, level_s[i]) == 0) level = i;
+        if (level < 0) {
+            bottom_bar_output(0, "unknown log level '%s'", args);
+            return 0;
+        }
+        wlog_state.level = level;
+    }
+    bottom_bar_output(0, "log level: %s", level_s[wlog_state.level]);
+    return 0;
+}
+
 int cmd_help(char* args) {
     if (args) {
         if (strcmp(args, "--list") == 0) {
-            bottom_bar_output(0, "quit, help, ulist, invite, yell, tell, fuck, admin");
+            bottom_bar_output(0, "quit, help, ulist, invite, yell, tell, fuck, admin, loglevel");
         } else if (strcmp(args, "quit") == 0) {
             bottom_bar_output(0, "quit the game and return terminal");
         } else if (strcmp(args, "ulist") == 0) {
@@ -730,7 +1108,7 @@ int cmd_help(char* args) {
         } else if (strcmp(args, "fuck") == 0) {
             bottom_bar_output(0, "forced stop ALL client and server");
         } else if (strcmp(args, "admin") == 0) {
-            bottom_bar_output(0, "control client info (need args: <ban, energy(eng), hp, pos, setadmin>)");
+            bottom_bar_output(0, "control client info (need args: <ban, energy(eng), hp, pos, setadmin, prof>)");
         } else if (strcmp(args, "admin ban") == 0) {
             bottom_bar_output(0, "ban user by name (need args)");
         } else if (strcmp(args, "admin energy") == 0) {
@@ -743,6 +1121,10 @@ int cmd_help(char* args) {
             bottom_bar_output(0, "reset user pos by name (need 3 args)");
         } else if (strcmp(args, "admin setadmin") == 0) {
             bottom_bar_output(0, "reset user attribute(admin or not) by name (need 2 args)");
+        } else if (strcmp(args, "admin prof") == 0) {
+            bottom_bar_output(0, "tick times of a battle (args: [battle [phase|reset]]), all phases go to the server log");
+        } else if (strcmp(args, "loglevel") == 0) {
+            bottom_bar_output(0, "show or set what goes to runtime.log (args: debug, info, off)");
         } else {
             bottom_bar_output(0, "no help for '%s'", args);
         }
@@ -765,6 +1147,7 @@ static struct {
     /* ------------------- */
     {"help", cmd_help},
     {"admin", cmd_admin},
+    {"loglevel", cmd_loglevel},
 };
 
 #define NR_HANDLER ((int)sizeof(command_handler) / (int)sizeof(command_handler[0]))
@@ -793,6 +1176,8 @@ void flip_screen() {
     set_cursor(0, SCR_H);
     printf("\033[2J");
     set_cursor(0, 0);
+    clear_cells(front, 0, SCR_W);
+    shown_state[0] = 0;
     unlock_cursor();
 }
 
@@ -801,6 +1186,8 @@ void clear_screen() {
     set_cursor(0, SCR_H);
     printf("\033[2J");
     set_cursor(0, 0);
+    clear_cells(front, 0, SCR_W);
+    shown_state[0] = 0;
     unlock_cursor();
 }
 
@@ -878,7 +1265,7 @@ void draw_catalog(catalog_t* pcl) {
         printf("─");
     printf("┤");
 
-    for (int i = 0; i < USER_CNT; i++) {
+    for (int i = 0; i < CATALOG_ROWS; i++) {
         int j = 0;
         int ulen = strlen(pcl->records[i]);
         set_cursor(x, y + i + 3);
@@ -896,7 +1283,7 @@ void draw_catalog(catalog_t* pcl) {
         printf("│");
     }
 
-    set_cursor(x, y + USER_CNT + 3);
+    set_cursor(x, y + CATALOG_ROWS + 3);
     printf("└");
     for (int i = 0; i < w; i++)
         printf("─");
@@ -913,7 +1300,10 @@ void run_battle() {
     bottom_bar_output(0, "type <TAB> to enter command mode and invite more friends\n");
     echo_off();
     disable_buffer();
-    //memset(map, -1, sizeof(map));
+    lock_cursor();
+    clear_cells(back, 0, SCR_W);
+    unlock_cursor();
+    reset_prediction();
     while (user_state == USER_STATE_BATTLE) {
         int ch = fgetc(stdin);
         if (ch == 'q') {
@@ -921,7 +1311,6 @@ void run_battle() {
             user_state = USER_STATE_LOGIN;
             send_command(CLIENT_COMMAND_QUIT_BATTLE);
             send_command(CLIENT_COMMAND_FETCH_ALL_FRIENDS);
-            memset(map, 0, sizeof(map));
             break;
         } else if (ch == '\t' || ch == ':') {
             wlog("type <TAB> and enter command mode\n");
@@ -929,10 +1318,10 @@ void run_battle() {
         }
 
         switch (ch) {
-            case 'w': send_command(CLIENT_COMMAND_MOVE_UP); break;
-            case 's': send_command(CLIENT_COMMAND_MOVE_DOWN); break;
-            case 'a': send_command(CLIENT_COMMAND_MOVE_LEFT); break;
-            case 'd': send_command(CLIENT_COMMAND_MOVE_RIGHT); break;
+            case 'w': send_move(CLIENT_COMMAND_MOVE_UP); break;
+            case 's': send_move(CLIENT_COMMAND_MOVE_DOWN); break;
+            case 'a': send_move(CLIENT_COMMAND_MOVE_LEFT); break;
+            case 'd': send_move(CLIENT_COMMAND_MOVE_RIGHT); break;
             case 'k': send_command(CLIENT_COMMAND_FIRE_UP); break;
             case 'j': send_command(CLIENT_COMMAND_FIRE_DOWN); break;
             case 'h': send_command(CLIENT_COMMAND_FIRE_LEFT); break;
@@ -1192,9 +1581,9 @@ int serv_response_you_have_logined(server_message_t* psm) {
 
 int serv_response_all_users_info(server_message_t* psm) {
     int len = 0;
-    static char users[USERNAME_SIZE * USER_CNT];
+    static char users[(USERNAME_SIZE + 2) * MAX_LIST_USERS];
     wlog("call message handler %s\n", __func__);
-    for (int i = 0; i < USER_CNT; i++) {
+    for (int i = 0; i < psm->nr_all_users; i++) {
         int state = psm->all_users[i].user_state;
         if (state != USER_STATE_UNUSED
             && state != USER_STATE_NOT_LOGIN) {
@@ -1204,7 +1593,7 @@ int serv_response_all_users_info(server_message_t* psm) {
     if (len > (int)sizeof(users) - 1)
         eprintf("buffer overflow\n");
 
-    users[len - 2] = 0;
+    users[len >= 2 ? len - 2 : 0] = 0;
     wlog("server response user list: %s\n", users);
     bottom_bar_output(0, "online: %s", users);
     return 0;
@@ -1213,7 +1602,8 @@ int serv_response_all_users_info(server_message_t* psm) {
 int serv_response_all_friends_info(server_message_t* psm) {
     int j = 0;
     wlog("call message handler %s\n", __func__);
-    for (int i = 0; i < USER_CNT; i++) {
+    memset(friend_list.records, 0, sizeof(friend_list.records));
+    for (int i = 0; i < psm->nr_all_users && j < CATALOG_ROWS; i++) {
         int state = psm->all_users[i].user_state;
         if (state != USER_STATE_UNUSED
             && state != USER_STATE_NOT_LOGIN) {
@@ -1255,7 +1645,7 @@ int serv_response_invitation_sent(server_message_t* psm) {
 
 int serv_msg_friend_login(server_message_t* psm) {
     wlog("call message handler %s\n", __func__);
-    for (int i = 0; i < USER_CNT; i++) {
+    for (int i = 0; i < CATALOG_ROWS; i++) {
         if (friend_list.records[i][0] == 0) {
             strncpy(friend_list.records[i], psm->friend_name, USERNAME_SIZE - 1);
             break;
@@ -1269,7 +1659,7 @@ int serv_msg_friend_login(server_message_t* psm) {
 
 int serv_msg_friend_logout(server_message_t* psm) {
     wlog("call message handler %s\n", __func__);
-    for (int i = 0; i < USER_CNT; i++) {
+    for (int i = 0; i < CATALOG_ROWS; i++) {
         if (strncmp(friend_list.records[i], psm->friend_name, USERNAME_SIZE - 1) == 0) {
             friend_list.records[i][0] = 0;
             break;
@@ -1359,83 +1749,263 @@ void flip_old_items(server_message_t* psm) {
     //memcpy(&sm, psm, sizeof(server_message_t));
 }
 
-void draw_users(server_message_t* psm) {
-    lock_cursor();
-    for (int i = 0, x, y; i < USER_CNT; i++) {
-        x = psm->user_pos[i].x;
-        y = psm->user_pos[i].y;
-        if (!psm->user_color[i]) continue;
-        if (x >= BATTLE_W || y >= BATTLE_H) continue;
-        if (map[y][x] == MAP_ITEM_GRASS) {
-            set_cursor(x, y);
-            printf("%s", map_s[map[y][x]]);
-            continue;
-        }
-        map[y][x] = MAP_ITEM_USER;
+// map_s with the attributes taken out, they are kept in the cells
+const char* item_glyph(int item) {
+    if (item >= MAP_ITEM_END) return " ";
+    return item == MAP_ITEM_GRASS ? "█" : map_s[item];
+}
 
-        set_cursor(x, y);
-        if (i == psm->index)
-            printf("%sY%s", color_s[psm->user_color[i]], color_s[0]);
-        else
-            printf("%sA%s", color_s[psm->user_color[i]], color_s[0]);
+const char* item_sgr(int item, int color) {
+    if (item == MAP_ITEM_GRASS) return GRASS_SGR;
+    if (item == MAP_ITEM_MY_BULLET) return color_s[color];
+    return color_s[0];
+}
+
+/* the receive thread decodes battle messages into `latest` and the
+ * render thread draws from it, at most RENDER_HZ times a second. frames
+ * that arrive in between overwrite the slot and are never drawn, so a
+ * slow terminal does not hold up the socket.
+ */
+#define RENDER_HZ 60
+#define RENDER_LOG_EVERY 3000  // drawn frames between two counts in the log
+
+struct visible_user_t {
+    uint16_t index;
+    pos_t pos;  // relative to the view
+    uint8_t color;
+};
+
+struct battle_view_t {
+    bool new_frame, new_players;
+    uint8_t map[BATTLE_H][BATTLE_W];
+    pos_t view;  // arena position of the top left cell of `map`
+    pos_t me;    // predicted arena position of this player
+    bool me_known;
+    int arena_w, arena_h;
+    int index, color;
+    int nr_visible;
+    visible_user_t visible[MAX_BATTLE_PLAYERS];
+    int nr_users;
+    player_score_t users[MAX_BATTLE_PLAYERS];
+};
+
+/* moves are applied to `me` as soon as they are sent and kept until a
+ * frame reports them applied, or given up once they are so old that the
+ * server must have lost them. the position of a frame plus the moves
+ * it does not hold yet is the new prediction, so the server stays the
+ * authority and a wrong guess lasts one round trip at most.
+ */
+#define MAX_PENDING_MOVES 64
+// frames a move may go unreported before it is taken for lost
+#define PENDING_MOVE_FRAMES 25
+
+struct pending_move_t {
+    uint32_t seq;
+    int command;
+    uint32_t sent_at;  // frames received when it was sent
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    battle_view_t latest;
+    uint32_t received, drawn;  // frames
+    uint32_t input_seq;        // of the last move sent
+    pending_move_t pending[MAX_PENDING_MOVES];
+    int nr_pending;
+} render_slot = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// moves as the server does them, stopping at the edges of the arena
+void predict_move(battle_view_t* v, int command) {
+    switch (command) {
+        case CLIENT_COMMAND_MOVE_UP: if (v->me.y > 0) v->me.y--; break;
+        case CLIENT_COMMAND_MOVE_DOWN: if (v->me.y < v->arena_h - 1) v->me.y++; break;
+        case CLIENT_COMMAND_MOVE_LEFT: if (v->me.x > 0) v->me.x--; break;
+        case CLIENT_COMMAND_MOVE_RIGHT: if (v->me.x < v->arena_w - 1) v->me.x++; break;
     }
+}
 
-    fflush(stdout);
-    unlock_cursor();
+void reset_prediction() {
+    pthread_mutex_lock(&render_slot.lock);
+    render_slot.nr_pending = 0;
+    render_slot.latest.me_known = false;
+    pthread_mutex_unlock(&render_slot.lock);
 }
 
-void draw_items(server_message_t* psm) {
-    lock_cursor();
-    for (int i = 0, cur; i < BATTLE_H; i++) {
-        for (int j = 0; j < BATTLE_W; j += 2) {
-            cur = (int)psm->map[i][j >> 1] & 0x0F;
-            if (cur < MAP_ITEM_END) {
-                if (map[i][j] != cur) {
-                    map[i][j] = cur;
-                    set_cursor(j, i);
-                    if (cur == MAP_ITEM_MY_BULLET) printf("%s%s%s", color_s[psm->color], map_s[cur], color_s[0]);
-                    else printf("%s", map_s[cur]);
-                    if (map_s[cur] == NULL) exit(cur);
-                    //putchar(' ');
-                }
-            }
-            cur = (int)(psm->map[i][j >> 1] >> 4) & 0x0F;
-            if (cur < MAP_ITEM_END) {
-                if (map[i][j + 1] != cur) {
-                    map[i][j + 1] = cur;
-                    set_cursor(j + 1, i);
-                    if (cur == MAP_ITEM_MY_BULLET) printf("%s%s%s", color_s[psm->color], map_s[cur], color_s[0]);
-                    else printf("%s", map_s[cur]);
-                    if (map_s[cur] == NULL) exit(cur);
-                    //putchar(' ');
-                }
-            }
+void send_move(int command) {
+    client_message_t cm;
+    memset(&cm, 0, sizeof(client_message_t));
+    cm.command = command;
+
+    pthread_mutex_lock(&render_slot.lock);
+    cm.input_seq = ++render_slot.input_seq;
+    if (render_slot.nr_pending == MAX_PENDING_MOVES) {
+        render_slot.nr_pending--;
+        memmove(render_slot.pending, render_slot.pending + 1,
+                render_slot.nr_pending * sizeof(render_slot.pending[0]));
+    }
+    render_slot.pending[render_slot.nr_pending].seq = cm.input_seq;
+    render_slot.pending[render_slot.nr_pending].command = command;
+    render_slot.pending[render_slot.nr_pending].sent_at = render_slot.received;
+    render_slot.nr_pending++;
+    battle_view_t* v = &render_slot.latest;
+    if (v->me_known) {
+        predict_move(v, command);
+        user_pos = v->me;
+        v->new_frame = true;  // draw it now, not with the next frame
+        pthread_cond_signal(&render_slot.cond);
+    }
+    pthread_mutex_unlock(&render_slot.lock);
+
+    wrap_send(&cm);
+}
+
+void paint_items(uint8_t frame[BATTLE_H][BATTLE_W], int color) {
+    for (int i = 0; i < BATTLE_H; i++)
+        for (int j = 0; j < BATTLE_W; j++)
+            set_cell(&back[i][j], item_glyph(frame[i][j]), item_sgr(frame[i][j], color));
+}
+
+// players in the grass stay hidden, this one is drawn where it is predicted
+void paint_users(const battle_view_t* v) {
+    for (int i = 0, x, y; i < v->nr_visible; i++) {
+        x = v->visible[i].pos.x;
+        y = v->visible[i].pos.y;
+        if (v->visible[i].index == v->index && v->me_known) {
+            x = v->me.x - v->view.x;
+            y = v->me.y - v->view.y;
         }
+        if (x < 0 || x >= BATTLE_W || y < 0 || y >= BATTLE_H) continue;
+        if (back[y][x].sgr == GRASS_SGR) continue;
+        set_cell(&back[y][x], v->visible[i].index == v->index ? "Y" : "A",
+                 color_s[v->visible[i].color]);
     }
-    fflush(stdout);
-    unlock_cursor();
 }
 
-void draw_players(server_message_t* psm) {
-    lock_cursor();
-    for (int i = 0; i < BATTLE_H; i++) {
-        set_cursor(BATTLE_W, i);
-        for (int j = 0; j < SCR_W - BATTLE_W; j++) {
-            putchar(' ');
+void paint_players(const battle_view_t* v) {
+    char s[64];
+    clear_cells(back, BATTLE_W, SCR_W);
+    put_cells(BATTLE_W, 0, color_s[0], "players:        K/D");
+    for (int i = 0, p = 0; i < v->nr_users && p < BATTLE_H - 1; i++) {
+        if (v->users[i].namecolor != 0) {
+            ++p;
+            put_cells(BATTLE_W, p, color_s[v->users[i].namecolor], v->users[i].name);
+            snprintf(s, sizeof(s), "(%d)", v->users[i].life);
+            put_cells(BATTLE_W + strlen(v->users[i].name), p, color_s[0], s);
+            snprintf(s, sizeof(s), "%2d★ %d/%d", v->users[i].score, v->users[i].kill, v->users[i].death);
+            put_cells(BATTLE_W + 12, p, color_s[0], s);
         }
     }
-    set_cursor(BATTLE_W, 0);
-    printf("players:        K/D");
-    for (int i = 0, p = 0; i < USER_CNT; i++) {
-        if (psm->users[i].namecolor != 0) {
-            set_cursor(BATTLE_W, ++p);
-            printf("%s%s%s(%d)", color_s[psm->users[i].namecolor], psm->users[i].name, color_s[0], psm->users[i].life);
-            set_cursor(BATTLE_W + 12, p);
-            printf("%2d★ %d/%d", psm->users[i].score, psm->users[i].kill, psm->users[i].death);
+}
+
+void publish_frame(uint8_t frame[BATTLE_H][BATTLE_W], const server_message_t* psm) {
+    pthread_mutex_lock(&render_slot.lock);
+    battle_view_t* v = &render_slot.latest;
+    memcpy(v->map, frame, sizeof(v->map));
+    v->view = psm->view;
+    v->arena_w = psm->arena_w;
+    v->arena_h = psm->arena_h;
+    v->index = psm->index;
+    v->color = psm->color;
+    v->nr_visible = psm->nr_visible;
+    bool found = false;
+    for (int i = 0; i < psm->nr_visible; i++) {
+        v->visible[i].index = psm->visible[i].index;
+        v->visible[i].pos = psm->visible[i].pos;
+        v->visible[i].color = psm->visible[i].color;
+        if (psm->visible[i].index != psm->index) continue;
+        v->me.x = psm->view.x + psm->visible[i].pos.x;
+        v->me.y = psm->view.y + psm->visible[i].pos.y;
+        found = v->me_known = true;
+    }
+
+    // reconcile, replay on the reported position what it does not hold yet
+    int acked = 0;
+    while (acked < render_slot.nr_pending
+           && ((int32_t)(render_slot.pending[acked].seq - psm->input_seq) <= 0
+               || render_slot.received - render_slot.pending[acked].sent_at > PENDING_MOVE_FRAMES))
+        acked++;
+    render_slot.nr_pending -= acked;
+    memmove(render_slot.pending, render_slot.pending + acked,
+            render_slot.nr_pending * sizeof(render_slot.pending[0]));
+    for (int i = 0; found && i < render_slot.nr_pending; i++)
+        predict_move(v, render_slot.pending[i].command);
+    user_pos = v->me;
+    v->new_frame = true;
+    render_slot.received++;
+    pthread_cond_signal(&render_slot.cond);
+    pthread_mutex_unlock(&render_slot.lock);
+}
+
+void publish_players(const server_message_t* psm) {
+    pthread_mutex_lock(&render_slot.lock);
+    battle_view_t* v = &render_slot.latest;
+    v->nr_users = psm->nr_users;
+    memcpy(v->users, psm->users, psm->nr_users * sizeof(v->users[0]));
+    v->new_players = true;
+    pthread_cond_signal(&render_slot.cond);
+    pthread_mutex_unlock(&render_slot.lock);
+}
+
+void* render_loop(void* args) {
+    static battle_view_t view;
+    const long interval = 1000000000L / RENDER_HZ;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    wlog("render thread starts\n");
+    while (1) {
+        pthread_mutex_lock(&render_slot.lock);
+        while (!render_slot.latest.new_frame && !render_slot.latest.new_players)
+            pthread_cond_wait(&render_slot.cond, &render_slot.lock);
+        battle_view_t* v = &render_slot.latest;
+        view.new_frame = v->new_frame;
+        view.new_players = v->new_players;
+        if (v->new_frame) {
+            memcpy(view.map, v->map, sizeof(view.map));
+            view.view = v->view;
+            view.me = v->me;
+            view.me_known = v->me_known;
+            view.index = v->index;
+            view.color = v->color;
+            view.nr_visible = v->nr_visible;
+            memcpy(view.visible, v->visible, v->nr_visible * sizeof(v->visible[0]));
+            render_slot.drawn++;
+        }
+        if (v->new_players) {
+            view.nr_users = v->nr_users;
+            memcpy(view.users, v->users, v->nr_users * sizeof(v->users[0]));
         }
+        v->new_frame = v->new_players = false;
+        if (view.new_frame && render_slot.drawn % RENDER_LOG_EVERY == 0)
+            wlogi("render drew %u of %u frames\n", render_slot.drawn, render_slot.received);
+        pthread_mutex_unlock(&render_slot.lock);
+
+        lock_cursor();
+        if (user_state == USER_STATE_BATTLE) {
+            if (view.new_frame) {
+                paint_items(view.map, view.color);
+                paint_users(&view);
+            }
+            if (view.new_players)
+                paint_players(&view);
+            fc_begin(&composer);
+            compose_cells(&composer);
+            compose_user_state(&composer);
+            fc_end(&composer);
+        }
+        unlock_cursor();
+
+        // the next frame waits for its turn, whatever came meanwhile is skipped
+        next.tv_nsec += interval;
+        if (next.tv_nsec >= 1000000000L) next.tv_sec++, next.tv_nsec -= 1000000000L;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec))
+            next = now;
+        else
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
     }
-    fflush(stdout);
-    unlock_cursor();
+    return NULL;
 }
 
 void log_psm_info(server_message_t* psm) {
@@ -1444,8 +2014,8 @@ void log_psm_info(server_message_t* psm) {
     char* p = s;
     len += sprintf(p + len, "message: %d, life:%d, user_index:%d\n", psm->message, psm->life, psm->index);
     len += sprintf(p + len, "user_pos:");
-    for (int i = 0; i < USER_CNT; i++) {
-        len += sprintf(p + len, "(%d,%d), ", psm->user_pos[i].x, psm->user_pos[i].y);
+    for (int i = 0; i < psm->nr_visible; i++) {
+        len += sprintf(p + len, "(%d,%d), ", psm->visible[i].pos.x, psm->visible[i].pos.y);
     }
 
     len += sprintf(p + len, "\n");
@@ -1463,15 +2033,28 @@ void log_psm_info(server_message_t* psm) {
     wlog("battle info:\n%s\n", s);
 }
 
+void ack_frame(uint32_t seq) {
+    client_message_t cm;
+    memset(&cm, 0, sizeof(client_message_t));
+    cm.command = CLIENT_COMMAND_ACK_FRAME;
+    cm.frame_seq = seq;
+    wrap_send(&cm);
+}
+
 int serv_msg_battle_info(server_message_t* psm) {
     wlog("call message handler %s\n", __func__);
     if (user_state == USER_STATE_BATTLE) {
         //log_psm_info(psm);
+        uint8_t (*frame)[BATTLE_W] = apply_battle_frame(&frames, psm);
+        if (frame == NULL) {
+            wlog("lost base frame %u, ask for keyframe\n", psm->base_seq);
+            ack_frame(0);
+            return 0;
+        }
+        ack_frame(psm->frame_seq);
         user_bullets = psm->bullets_num;
         user_hp = psm->life;
-        draw_items(psm);
-        draw_users(psm);
-        display_user_state();
+        publish_frame(frame, psm);
     }
     return 0;
 }
@@ -1479,7 +2062,7 @@ int serv_msg_battle_info(server_message_t* psm) {
 int serv_msg_battle_player(server_message_t* psm) {
     wlog("call message handler %s\n", __func__);
     if (user_state == USER_STATE_BATTLE) {
-        draw_players(psm);
+        publish_players(psm);
     }
     return 0;
 }
@@ -1567,6 +2150,13 @@ void start_message_monitor() {
     }
 }
 
+void start_renderer() {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, render_loop, NULL) != 0) {
+        eprintf("fail to start renderer.\n");
+    }
+}
+
 void terminate(int signum) {
     unlock_cursor();
     set_cursor(0, 0);
@@ -1585,6 +2175,7 @@ int main(int argc, char* argv[]) {
     if (access(log_file, F_OK) == 0) {
         remove(log_file);
     }
+    start_wlog();
     if (argc >= 2) {
         server_addr = (char*)malloc(IPADDR_SIZE);
         strcpy(server_addr, argv[1]);
@@ -1622,6 +2213,7 @@ int main(int argc, char* argv[]) {
     flip_screen();
 
     start_message_monitor();
+    start_renderer();
     start_ui();
 
     resume_and_exit(0);
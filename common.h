@@ -36,30 +36,7 @@ const char* version = (char*)"v2.8.5";
 #define VT100_COLOR_NORMAL   "38"
 
 
-#define log(fmt, ...) \
-    fprintf(stderr, \
-    "\033[" VT100_STYLE_NORMAL ";" VT100_COLOR_BLUE "m[LOG] \033[0m" \
-    "\033[" VT100_STYLE_DARK ";" VT100_COLOR_NORMAL "m%s:%d: \033[0m" \
-    fmt "\n", __func__, __LINE__, ## __VA_ARGS__)
-
-#define logw(fmt, ...) \
-    fprintf(stderr, \
-    "\033[" VT100_STYLE_NORMAL ";" VT100_COLOR_YELLOW "m[WARN] \033[0m" \
-    "\033[" VT100_STYLE_DARK ";" VT100_COLOR_NORMAL "m%s:%d: \033[0m" \
-    fmt "\n", __func__, __LINE__, ## __VA_ARGS__)
-
-#define loge(fmt, ...) \
-    fprintf(stderr, \
-    "\033[" VT100_STYLE_NORMAL ";" VT100_COLOR_RED "m[ERROR] \033[0m" \
-    "\033[" VT100_STYLE_DARK ";" VT100_COLOR_NORMAL "m%s:%d: \033[0m" \
-    fmt "\n", __func__, __LINE__, ## __VA_ARGS__)
-
-// inner log
-#define logi(fmt, ...) \
-    fprintf(stderr, \
-    "\033[" VT100_STYLE_NORMAL ";" VT100_COLOR_BLUE "m[LOG] \033[0m" \
-    "\033[" VT100_STYLE_DARK ";" VT100_COLOR_NORMAL "m%s:%d: \033[0m" \
-    "==> " fmt "\n", __func__, __LINE__, ## __VA_ARGS__)
+#include "logger.h"
 
 #define eprintf(...) do { \
     loge(__VA_ARGS__); \
@@ -77,10 +54,33 @@ const char* version = (char*)"v2.8.5";
 
 
 struct pos_t {
+    uint16_t x;
+    uint16_t y;
+};
+
+/* battle frames are delta encoded: the server renders the BATTLE_W x
+ * BATTLE_H window of the arena around every player (its top left cell
+ * is `view`), then sends only the cells which differ from the last
+ * frame that player acknowledged (`base_seq`). both ends keep the last
+ * FRAME_HISTORY frames, so any acknowledged frame can serve as a base.
+ * a frame with `base_seq == 0` is a keyframe and carries the packed map.
+ */
+#define FRAME_HISTORY 32
+#define KEYFRAME_INTERVAL 100
+
+struct cell_delta_t {
     uint8_t x;
-    uint8_t y; 
+    uint8_t y;
+    uint8_t item;
 };
 
+#define MAX_DELTA_CELLS ((BATTLE_H * (BATTLE_W / 2 + 1)) / (int)sizeof(cell_delta_t))
+
+typedef struct frame_history_t {
+    uint32_t seq[FRAME_HISTORY];
+    uint8_t map[FRAME_HISTORY][BATTLE_H][BATTLE_W];
+} frame_history_t;
+
 // format of messages sended from client to server
 typedef struct client_message_t {
     uint8_t command;
@@ -89,9 +89,27 @@ typedef struct client_message_t {
     {
         char message[MSG_SIZE];
         char password[PASSWORD_SIZE];
+        uint32_t frame_seq;
+        uint32_t input_seq;  // of a move, echoed back once the server applied it
     };
 } client_message_t;
 
+/* lists in a message only hold who is present, the counts say how many
+ * entries are valid. a battle can not have more than MAX_BATTLE_PLAYERS
+ * players, a user list stops at MAX_LIST_USERS.
+ */
+#define MAX_BATTLE_PLAYERS 256
+#define MAX_LIST_USERS 256
+
+struct player_score_t {
+    char name[USERNAME_SIZE];
+    uint8_t namecolor;
+    uint8_t kill;
+    uint8_t death;
+    uint8_t score;
+    uint16_t life;
+};
+
 // format of messages sended from server to client
 typedef struct server_message_t {
     union {
@@ -104,27 +122,38 @@ typedef struct server_message_t {
         char friend_name[USERNAME_SIZE];
 
         struct {
-            char user_name[USERNAME_SIZE];
-            uint8_t user_state;
-        } all_users[USER_CNT];
+            uint16_t nr_all_users;
+            struct {
+                char user_name[USERNAME_SIZE];
+                uint8_t user_state;
+            } all_users[MAX_LIST_USERS];
+        };
 
         struct {
             uint16_t life, index, bullets_num, color;
-            pos_t user_pos[USER_CNT];
-            uint8_t user_color[USER_CNT];
-            uint8_t map[BATTLE_H][BATTLE_W / 2 + 1];
+            pos_t view;  // arena position of the top left cell of `map`
+            uint16_t arena_w, arena_h;
+            uint16_t nr_visible;
+            struct {
+                uint16_t index;  // slot of the player in the battle
+                pos_t pos;       // relative to `view`
+                uint8_t color;
+            } visible[MAX_BATTLE_PLAYERS];
+            uint32_t frame_seq, base_seq;
+            uint32_t input_seq;  // last move of the receiver this frame includes
+            uint16_t nr_cells;
+            union {
+                uint8_t map[BATTLE_H][BATTLE_W / 2 + 1];  // keyframe
+                cell_delta_t cells[MAX_DELTA_CELLS];      // delta frame
+            };
             //pos_t item_pos[MAX_ITEM];
             //uint8_t item_kind[MAX_ITEM];
         };
 
         struct {
-            char name[USERNAME_SIZE];
-            uint8_t namecolor;
-            uint8_t kill;
-            uint8_t death;
-            uint8_t score;
-            uint16_t life;
-        } users[USER_CNT];
+            uint16_t nr_users;
+            player_score_t users[MAX_BATTLE_PLAYERS];
+        };
 
         struct {
             char from_user[USERNAME_SIZE];
@@ -167,6 +196,7 @@ enum {
     CLIENT_COMMAND_ADMIN_CONTROL,
     CLIENT_COMMAND_PUT_LANDMINE,
     CLIENT_COMMAND_MELEE,
+    CLIENT_COMMAND_ACK_FRAME,
     CLIENT_COMMAND_END,
 };
 
@@ -215,6 +245,454 @@ enum {
     SERVER_MESSAGE_YOUR_MAGAZINE_IS_EMPTY,
 };
 
+uint8_t (*frame_history_find(frame_history_t* fh, uint32_t seq))[BATTLE_W] {
+    int i = seq % FRAME_HISTORY;
+    if (seq == 0 || fh->seq[i] != seq) return NULL;
+    return fh->map[i];
+}
+
+uint8_t (*frame_history_store(frame_history_t* fh, uint32_t seq))[BATTLE_W] {
+    int i = seq % FRAME_HISTORY;
+    fh->seq[i] = seq;
+    return fh->map[i];
+}
+
+/* rebuild the full map of a received battle frame and remember it as a
+ * base for later frames. returns NULL if the base is gone, the caller
+ * should then acknowledge frame 0 to ask for a keyframe.
+ */
+uint8_t (*apply_battle_frame(frame_history_t* fh, const server_message_t* psm))[BATTLE_W] {
+    uint8_t (*map)[BATTLE_W];
+    if (psm->base_seq == 0) {
+        map = frame_history_store(fh, psm->frame_seq);
+        for (int i = 0; i < BATTLE_H; i++) {
+            for (int j = 0; j < BATTLE_W; j += 2) {
+                map[i][j] = psm->map[i][j >> 1] & 0x0F;
+                map[i][j + 1] = (psm->map[i][j >> 1] >> 4) & 0x0F;
+            }
+        }
+        return map;
+    }
+
+    uint8_t (*base)[BATTLE_W] = frame_history_find(fh, psm->base_seq);
+    if (base == NULL || psm->nr_cells > MAX_DELTA_CELLS) return NULL;
+    map = frame_history_store(fh, psm->frame_seq);
+    if (map != base) memcpy(map, base, sizeof(fh->map[0]));
+    for (int i = 0; i < psm->nr_cells; i++) {
+        const cell_delta_t* cell = &psm->cells[i];
+        if (cell->x >= BATTLE_W || cell->y >= BATTLE_H) continue;
+        map[cell->y][cell->x] = cell->item;
+    }
+    return map;
+}
+
+/* wire format: every message travels as a length prefixed frame
+ *
+ *     [u16 length][u8 type][payload]
+ *
+ * `length` counts the type byte and the payload, integers are big endian
+ * and strings go as [u8 length][bytes]. the payload layout is picked by
+ * the type (see client_payload_kind and server_payload_kind), so a plain
+ * event costs three bytes instead of a whole message struct. decoders
+ * fill the usual message structs, handlers never see the wire layout.
+ */
+#define FRAME_HEADER_SIZE 3
+#define MAX_FRAME_SIZE    8192
+
+enum {
+    PAYLOAD_NONE,
+    PAYLOAD_NAME,        // user name
+    PAYLOAD_TEXT,        // message text
+    PAYLOAD_CHAT,        // user name, message text
+    PAYLOAD_CREDENTIAL,  // user name, password
+    PAYLOAD_FRAME_SEQ,   // acknowledged battle frame
+    PAYLOAD_INPUT_SEQ,   // sequence number of a move
+    PAYLOAD_USER_LIST,   // [u16 count]{name, state}
+    PAYLOAD_BATTLE,      // battle frame, see encode_battle_payload
+    PAYLOAD_PLAYERS,     // [u16 count]{name, color, kill, death, score, life}
+};
+
+// keyframe carried as a cell list against an empty map
+#define BATTLE_FRAME_SPARSE 0x01
+
+typedef struct wire_t {
+    uint8_t* p;
+    uint8_t* end;
+    bool error;  // set on overflow, the frame is then dropped
+} wire_t;
+
+int client_payload_kind(int command) {
+    switch (command) {
+        case CLIENT_COMMAND_USER_REGISTER:
+        case CLIENT_COMMAND_USER_LOGIN:
+            return PAYLOAD_CREDENTIAL;
+        case CLIENT_COMMAND_LAUNCH_BATTLE:
+        case CLIENT_COMMAND_INVITE_USER:
+            return PAYLOAD_NAME;
+        case CLIENT_COMMAND_SEND_MESSAGE:
+        case CLIENT_COMMAND_ADMIN_CONTROL:
+            return PAYLOAD_CHAT;
+        case CLIENT_COMMAND_ACK_FRAME:
+            return PAYLOAD_FRAME_SEQ;
+        case CLIENT_COMMAND_MOVE_UP:
+        case CLIENT_COMMAND_MOVE_DOWN:
+        case CLIENT_COMMAND_MOVE_LEFT:
+        case CLIENT_COMMAND_MOVE_RIGHT:
+            return PAYLOAD_INPUT_SEQ;
+    }
+    return PAYLOAD_NONE;
+}
+
+int server_payload_kind(int message) {
+    switch (message) {
+        case SERVER_MESSAGE_FRIEND_LOGIN:
+        case SERVER_MESSAGE_FRIEND_LOGOUT:
+        case SERVER_MESSAGE_FRIEND_ACCEPT_BATTLE:
+        case SERVER_MESSAGE_FRIEND_REJECT_BATTLE:
+        case SERVER_MESSAGE_FRIEND_NOT_LOGIN:
+        case SERVER_MESSAGE_FRIEND_ALREADY_IN_BATTLE:
+        case SERVER_MESSAGE_INVITE_TO_BATTLE:
+        case SERVER_MESSAGE_USER_QUIT_BATTLE:
+            return PAYLOAD_NAME;
+        case SERVER_RESPONSE_LOGIN_SUCCESS:
+        case SERVER_MESSAGE:
+        case SERVER_STATUS_QUIT:
+            return PAYLOAD_TEXT;
+        case SERVER_MESSAGE_FRIEND_MESSAGE:
+            return PAYLOAD_CHAT;
+        case SERVER_RESPONSE_ALL_USERS_INFO:
+        case SERVER_RESPONSE_ALL_FRIENDS_INFO:
+            return PAYLOAD_USER_LIST;
+        case SERVER_MESSAGE_BATTLE_INFORMATION:
+            return PAYLOAD_BATTLE;
+        case SERVER_MESSAGE_BATTLE_PLAYER:
+            return PAYLOAD_PLAYERS;
+    }
+    return PAYLOAD_NONE;
+}
+
+void wire_put8(wire_t* w, uint32_t v) {
+    if (w->end - w->p < 1) { w->error = true; return; }
+    *w->p++ = v;
+}
+
+void wire_put16(wire_t* w, uint32_t v) {
+    wire_put8(w, v >> 8);
+    wire_put8(w, v);
+}
+
+void wire_put32(wire_t* w, uint32_t v) {
+    wire_put16(w, v >> 16);
+    wire_put16(w, v);
+}
+
+void wire_put_str(wire_t* w, const char* s, size_t size) {
+    size_t len = strnlen(s, size - 1);
+    wire_put8(w, len);
+    if ((size_t)(w->end - w->p) < len) { w->error = true; return; }
+    memcpy(w->p, s, len);
+    w->p += len;
+}
+
+uint32_t wire_get8(wire_t* w) {
+    if (w->end - w->p < 1) { w->error = true; return 0; }
+    return *w->p++;
+}
+
+uint32_t wire_get16(wire_t* w) {
+    uint32_t v = wire_get8(w) << 8;
+    return v | wire_get8(w);
+}
+
+uint32_t wire_get32(wire_t* w) {
+    uint32_t v = wire_get16(w) << 16;
+    return v | wire_get16(w);
+}
+
+// `s` must hold `size` bytes, the result is always terminated
+void wire_get_str(wire_t* w, char* s, size_t size) {
+    size_t len = wire_get8(w);
+    if ((size_t)(w->end - w->p) < len) { w->error = true; len = 0; }
+    size_t n = len < size - 1 ? len : size - 1;
+    memcpy(s, w->p, n);
+    s[n] = '\0';
+    w->p += len;
+}
+
+/* battle payload:
+ *
+ *     life, index, bullets_num, color       u16 each
+ *     view x, y, arena w, h                 u16 each
+ *     [u16 count]{u16 index, x, y, color}   visible players
+ *     frame_seq, base_seq, input_seq        u32 each
+ *     keyframe: [u8 flags] then the packed map, or with
+ *               BATTLE_FRAME_SPARSE [u16 count]{x, y, item} of the
+ *               non-empty cells
+ *     delta:    [u16 count]{x, y, item}
+ */
+void encode_battle_payload(wire_t* w, const server_message_t* psm) {
+    wire_put16(w, psm->life);
+    wire_put16(w, psm->index);
+    wire_put16(w, psm->bullets_num);
+    wire_put16(w, psm->color);
+    wire_put16(w, psm->view.x);
+    wire_put16(w, psm->view.y);
+    wire_put16(w, psm->arena_w);
+    wire_put16(w, psm->arena_h);
+
+    wire_put16(w, psm->nr_visible);
+    for (int i = 0; i < psm->nr_visible; i++) {
+        wire_put16(w, psm->visible[i].index);
+        wire_put8(w, psm->visible[i].pos.x);
+        wire_put8(w, psm->visible[i].pos.y);
+        wire_put8(w, psm->visible[i].color);
+    }
+
+    wire_put32(w, psm->frame_seq);
+    wire_put32(w, psm->base_seq);
+    wire_put32(w, psm->input_seq);
+    if (psm->base_seq) {
+        wire_put16(w, psm->nr_cells);
+        for (int i = 0; i < psm->nr_cells; i++) {
+            wire_put8(w, psm->cells[i].x);
+            wire_put8(w, psm->cells[i].y);
+            wire_put8(w, psm->cells[i].item);
+        }
+        return;
+    }
+
+    // most of the arena is empty, a cell list is usually far shorter
+    int nr_cells = 0;
+    for (int i = 0; i < BATTLE_H; i++)
+        for (int j = 0; j < BATTLE_W; j++)
+            if ((psm->map[i][j >> 1] >> ((j & 1) << 2)) & 0x0F) nr_cells++;
+    if (nr_cells * (int)sizeof(cell_delta_t) >= (int)sizeof(psm->map)) {
+        wire_put8(w, 0);
+        for (int i = 0; i < BATTLE_H; i++)
+            for (int j = 0; j < BATTLE_W / 2 + 1; j++)
+                wire_put8(w, psm->map[i][j]);
+        return;
+    }
+    wire_put8(w, BATTLE_FRAME_SPARSE);
+    wire_put16(w, nr_cells);
+    for (int i = 0; i < BATTLE_H; i++) {
+        for (int j = 0; j < BATTLE_W; j++) {
+            uint8_t item = (psm->map[i][j >> 1] >> ((j & 1) << 2)) & 0x0F;
+            if (!item) continue;
+            wire_put8(w, j);
+            wire_put8(w, i);
+            wire_put8(w, item);
+        }
+    }
+}
+
+void decode_battle_payload(wire_t* w, server_message_t* psm) {
+    psm->life = wire_get16(w);
+    psm->index = wire_get16(w);
+    psm->bullets_num = wire_get16(w);
+    psm->color = wire_get16(w);
+    psm->view.x = wire_get16(w);
+    psm->view.y = wire_get16(w);
+    psm->arena_w = wire_get16(w);
+    psm->arena_h = wire_get16(w);
+
+    psm->nr_visible = wire_get16(w);
+    if (psm->nr_visible > MAX_BATTLE_PLAYERS) { w->error = true; return; }
+    for (int i = 0; i < psm->nr_visible; i++) {
+        psm->visible[i].index = wire_get16(w);
+        psm->visible[i].pos.x = wire_get8(w);
+        psm->visible[i].pos.y = wire_get8(w);
+        psm->visible[i].color = wire_get8(w);
+    }
+
+    psm->frame_seq = wire_get32(w);
+    psm->base_seq = wire_get32(w);
+    psm->input_seq = wire_get32(w);
+    if (psm->base_seq) {
+        psm->nr_cells = wire_get16(w);
+        if (psm->nr_cells > MAX_DELTA_CELLS) { w->error = true; return; }
+        for (int i = 0; i < psm->nr_cells; i++) {
+            psm->cells[i].x = wire_get8(w);
+            psm->cells[i].y = wire_get8(w);
+            psm->cells[i].item = wire_get8(w);
+        }
+        return;
+    }
+
+    if (!(wire_get8(w) & BATTLE_FRAME_SPARSE)) {
+        for (int i = 0; i < BATTLE_H; i++)
+            for (int j = 0; j < BATTLE_W / 2 + 1; j++)
+                psm->map[i][j] = wire_get8(w);
+        return;
+    }
+    int nr_cells = wire_get16(w);
+    for (int i = 0; i < nr_cells && !w->error; i++) {
+        int x = wire_get8(w), y = wire_get8(w), item = wire_get8(w) & 0x0F;
+        if (x >= BATTLE_W || y >= BATTLE_H) continue;
+        psm->map[y][x >> 1] |= item << ((x & 1) << 2);
+    }
+}
+
+/* encode a message into `buf` which holds at least MAX_FRAME_SIZE bytes,
+ * returns the size of the whole frame or 0 if it does not fit.
+ */
+size_t encode_client_message(const client_message_t* pcm, uint8_t* buf) {
+    wire_t w = { buf + FRAME_HEADER_SIZE, buf + MAX_FRAME_SIZE, false };
+    switch (client_payload_kind(pcm->command)) {
+        case PAYLOAD_NAME:
+            wire_put_str(&w, pcm->user_name, USERNAME_SIZE);
+            break;
+        case PAYLOAD_CHAT:
+            wire_put_str(&w, pcm->user_name, USERNAME_SIZE);
+            wire_put_str(&w, pcm->message, MSG_SIZE);
+            break;
+        case PAYLOAD_CREDENTIAL:
+            wire_put_str(&w, pcm->user_name, USERNAME_SIZE);
+            wire_put_str(&w, pcm->password, PASSWORD_SIZE);
+            break;
+        case PAYLOAD_FRAME_SEQ:
+            wire_put32(&w, pcm->frame_seq);
+            break;
+        case PAYLOAD_INPUT_SEQ:
+            wire_put32(&w, pcm->input_seq);
+            break;
+    }
+    if (w.error) return 0;
+
+    size_t len = w.p - buf;
+    buf[0] = (len - 2) >> 8;
+    buf[1] = (len - 2);
+    buf[2] = pcm->command;
+    return len;
+}
+
+size_t encode_server_message(const server_message_t* psm, uint8_t* buf) {
+    wire_t w = { buf + FRAME_HEADER_SIZE, buf + MAX_FRAME_SIZE, false };
+    switch (server_payload_kind(psm->message)) {
+        case PAYLOAD_NAME:
+            wire_put_str(&w, psm->friend_name, USERNAME_SIZE);
+            break;
+        case PAYLOAD_TEXT:
+            wire_put_str(&w, psm->msg, MSG_SIZE);
+            break;
+        case PAYLOAD_CHAT:
+            wire_put_str(&w, psm->from_user, USERNAME_SIZE);
+            wire_put_str(&w, psm->msg, MSG_SIZE);
+            break;
+        case PAYLOAD_USER_LIST: {
+            wire_put16(&w, psm->nr_all_users);
+            for (int i = 0; i < psm->nr_all_users; i++) {
+                wire_put_str(&w, psm->all_users[i].user_name, USERNAME_SIZE);
+                wire_put8(&w, psm->all_users[i].user_state);
+            }
+            break;
+        }
+        case PAYLOAD_BATTLE:
+            encode_battle_payload(&w, psm);
+            break;
+        case PAYLOAD_PLAYERS: {
+            wire_put16(&w, psm->nr_users);
+            for (int i = 0; i < psm->nr_users; i++) {
+                wire_put_str(&w, psm->users[i].name, USERNAME_SIZE);
+                wire_put8(&w, psm->users[i].namecolor);
+                wire_put8(&w, psm->users[i].kill);
+                wire_put8(&w, psm->users[i].death);
+                wire_put8(&w, psm->users[i].score);
+                wire_put16(&w, psm->users[i].life);
+            }
+            break;
+        }
+    }
+    if (w.error) return 0;
+
+    size_t len = w.p - buf;
+    buf[0] = (len - 2) >> 8;
+    buf[1] = (len - 2);
+    buf[2] = psm->message;
+    return len;
+}
+
+/* returns the size of the frame at the head of `buf`, or 0 if `len` bytes
+ * do not hold a whole frame yet. a malformed length gives -1.
+ */
+int frame_size(const uint8_t* buf, size_t len) {
+    if (len < 2) return 0;
+    size_t size = 2 + ((buf[0] << 8) | buf[1]);
+    if (size < FRAME_HEADER_SIZE || size > MAX_FRAME_SIZE) return -1;
+    return len < size ? 0 : size;
+}
+
+// decode a whole frame, returns false if the payload is malformed
+bool decode_client_message(const uint8_t* buf, size_t len, client_message_t* pcm) {
+    wire_t w = { (uint8_t*)buf + FRAME_HEADER_SIZE, (uint8_t*)buf + len, false };
+    memset(pcm, 0, sizeof(client_message_t));
+    pcm->command = buf[2];
+    switch (client_payload_kind(pcm->command)) {
+        case PAYLOAD_NAME:
+            wire_get_str(&w, pcm->user_name, USERNAME_SIZE);
+            break;
+        case PAYLOAD_CHAT:
+            wire_get_str(&w, pcm->user_name, USERNAME_SIZE);
+            wire_get_str(&w, pcm->message, MSG_SIZE);
+            break;
+        case PAYLOAD_CREDENTIAL:
+            wire_get_str(&w, pcm->user_name, USERNAME_SIZE);
+            wire_get_str(&w, pcm->password, PASSWORD_SIZE);
+            break;
+        case PAYLOAD_FRAME_SEQ:
+            pcm->frame_seq = wire_get32(&w);
+            break;
+        case PAYLOAD_INPUT_SEQ:
+            pcm->input_seq = wire_get32(&w);
+            break;
+    }
+    return !w.error;
+}
+
+bool decode_server_message(const uint8_t* buf, size_t len, server_message_t* psm) {
+    wire_t w = { (uint8_t*)buf + FRAME_HEADER_SIZE, (uint8_t*)buf + len, false };
+    memset(psm, 0, sizeof(server_message_t));
+    psm->message = buf[2];
+    switch (server_payload_kind(psm->message)) {
+        case PAYLOAD_NAME:
+            wire_get_str(&w, psm->friend_name, USERNAME_SIZE);
+            break;
+        case PAYLOAD_TEXT:
+            wire_get_str(&w, psm->msg, MSG_SIZE);
+            break;
+        case PAYLOAD_CHAT:
+            wire_get_str(&w, psm->from_user, USERNAME_SIZE);
+            wire_get_str(&w, psm->msg, MSG_SIZE);
+            break;
+        case PAYLOAD_USER_LIST: {
+            psm->nr_all_users = wire_get16(&w);
+            if (psm->nr_all_users > MAX_LIST_USERS) return false;
+            for (int i = 0; i < psm->nr_all_users; i++) {
+                wire_get_str(&w, psm->all_users[i].user_name, USERNAME_SIZE);
+                psm->all_users[i].user_state = wire_get8(&w);
+            }
+            break;
+        }
+        case PAYLOAD_BATTLE:
+            decode_battle_payload(&w, psm);
+            break;
+        case PAYLOAD_PLAYERS: {
+            psm->nr_users = wire_get16(&w);
+            if (psm->nr_users > MAX_BATTLE_PLAYERS) return false;
+            for (int i = 0; i < psm->nr_users; i++) {
+                wire_get_str(&w, psm->users[i].name, USERNAME_SIZE);
+                psm->users[i].namecolor = wire_get8(&w);
+                psm->users[i].kill = wire_get8(&w);
+                psm->users[i].death = wire_get8(&w);
+                psm->users[i].score = wire_get8(&w);
+                psm->users[i].life = wire_get16(&w);
+            }
+            break;
+        }
+    }
+    return !w.error;
+}
+
 /* some special characters(terminal graph):
  *
  *  ▁ ▂ ▃ ▄ ▅ ▆ ▇ █ ▊ ▌ ▎ ▖ ▗ ▘ ▙ ▚ ▛ ▜ ▝ ▞ ▟ ━ ┃
@@ -14,7 +14,6 @@
 #define IPADDR_SIZE 24
 #define USERNAME_SIZE  12
 #define MSG_SIZE 96
-#define USER_CNT   14
 
 #define LANDMINE_COST 12
 
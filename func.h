@@ -11,8 +11,33 @@ int max(int a, int b) {
     return a > b ? a : b;
 }
 
-bool probability(int x, int y) {
-    return (rand() % y) <= (x - 1);
+/* xorshift64*. a battle draws from a generator of its own, so that the
+ * same seed and the same inputs give the same battle again
+ */
+struct rng_t {
+    uint64_t state;
+
+    void seed(uint64_t s) {
+        state = s ? s : 0x9E3779B97F4A7C15ull;  // 0 would stay 0
+    }
+
+    uint32_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return (state * 0x2545F4914F6CDD1Dull) >> 32;
+    }
+
+    // in [0, n)
+    int below(int n) {
+        return next() % n;
+    }
+
+    rng_t() { seed(0); }
+};
+
+bool probability(rng_t* rng, int x, int y) {
+    return rng->below(y) <= x - 1;
 }
 
 uint64_t myclock() {
@@ -0,0 +1,77 @@
+// latency histograms for the bot and the tick profiler
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <cstdint>
+#include <cstring>
+
+/* log-linear buckets after HdrHistogram. values below HIST_SUB each have
+ * a bucket, every power of two above is cut into HIST_SUB / 2 buckets,
+ * so a bucket is never wider than 1/64 of the values it holds. values
+ * past 2^HIST_MAX_BITS share the last bucket, max stays exact.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * (HIST_SUB / 2))
+
+struct histogram_t {
+    uint64_t count, sum, max;
+    uint32_t buckets[HIST_BUCKETS];
+};
+
+void hist_reset(histogram_t* h) {
+    memset(h, 0, sizeof(*h));
+}
+
+int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) return v;
+    if (v >> HIST_MAX_BITS) return HIST_BUCKETS - 1;
+    int e = 63 - __builtin_clzll(v);
+    int shift = e - (HIST_SUB_BITS - 1);
+    return (shift << (HIST_SUB_BITS - 1)) + (v >> shift);
+}
+
+// the largest value that falls into bucket `b`
+uint64_t hist_bucket_top(int b) {
+    if (b < HIST_SUB) return b;
+    int shift = (b >> (HIST_SUB_BITS - 1)) - 1;
+    uint64_t top = (b & (HIST_SUB / 2 - 1)) + HIST_SUB / 2;
+    return ((top + 1) << shift) - 1;
+}
+
+void hist_record(histogram_t* h, uint64_t v) {
+    h->buckets[hist_bucket(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+void hist_merge(histogram_t* to, const histogram_t* from) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        to->buckets[i] += from->buckets[i];
+    to->count += from->count;
+    to->sum += from->sum;
+    if (from->max > to->max) to->max = from->max;
+}
+
+// `p` in percent, 0 if nothing was recorded
+uint64_t hist_percentile(const histogram_t* h, double p) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(p / 100 * h->count + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank)
+            return hist_bucket_top(i) < h->max ? hist_bucket_top(i) : h->max;
+    }
+    return h->max;
+}
+
+uint64_t hist_mean(const histogram_t* h) {
+    return h->count ? h->sum / h->count : 0;
+}
+
+#endif
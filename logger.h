@@ -0,0 +1,335 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+/* asynchronous logger behind log/logi/logw/loge.
+ *
+ * a call copies its arguments, strings included, into a ring owned by
+ * the calling thread and returns, the flusher thread formats them later
+ * and writes them to stderr. a thread whose ring is full drops the line
+ * instead of waiting, the flusher reports how many were dropped. lines
+ * of one thread keep their order, lines of different threads may not.
+ *
+ * until logger_start(), and after the process begins to exit, lines are
+ * formatted and written on the spot, which is all the client needs.
+ *
+ * levels below LOG_LEVEL are compiled out, e.g.
+ *
+ *     make CPPFLAGS=-DLOG_LEVEL=LOG_LEVEL_WARN
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <atomic>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_LEVEL_DEBUG 0  // logi
+#define LOG_LEVEL_INFO  1  // log
+#define LOG_LEVEL_WARN  2  // logw
+#define LOG_LEVEL_ERROR 3  // loge
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_RING_SIZE (1 << 20)  // bytes per thread, a power of 2
+#define LOG_MAX_THREADS 64
+#define LOG_LINE_SIZE 1024
+#define LOG_FLUSH_SIZE (1 << 16)
+#define LOG_IDLE_NS 5000000  // flusher nap when all rings are empty
+
+struct log_site_t {
+    const char* fmt;  // takes __func__ and __LINE__ first
+    const char* func;
+    int line;
+};
+
+/* arguments are stored by value, strings by content since the buffer
+ * they point to may be reused before the line is formatted.
+ */
+template <class T> struct log_arg_t {
+    static size_t size(T) { return sizeof(T); }
+    static char* put(char* p, T v) {
+        memcpy(p, &v, sizeof(T));
+        return p + sizeof(T);
+    }
+    static T get(const char*& p) {
+        T v;
+        memcpy(&v, p, sizeof(T));
+        p += sizeof(T);
+        return v;
+    }
+};
+
+template <> struct log_arg_t<const char*> {
+    static size_t size(const char* s) { return strlen(s ? s : "(null)") + 1; }
+    static char* put(char* p, const char* s) {
+        size_t n = size(s);
+        memcpy(p, s ? s : "(null)", n);
+        return p + n;
+    }
+    static const char* get(const char*& p) {
+        const char* s = p;
+        p += strlen(s) + 1;
+        return s;
+    }
+};
+
+template <> struct log_arg_t<char*> : log_arg_t<const char*> {};
+
+inline size_t log_args_size() { return 0; }
+template <class T, class... Rest>
+size_t log_args_size(T v, Rest... rest) {
+    return log_arg_t<T>::size(v) + log_args_size(rest...);
+}
+
+inline void log_args_put(char*) {}
+template <class T, class... Rest>
+void log_args_put(char* p, T v, Rest... rest) {
+    log_args_put(log_arg_t<T>::put(p, v), rest...);
+}
+
+// decodes the stored arguments one by one, then formats them all at once
+template <class... Args> struct log_format_t;
+template <> struct log_format_t<> {
+    template <class... Done>
+    static int run(char* buf, size_t n, const log_site_t* site, const char*, Done... done) {
+        return snprintf(buf, n, site->fmt, site->func, site->line, done...);
+    }
+};
+template <class T, class... Rest> struct log_format_t<T, Rest...> {
+    template <class... Done>
+    static int run(char* buf, size_t n, const log_site_t* site, const char* p, Done... done) {
+        auto v = log_arg_t<T>::get(p);
+        return log_format_t<Rest...>::run(buf, n, site, p, done..., v);
+    }
+};
+
+typedef int (*log_format_fn)(char* buf, size_t n, const log_site_t* site, const char* args);
+
+template <class... Args>
+int log_format(char* buf, size_t n, const log_site_t* site, const char* args) {
+    return log_format_t<Args...>::run(buf, n, site, args);
+}
+
+// a record is its header and then the arguments, padded to 8 bytes
+struct log_record_t {
+    uint32_t size;
+    log_format_fn format;  // NULL for the filler before the ring wraps
+    const log_site_t* site;
+};
+
+/* single producer, the thread owning it, and single consumer, the
+ * flusher. a record never wraps around the end of `buf`, the bytes left
+ * before the end are skipped, with a filler record if there is room.
+ */
+struct log_ring_t {
+    char buf[LOG_RING_SIZE];
+    std::atomic<uint64_t> head;  // consumed bytes
+    std::atomic<uint64_t> tail;  // produced bytes
+    std::atomic<uint64_t> dropped;
+
+    char* reserve(size_t size) {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        uint64_t h = head.load(std::memory_order_acquire);
+        size_t offset = t & (LOG_RING_SIZE - 1);
+        size_t filler = offset + size > LOG_RING_SIZE ? LOG_RING_SIZE - offset : 0;
+        if (t + filler + size - h > LOG_RING_SIZE)
+            return NULL;
+        if (filler) {
+            if (filler >= sizeof(log_record_t)) {
+                log_record_t* r = (log_record_t*)(buf + offset);
+                r->size = filler;
+                r->format = NULL;
+            }
+            tail.store(t + filler, std::memory_order_release);
+            offset = 0;
+        }
+        return buf + offset;
+    }
+    void commit(size_t size) {
+        tail.store(tail.load(std::memory_order_relaxed) + size, std::memory_order_release);
+    }
+};
+
+static struct {
+    std::atomic<bool> running;
+    std::atomic<bool> stopping;
+    pthread_t flusher;
+    pthread_mutex_t lock;  // taken once by each thread to register its ring
+    log_ring_t* rings[LOG_MAX_THREADS];
+    std::atomic<int> nr_rings;
+} logger = { {false}, {false}, pthread_t(), PTHREAD_MUTEX_INITIALIZER, {}, {0} };
+
+static thread_local log_ring_t* log_thread_ring = NULL;
+static thread_local bool log_thread_unbuffered = false;
+
+// NULL if the thread has to write its lines itself
+inline log_ring_t* log_ring() {
+    if (log_thread_ring || log_thread_unbuffered)
+        return log_thread_ring;
+    pthread_mutex_lock(&logger.lock);
+    int n = logger.nr_rings.load(std::memory_order_relaxed);
+    if (n < LOG_MAX_THREADS) {
+        log_thread_ring = new log_ring_t();
+        logger.rings[n] = log_thread_ring;
+        logger.nr_rings.store(n + 1, std::memory_order_release);
+    } else {
+        log_thread_unbuffered = true;
+    }
+    pthread_mutex_unlock(&logger.lock);
+    return log_thread_ring;
+}
+
+template <class... Args>
+void log_write(const log_site_t* site, Args... args) {
+    log_ring_t* ring;
+    if (!logger.running.load(std::memory_order_relaxed) || !(ring = log_ring())) {
+        fprintf(stderr, site->fmt, site->func, site->line, args...);
+        return;
+    }
+    size_t size = (sizeof(log_record_t) + log_args_size(args...) + 7) & ~(size_t)7;
+    char* p = size <= LOG_RING_SIZE / 4 ? ring->reserve(size) : NULL;
+    if (p == NULL) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    log_record_t* r = (log_record_t*)p;
+    r->size = size;
+    r->format = log_format<Args...>;
+    r->site = site;
+    log_args_put(p + sizeof(log_record_t), args...);
+    ring->commit(size);
+}
+
+// never called, lets the compiler check the arguments against the format
+inline void log_check_format(const char*, ...) __attribute__((format(printf, 1, 2)));
+inline void log_check_format(const char*, ...) {}
+
+inline void log_output(const char* s, size_t n) {
+    while (n > 0) {
+        ssize_t ret = write(STDERR_FILENO, s, n);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        s += ret;
+        n -= ret;
+    }
+}
+
+// formats whatever the rings hold, returns the number of records
+inline size_t log_drain() {
+    static char out[LOG_FLUSH_SIZE];
+    size_t len = 0, records = 0;
+    uint64_t dropped = 0;
+    int n = logger.nr_rings.load(std::memory_order_acquire);
+    for (int i = 0; i < n; i++) {
+        log_ring_t* ring = logger.rings[i];
+        uint64_t h = ring->head.load(std::memory_order_relaxed);
+        uint64_t t = ring->tail.load(std::memory_order_acquire);
+        while (h != t) {
+            size_t offset = h & (LOG_RING_SIZE - 1);
+            if (LOG_RING_SIZE - offset < sizeof(log_record_t)) {
+                h += LOG_RING_SIZE - offset;
+                continue;
+            }
+            log_record_t* r = (log_record_t*)(ring->buf + offset);
+            if (r->format) {
+                if (len + LOG_LINE_SIZE > sizeof(out)) {
+                    log_output(out, len);
+                    len = 0;
+                }
+                int ret = r->format(out + len, LOG_LINE_SIZE, r->site, (const char*)(r + 1));
+                if (ret >= LOG_LINE_SIZE) {
+                    len += LOG_LINE_SIZE - 1;
+                    out[len - 1] = '\n';
+                } else if (ret > 0) {
+                    len += ret;
+                }
+                records++;
+            }
+            h += r->size;
+        }
+        ring->head.store(h, std::memory_order_release);
+        dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+    }
+    if (dropped) {
+        len += snprintf(out + len, sizeof(out) - len,
+                        "\033[0;33m[WARN] \033[0mlogger: dropped %lu line(s)\n", (unsigned long)dropped);
+    }
+    log_output(out, len);
+    return records;
+}
+
+inline void* log_flusher(void*) {
+    struct timespec idle = { 0, LOG_IDLE_NS };
+    while (!logger.stopping.load(std::memory_order_acquire)) {
+        if (log_drain() == 0)
+            nanosleep(&idle, NULL);
+    }
+    log_drain();
+    return NULL;
+}
+
+/* writes out what is left and goes back to writing lines on the spot,
+ * registered with atexit() so that the last lines before exit() show up.
+ */
+inline void logger_stop() {
+    if (!logger.running.exchange(false))
+        return;
+    logger.stopping.store(true, std::memory_order_release);
+    if (!pthread_equal(pthread_self(), logger.flusher))
+        pthread_join(logger.flusher, NULL);
+}
+
+inline void logger_start() {
+    if (logger.running.load())
+        return;
+    logger.stopping.store(false);
+    if (pthread_create(&logger.flusher, NULL, log_flusher, NULL) != 0)
+        return;
+    logger.running.store(true, std::memory_order_release);
+    atexit(logger_stop);
+}
+
+#define LOG_PREFIX(color, tag) \
+    "\033[" VT100_STYLE_NORMAL ";" color "m" tag " \033[0m" \
+    "\033[" VT100_STYLE_DARK ";" VT100_COLOR_NORMAL "m%s:%d: \033[0m"
+
+// an expression, so it can stand in a comma list like fprintf did
+#define LOG_AT(prefix, fmt, ...) ({ \
+    static const log_site_t log_site_ = { prefix fmt "\n", __func__, __LINE__ }; \
+    if (0) log_check_format(prefix fmt "\n", __func__, __LINE__, ## __VA_ARGS__); \
+    log_write(&log_site_, ## __VA_ARGS__); \
+})
+
+// a level compiled out still has its format checked, its arguments are not evaluated
+#define LOG_OFF(fmt, ...) ((void)(0 && (log_check_format(fmt, ## __VA_ARGS__), 1)))
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define log(fmt, ...) LOG_AT(LOG_PREFIX(VT100_COLOR_BLUE, "[LOG]"), fmt, ## __VA_ARGS__)
+#else
+#define log(fmt, ...) LOG_OFF(fmt, ## __VA_ARGS__)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define logw(fmt, ...) LOG_AT(LOG_PREFIX(VT100_COLOR_YELLOW, "[WARN]"), fmt, ## __VA_ARGS__)
+#else
+#define logw(fmt, ...) LOG_OFF(fmt, ## __VA_ARGS__)
+#endif
+
+#define loge(fmt, ...) LOG_AT(LOG_PREFIX(VT100_COLOR_RED, "[ERROR]"), fmt, ## __VA_ARGS__)
+
+// inner log
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define logi(fmt, ...) LOG_AT(LOG_PREFIX(VT100_COLOR_BLUE, "[LOG]"), "==> " fmt, ## __VA_ARGS__)
+#else
+#define logi(fmt, ...) LOG_OFF(fmt, ## __VA_ARGS__)
+#endif
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/* counters of the server, exported on the metrics socket (see -s).
+ *
+ * every thread counts into a slot of its own, taken on its first count,
+ * so a count is a relaxed add to a cache line no other thread writes.
+ * a scrape sums the slots. it may miss a count in flight, but a counter
+ * never goes back. threads past METRICS_MAX_THREADS share one slot and
+ * add to it atomically.
+ */
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstdint>
+#include <atomic>
+#include <string>
+
+#define METRICS_MAX_THREADS 64
+
+enum {
+    METRIC_BYTES_SENT,
+    METRIC_MESSAGES_SENT,
+    METRIC_BYTES_RECEIVED,
+    METRIC_MESSAGES_RECEIVED,
+    METRIC_FRAMES_DROPPED,
+    METRIC_SLOW_CLOSES,
+    METRIC_ACCEPTS,
+    METRIC_TICKS,
+    METRIC_TICK_OVERRUNS,
+    METRIC_TICKS_SKIPPED,
+    METRIC_ACCOUNT_COMMITS,
+    METRIC_ACCOUNT_CHANGES,
+    NR_METRICS
+};
+
+static const struct {
+    const char* name;
+    const char* help;
+} metric_s[NR_METRICS] = {
+    { "stg_sent_bytes_total", "Bytes written to client sockets." },
+    { "stg_sent_messages_total", "Messages queued for clients." },
+    { "stg_received_bytes_total", "Bytes read from client sockets." },
+    { "stg_received_messages_total", "Messages decoded from clients." },
+    { "stg_dropped_frames_total", "Battle frames dropped or coalesced for slow clients." },
+    { "stg_slow_closes_total", "Sessions closed for falling behind." },
+    { "stg_accepts_total", "Connections accepted." },
+    { "stg_ticks_total", "Battle ticks run." },
+    { "stg_tick_overruns_total", "Battle ticks longer than the tick period." },
+    { "stg_skipped_ticks_total", "Battle ticks skipped to catch up." },
+    { "stg_account_commits_total", "Flushes of the account log." },
+    { "stg_account_changes_total", "Account changes written to the account log." },
+};
+
+struct alignas(64) metrics_slot_t {
+    std::atomic<uint64_t> counters[NR_METRICS];
+};
+
+static metrics_slot_t metrics_slots[METRICS_MAX_THREADS + 1];  // the last one is shared
+static std::atomic<int> metrics_nr_slots(0);
+static thread_local metrics_slot_t* metrics_thread_slot = NULL;
+
+inline void metric_add(int metric, uint64_t n = 1) {
+    metrics_slot_t* slot = metrics_thread_slot;
+    if (slot == NULL) {
+        int i = metrics_nr_slots.fetch_add(1, std::memory_order_relaxed);
+        slot = metrics_thread_slot = &metrics_slots[i < METRICS_MAX_THREADS ? i : METRICS_MAX_THREADS];
+    }
+    std::atomic<uint64_t>& c = slot->counters[metric];
+    if (slot == &metrics_slots[METRICS_MAX_THREADS]) {
+        c.fetch_add(n, std::memory_order_relaxed);
+    } else {
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+}
+
+inline void metrics_sum(uint64_t sum[NR_METRICS]) {
+    for (int i = 0; i < NR_METRICS; i++) {
+        sum[i] = 0;
+        for (auto& slot : metrics_slots)
+            sum[i] += slot.counters[i].load(std::memory_order_relaxed);
+    }
+}
+
+inline void metrics_printf(std::string* out, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+inline void metrics_printf(std::string* out, const char* fmt, ...) {
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len > 0) out->append(line, len < (int)sizeof(line) ? len : sizeof(line) - 1);
+}
+
+// the HELP and TYPE lines of a metric in the prometheus text format
+inline void metrics_describe(std::string* out, const char* name, const char* type, const char* help) {
+    metrics_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+inline void metrics_counters(std::string* out) {
+    uint64_t sum[NR_METRICS];
+    metrics_sum(sum);
+    for (int i = 0; i < NR_METRICS; i++) {
+        metrics_describe(out, metric_s[i].name, "counter", metric_s[i].help);
+        metrics_printf(out, "%s %lu\n", metric_s[i].name, sum[i]);
+    }
+}
+
+#endif
@@ -1,11 +1,17 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/time.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 
+#include <cerrno>
 #include <cstdarg>
 #include <csignal>
 #include <cstring>
@@ -14,31 +20,103 @@
 #include <cmath>
 
 #include <vector>
-#include <list>
 #include <set>
+#include <algorithm>
+#include <queue>
+#include <atomic>
 
 #include "constants.h"
 #include "server.h"
 #include "common.h"
 #include "func.h"
-
-#define REGISTERED_USER_LIST_SIZE 100
-
+#include "bullets.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "userdb.h"
+
+// snapshot and log of the accounts, see userdb.h
+#define USERS_FILE "users.db"
+#define USERS_LOG_FILE "users.wal"
+// accounts of older servers, moved into USERS_FILE once
 #define REGISTERED_USER_FILE "userlists.log"
 
+#define EPOLL_MAX_EVENTS 64
+#define EPOLL_LISTEN_TOKEN UINT32_MAX
+#define EPOLL_SIGNAL_TOKEN (UINT32_MAX - 1)
+// pause after a listening socket fails to accept, out of fds or memory
+#define ACCEPT_RETRY_MS 100
+// max messages handled for one session per wakeup, so that a flooding
+// client can not starve the others
+#define SESSION_RECV_BATCH 16
+
+// bytes buffered for every session while its socket is not writable
+#define OUTQ_SIZE (64 * 1024)
+// battle frames are treated as stale once this many bytes are pending
+#define OUTQ_HIGH_WATER (OUTQ_SIZE / 4)
+// keep the kernel from buffering seconds of stale frames behind our back
+#define SESSION_SNDBUF (32 * 1024)
+
+// how long a scraper has to send its request, see serve_metrics
+#define METRICS_REQUEST_MS 100
+
+// slots preallocated by the item pool of every battle
+#define ITEM_POOL_INIT 256
+#define ITEM_POOL_ALIGN BULLET_BLOCK
+// low bits of an item handle hold the slot, the rest its generation
+#define ITEM_SLOT_BITS 20
+
+// the timer wheel has TIMER_LEVELS levels of 2^TIMER_BITS buckets each
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+
+#define NS_PER_MS ((uint64_t)1000000)
+#define NS_PER_SEC ((uint64_t)1000000000)
+#define BATTLE_TICK_NS (GLOBAL_SPEED * NS_PER_MS)
+// ticks this long are logged with their slowest phase
+#define SLOW_TICK_NS (5 * NS_PER_MS)
+
+// sessions and battles are added REGISTRY_CHUNK at a time
+#define REGISTRY_CHUNK 64
+#define REGISTRY_MAX_CHUNKS 1024
+
+// player inputs a battle buffers between two ticks, a power of two
+#define INPUT_RING_SIZE 1024
+
+// the account log is folded into a new snapshot past this many entries,
+// or once it has waited this long with any
+#define USERS_COMPACT_ENTRIES 65536
+#define USERS_COMPACT_SEC 600
+
+// battle records, see start_record
+#define RECORD_VERSION 1
+#define RECORD_DIGEST_TICKS 500
+
+// what to do with a battle frame when the client falls behind
+enum {
+    OUTQ_POLICY_DROP,       // drop the new frame
+    OUTQ_POLICY_COALESCE,   // replace the pending frame with the new one
+    OUTQ_POLICY_DISCONNECT, // kick the client
+};
+
 using std::multiset;
 using std::vector;
+using std::priority_queue;
+using std::greater;
+using std::atomic;
+using std::memory_order_relaxed;
+using std::memory_order_acquire;
+using std::memory_order_release;
 
-pthread_mutex_t userlist_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t battles_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t default_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t items_lock[USER_CNT];
 
-int server_fd = 0, port = 50000, port_range = 100;
+int server_fd = 0, epoll_fd = -1, port = 50000, port_range = 100;
+// signal handlers write the signal here and the reactor shuts down, see terminate_entrance
+int signal_pipe[2] = { -1, -1 };
 
-void wrap_recv(int conn, client_message_t* pcm);
-void wrap_send(int conn, server_message_t* psm);
+void wrap_send(int uid, server_message_t* psm);
 
 void send_to_client(int uid, int message);
 void send_to_client(int uid, int message, char* str);
@@ -46,17 +124,53 @@ void say_to_client(int uid, char* message);
 void send_to_client_with_username(int uid, int message, char* user_name);
 void close_session(int conn, int message);
 
-void check_user_status(int uid);
+void check_user_status(int bid, int pid);
+void save_stats(int uid);
+void account_charge_quit(int id);
+void account_logout(int uid);
 
-void terminate_process(int recved_signal);
+void outq_close(int uid);
 
-static int user_list_size = 0;
+void terminate_process(int recved_signal);
+void handle_signal();
+
+static int battle_capacity = BATTLE_CAPACITY;
+static int outq_policy = OUTQ_POLICY_COALESCE;
+static const char* record_dir = NULL;  // see the -r option
+static const char* metrics_path = NULL;  // see the -s option
+static rng_t spawn_rng;  // drawn by the reactor only, see user_join_battle
+static userdb_t userdb;  // registered accounts, touched by the reactor only
 //static uint64_t sum_delay_time = 0, prev_time;
 
-struct {
-    char user_name[USERNAME_SIZE];
-    char password[PASSWORD_SIZE];
-} registered_user_list[REGISTERED_USER_LIST_SIZE];
+/* a table of entries that grows by whole chunks. a chunk never moves
+ * once added, so threads keep using entries while another one grows
+ * the table under its own lock. entries are never removed, the owner
+ * of the table reuses the unused ones.
+ */
+template <class T>
+class registry_t { public:
+    T* chunks[REGISTRY_MAX_CHUNKS];
+    atomic<int> count;
+
+    T& operator[](int id) {
+        return chunks[id / REGISTRY_CHUNK][id % REGISTRY_CHUNK];
+    }
+
+    int size() const {
+        return count.load(memory_order_acquire);
+    }
+
+    // returns the first new id, or -1 if the table is at its limit
+    int grow() {
+        int n = count.load(memory_order_relaxed);
+        if (n / REGISTRY_CHUNK >= REGISTRY_MAX_CHUNKS) return -1;
+        chunks[n / REGISTRY_CHUNK] = new T[REGISTRY_CHUNK];
+        count.store(n + REGISTRY_CHUNK, memory_order_release);
+        return n;
+    }
+
+    registry_t() : count(0) {}
+};
 
 struct session_t {
     char user_name[USERNAME_SIZE];
@@ -64,134 +178,566 @@ struct session_t {
     int conn;
     int state;
     int is_admin;
-    int score;
-    int kill;
-    int death;
+    // the tick of a battle keeps these up to date while the reactor reads them
+    atomic<int> score;
+    atomic<int> kill;
+    atomic<int> death;
     uint32_t bid;
+    atomic<int> account;  // in userdb, -1 until it logs in
+    atomic<int> slots;    // battle slots that still hold this session, see apply_join
     uint32_t inviter_id;
-    client_message_t cm;
-} sessions[USER_CNT];
+    client_message_t cm;  // last decoded command
+    uint8_t rbuf[MAX_FRAME_SIZE];  // inbound bytes not yet framed
+    size_t rbuf_len;
+    uint32_t frame_seq;  // last battle frame rendered for this session
+    atomic<uint32_t> acked_seq;  // last battle frame the client acknowledged
+    atomic<uint32_t> input_seq;  // last move of the client the tick applied
+    frame_history_t frames;
+
+    session_t() {
+        reset();
+    }
+
+    void reset() {
+        memset((void*)this, 0, sizeof(*this));
+        conn = -1;
+        account = -1;
+    }
+};
+
+registry_t<session_t> sessions;
 
-struct session_args_t {
+/* outbound queue of a session, filled by any thread and drained by the
+ * reactor. `head` and `tail` are byte counters, the ring index of a byte
+ * is its counter modulo OUTQ_SIZE. `conn` mirrors sessions[uid].conn
+ * but is only touched under `lock`, so that no frame is ever written to
+ * a closed (and possibly reused) fd.
+ */
+struct outq_t {
+    pthread_mutex_t lock;
     int conn;
-    char ip_addr[IPADDR_SIZE];
+    char* buf;
+    uint64_t head;       // bytes sent
+    uint64_t tail;       // bytes queued
+    uint64_t last_pos;   // where the newest frame starts
+    int last_message;    // message type of the newest frame
+    int want_write;      // EPOLLOUT is armed
+    int doomed;          // client fell behind, waiting to be closed
+    uint64_t dropped;
+
+    outq_t() {
+        pthread_mutex_init(&lock, NULL);
+        conn = -1;
+        buf = (char*)malloc(OUTQ_SIZE);
+        head = tail = last_pos = 0;
+        last_message = -1;
+        want_write = doomed = 0;
+        dropped = 0;
+    }
 };
 
-typedef struct session_args_t session_args_t;
+// outqs[uid] belongs to sessions[uid], both grow together
+registry_t<outq_t> outqs;
+
+/* items of a battle live in a pool of slots stored as parallel arrays, so
+ * each sweep reads only the fields it needs and nothing is allocated per
+ * item. free slots have kind ITEM_NONE and are chained through
+ * `cell_next`. a slot is reused once freed, but a handle also carries the
+ * generation of its slot and goes stale with the item it was taken from.
+ */
+typedef uint32_t item_handle_t;
+
+class item_pool_t { public:
+    int capacity;  // a multiple of ITEM_POOL_ALIGN
+    int end;       // slots at and past `end` have never been used
+    int live;
+    int free_head;
+    uint8_t* kind;
+    uint8_t* dir;
+    uint16_t* x;
+    uint16_t* y;
+    int32_t* owner;
+    int32_t* count;
+    int32_t* id;
+    uint64_t* time;      // the item expires at this tick
+    int32_t* timer;      // its expiry timer in the battle's wheel
+    uint32_t* gen;
+    int32_t* cell_prev;  // chain of the items sharing a cell, -1 ends it
+    int32_t* cell_next;
+    uint16_t* prev_x;    // positions before the last bullet step
+    uint16_t* prev_y;
+    uint32_t* moved;     // one bit per slot, set if the last step moved it
+
+    template <typename T> static void resize(T*& array, int old_size, int new_size) {
+        array = (T*)realloc(array, new_size * sizeof(T));
+        if (array == NULL) eprintf("fail to grow item pool to %d slots", new_size);
+        memset(array + old_size, 0, (new_size - old_size) * sizeof(T));
+    }
+
+    void grow(int new_capacity) {
+        new_capacity = (new_capacity + ITEM_POOL_ALIGN - 1) / ITEM_POOL_ALIGN * ITEM_POOL_ALIGN;
+        if (new_capacity > (1 << ITEM_SLOT_BITS))
+            eprintf("item pool can not hold %d slots", new_capacity);
+        resize(kind, capacity, new_capacity);
+        resize(dir, capacity, new_capacity);
+        resize(x, capacity, new_capacity);
+        resize(y, capacity, new_capacity);
+        resize(owner, capacity, new_capacity);
+        resize(count, capacity, new_capacity);
+        resize(id, capacity, new_capacity);
+        resize(time, capacity, new_capacity);
+        resize(timer, capacity, new_capacity);
+        resize(gen, capacity, new_capacity);
+        resize(cell_prev, capacity, new_capacity);
+        resize(cell_next, capacity, new_capacity);
+        resize(prev_x, capacity, new_capacity);
+        resize(prev_y, capacity, new_capacity);
+        resize(moved, capacity / BULLET_BLOCK, new_capacity / BULLET_BLOCK);
+        capacity = new_capacity;
+    }
+
+    // the pool only grows past its high-water mark, never on a steady tick
+    int alloc() {
+        int slot = free_head;
+        if (slot >= 0) {
+            free_head = cell_next[slot];
+        } else {
+            if (end == capacity) grow(capacity * 2);
+            slot = end++;
+        }
+        live++;
+        return slot;
+    }
+
+    void release(int slot) {
+        kind[slot] = ITEM_NONE;
+        gen[slot]++;
+        cell_next[slot] = free_head;
+        free_head = slot;
+        live--;
+    }
 
-class item_t { public:
-    int id;
-    int dir;
-    int owner;
-    uint64_t time;
-    int count;
+    item_handle_t handle(int slot) {
+        return (gen[slot] << ITEM_SLOT_BITS) | slot;
+    }
+
+    // returns the slot of a live item, or -1 if it has been freed
+    int resolve(item_handle_t h) {
+        int slot = h & ((1 << ITEM_SLOT_BITS) - 1);
+        if (slot >= end || kind[slot] == ITEM_NONE) return -1;
+        if ((gen[slot] << ITEM_SLOT_BITS) != (h & ~((1u << ITEM_SLOT_BITS) - 1))) return -1;
+        return slot;
+    }
+
+    void reset() {
+        for (int i = 0; i < end; i++) {
+            if (kind[i] == ITEM_NONE) continue;
+            kind[i] = ITEM_NONE;
+            gen[i]++;
+        }
+        end = live = 0;
+        free_head = -1;
+    }
+
+    item_pool_t() {
+        capacity = end = live = 0;
+        free_head = -1;
+        kind = dir = NULL;
+        x = y = NULL;
+        owner = NULL;
+        count = id = timer = cell_prev = cell_next = NULL;
+        time = NULL;
+        gen = NULL;
+        prev_x = prev_y = NULL;
+        moved = NULL;
+        grow(ITEM_POOL_INIT);
+    }
+};
+
+/* hierarchical timing wheel over battle ticks. a timer waits in the
+ * lowest level whose span still separates its tick from `now`, and drops
+ * to finer levels as the wheel turns, so each tick only touches the
+ * timers that are due. ticks beyond the top level wait in `overflow`.
+ */
+enum {
+    TIMER_ITEM_EXPIRE,  // arg: item handle
+};
+
+struct timer_node_t {
+    uint64_t when;
     int kind;
-    pos_t pos;
-    item_t(const item_t &it) : id(it.id),
-                               dir(it.dir),
-                               owner(it.owner),
-                               time(it.time),
-                               count(it.count),
-                               kind(it.kind),
-                               pos(it.pos)
-                               {}
-    item_t() {
-        id = 0;
-        dir = owner = time = count = kind = 0;
-        pos.x = pos.y = 0;
-    }
-    friend const bool operator < (const item_t it1, const item_t it2) {
-        return it1.time < it2.time;
+    uint32_t arg;
+    int32_t prev, next;
+};
+
+class timer_wheel_t { public:
+    uint64_t now;  // all timers up to this tick have fired
+    vector<timer_node_t> nodes;
+    int32_t free_head;
+    int32_t buckets[TIMER_LEVELS][TIMER_SLOTS];
+    int32_t overflow;
+
+    int32_t* bucket_of(uint64_t when) {
+        uint64_t diff = when ^ now;
+        for (int level = 0; level < TIMER_LEVELS; level++) {
+            if (diff < (1ull << (TIMER_BITS * (level + 1))))
+                return &buckets[level][(when >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+        }
+        return &overflow;
+    }
+
+    void link(int32_t id) {
+        int32_t* head = bucket_of(nodes[id].when);
+        nodes[id].prev = -1;
+        nodes[id].next = *head;
+        if (*head >= 0) nodes[*head].prev = id;
+        *head = id;
+    }
+
+    void unlink(int32_t id) {
+        timer_node_t& t = nodes[id];
+        if (t.prev >= 0) nodes[t.prev].next = t.next;
+        else *bucket_of(t.when) = t.next;
+        if (t.next >= 0) nodes[t.next].prev = t.prev;
+    }
+
+    // a tick which has passed already fires on the next one
+    int32_t add(uint64_t when, int kind, uint32_t arg) {
+        int32_t id = free_head;
+        if (id >= 0) {
+            free_head = nodes[id].next;
+        } else {
+            id = nodes.size();
+            nodes.push_back(timer_node_t());
+        }
+        // ticks are 64 bits, the max of func.h would cut them to int
+        nodes[id].when = when > now + 1 ? when : now + 1;
+        nodes[id].kind = kind;
+        nodes[id].arg = arg;
+        link(id);
+        return id;
+    }
+
+    void cancel(int32_t id) {
+        unlink(id);
+        nodes[id].next = free_head;
+        free_head = id;
+    }
+
+    // move the timers of a coarse bucket down to the levels below
+    void cascade(int32_t* head) {
+        int32_t id = *head;
+        *head = -1;
+        while (id >= 0) {
+            int32_t next = nodes[id].next;
+            link(id);
+            id = next;
+        }
+    }
+
+    /* turn the wheel up to tick `to`, calling `fire(kind, arg)` for every
+     * timer due on the way. `fire` may add or cancel other timers.
+     */
+    template <typename F> void advance(uint64_t to, F fire) {
+        while (now < to) {
+            now++;
+            if ((now & ((1ull << (TIMER_BITS * TIMER_LEVELS)) - 1)) == 0)
+                cascade(&overflow);
+            for (int level = TIMER_LEVELS - 1; level > 0; level--) {
+                if (now & ((1ull << (TIMER_BITS * level)) - 1)) continue;
+                cascade(&buckets[level][(now >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)]);
+            }
+
+            int32_t* head = &buckets[0][now & (TIMER_SLOTS - 1)];
+            while (*head >= 0) {
+                int32_t id = *head;
+                int kind = nodes[id].kind;
+                uint32_t arg = nodes[id].arg;
+                cancel(id);
+                fire(kind, arg);
+            }
+        }
     }
+
+    void reset() {
+        now = 0;
+        nodes.clear();
+        free_head = overflow = -1;
+        memset(buckets, -1, sizeof(buckets));
+    }
+
+    timer_wheel_t() {
+        nodes.reserve(ITEM_POOL_INIT);
+        reset();
+    }
+};
+
+/* player inputs on their way from the reactor to the tick of a battle, a
+ * bounded ring after Dmitry Vyukov's queue. producers claim a cell by
+ * advancing `tail`, the cell's `seq` tells who may touch it next: it is
+ * `pos` when free for the producer of `pos` and `pos + 1` once filled.
+ * only the tick of the battle pops, so `head` needs no atomics.
+ */
+struct input_cell_t {
+    atomic<uint32_t> seq;
+    uint32_t uid;
+    uint32_t input_seq;  // of a move, 0 for other commands
+    uint8_t command;
+};
+
+class input_ring_t { public:
+    input_cell_t cells[INPUT_RING_SIZE];
+    atomic<uint32_t> tail;
+    uint32_t head;
+
+    // false if the ring is full
+    bool push(int uid, int command, uint32_t input_seq) {
+        uint32_t pos = tail.load(memory_order_relaxed);
+        input_cell_t* cell;
+        for (;;) {
+            cell = &cells[pos & (INPUT_RING_SIZE - 1)];
+            int32_t lag = (int32_t)(cell->seq.load(memory_order_acquire) - pos);
+            if (lag == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                    break;
+            } else if (lag < 0) {
+                return false;
+            } else {
+                pos = tail.load(memory_order_relaxed);
+            }
+        }
+        cell->uid = uid;
+        cell->input_seq = input_seq;
+        cell->command = command;
+        cell->seq.store(pos + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop(int* uid, int* command, uint32_t* input_seq) {
+        input_cell_t* cell = &cells[head & (INPUT_RING_SIZE - 1)];
+        if (cell->seq.load(memory_order_acquire) != head + 1)
+            return false;
+        *uid = cell->uid;
+        *input_seq = cell->input_seq;
+        *command = cell->command;
+        cell->seq.store(head + INPUT_RING_SIZE, memory_order_release);
+        head++;
+        return true;
+    }
+
+    input_ring_t() {
+        for (uint32_t i = 0; i < INPUT_RING_SIZE; i++)
+            cells[i].seq.store(i, memory_order_relaxed);
+        tail.store(0, memory_order_relaxed);
+        head = 0;
+    }
+};
+
+/* changes of the players of a battle on their way from the reactor to
+ * its tick, which applies them as it starts. unlike inputs they are
+ * never dropped, so they wait in a locked vector instead of the ring.
+ */
+enum {
+    CONTROL_JOIN,    // `uid` takes a free slot at (arg[0], arg[1])
+    CONTROL_QUIT,    // `uid` leaves its slot
+    CONTROL_ENERGY,  // an admin sets the energy of `uid` to arg[0]
+    CONTROL_LIFE,    // an admin sets the life of `uid` to arg[0]
+    CONTROL_POS,     // an admin moves `uid` to (arg[0], arg[1])
+};
+
+struct battle_control_t {
+    int kind;
+    int uid;
+    int account;  // the session of `uid` was logged in as, it may log out meanwhile
+    int arg[2];
+    char user_name[USERNAME_SIZE];
+};
+
+// the phases of a tick, timed apart by battle_tick
+enum {
+    PHASE_INPUTS,    // apply_battle_controls and apply_battle_inputs
+    PHASE_BULLETS,   // move_bullets
+    PHASE_STATUS,    // check_all_user_status
+    PHASE_DEATH,     // check_who_is_dead
+    PHASE_STATE,     // inform_all_user_battle_state
+    PHASE_PLAYERS,   // inform_all_user_battle_player, every 10th tick
+    PHASE_CLEAR,     // clear_items
+    PHASE_GENERATE,  // random_generate_items
+    PHASE_TICK,      // the whole tick
+    NR_PHASES
 };
 
+static const char* phase_s[NR_PHASES] = {
+    "inputs", "bullets", "status", "death", "state", "players", "clear", "generate", "tick",
+};
+
+/* how long each phase of the ticks of a battle took, in ns. the tick
+ * records into it while an admin may be reading it, see admin_prof.
+ */
+class tick_profile_t { public:
+    pthread_mutex_t lock;
+    histogram_t phases[NR_PHASES];
+
+    void reset() {
+        pthread_mutex_lock(&lock);
+        for (auto& phase : phases)
+            hist_reset(&phase);
+        pthread_mutex_unlock(&lock);
+    }
+
+    tick_profile_t() {
+        pthread_mutex_init(&lock, NULL);
+        reset();
+    }
+};
+
+struct overlay_cell_t {
+    uint16_t x, y;
+    uint8_t item;
+};
+
+/* a battle has `battle_capacity` player slots, a user takes a free one
+ * when it joins and keeps it until it quits. only the tick changes the
+ * slots, the reactor posts to `controls` and counts `members` instead.
+ *
+ * the arena is `w` x `h` cells, the ffa one may be far larger than a
+ * screen (see -m). every player is sent the BATTLE_W x BATTLE_H window
+ * around it, and the players inside it are found through `buckets`.
+ */
 class battle_t { public:
-    int is_alloced;
+    int is_alloced;  // written by the reactor under scheduler.lock
+    bool scheduled;  // in scheduler.due or being ticked, under its lock
+    int members;  // users in the battle or about to be, the reactor's count
     size_t alive_users;
     size_t all_users;
     class user_t { public:
+        int uid;
         int battle_state;
         int energy;
         int dir;
         int life;
         int killby;
+        int bucket;  // in `buckets`, -1 if in none
         pos_t pos;
         pos_t last_pos;
-    } users[USER_CNT];
+    };
+    vector<user_t> users;  // never resized, the tick may be reading it
+    vector<int> pid_of;  // slot of each uid in `users`, -1 if none
+
+    int w, h;
+    int screens;  // w * h in windows, items are generated in proportion
+    bullet_rules_t rules;
 
     int num_of_other;  // number of other alloced item except for bullet
     int item_count;
     uint64_t global_time;
-
-    std::list<item_t> items;
-
+    uint64_t seed;
+    rng_t rng;  // drawn by the tick only, seeded as it starts
+
+    item_pool_t items;
+    atomic<int> item_kinds[ITEM_SIZE];  // live items of each kind, for the metrics
+    timer_wheel_t timers;
+    // slots of each cell in insertion order, so a collision check only
+    // walks one chain instead of all `items`. cells are indexed by cell()
+    vector<int32_t> cell_head;
+    vector<int32_t> cell_tail;
+
+    // what every player sees, and what differs for each, see render_battle_layer
+    vector<uint8_t> layer;
+    vector<int32_t> bullet_owner;
+    vector<int> painted;  // cells set in `layer` by the last render
+    vector<pos_t> bullet_cells;
+    vector<int> landmines;
+    vector<vector<overlay_cell_t> > overlay;  // by slot
+
+    // slots of the live players in each BATTLE_W x BATTLE_H block of the
+    // arena, a window meets at most four blocks. see update_interest
+    int buckets_w, buckets_h;
+    vector<vector<int> > buckets;
+
+    // left alone by reset(), the tick may be draining them meanwhile
+    input_ring_t inputs;
+    pthread_mutex_t control_lock;
+    vector<battle_control_t> controls;
+    vector<battle_control_t> applying;  // the tick's, see apply_battle_controls
+    vector<int> left;  // sessions that quit in this tick, see apply_battle_inputs
+    // owned by the tick as well, see start_record
+    FILE* record;
+    // kept past the end of the battle, until it starts again
+    tick_profile_t profile;
+
+    int cell(int x, int y) const { return y * w + x; }
+    int bucket_of(pos_t pos) const {
+        return pos.y / BATTLE_H * buckets_w + pos.x / BATTLE_W;
+    }
+
+    void resize(int new_w, int new_h) {
+        w = new_w;
+        h = new_h;
+        screens = max(w * h / (BATTLE_W * BATTLE_H), 1);
+        bullet_rules_init(&rules, w, h);
+        cell_head.resize(w * h);
+        cell_tail.resize(w * h);
+        layer.resize(w * h);
+        bullet_owner.resize(w * h);
+        buckets_w = (w + BATTLE_W - 1) / BATTLE_W;
+        buckets_h = (h + BATTLE_H - 1) / BATTLE_H;
+        buckets.resize(buckets_w * buckets_h);
+        reset();
+    }
     void reset() {
-        is_alloced = all_users = alive_users = num_of_other = item_count = 0;
+        all_users = alive_users = num_of_other = item_count = 0;
         global_time = 0;
-        items.clear();
-    }
-    battle_t() {
-        reset();
+        items.reset();
+        for (auto& kind : item_kinds)
+            kind.store(0, memory_order_relaxed);
+        timers.reset();
+        fill(cell_head.begin(), cell_head.end(), -1);
+        fill(cell_tail.begin(), cell_tail.end(), -1);
+        fill(layer.begin(), layer.end(), 0);
+        fill(bullet_owner.begin(), bullet_owner.end(), -1);
+        painted.clear();
+        bullet_cells.clear();
+        for (auto& bucket : buckets)
+            bucket.clear();
+        for (auto& user : users)
+            user.bucket = -1;
+        fill(pid_of.begin(), pid_of.end(), -1);
+    }
+    battle_t() : is_alloced(0), scheduled(false), members(0), users(battle_capacity), overlay(battle_capacity),
+                 record(NULL) {
+        for (auto& user : users)
+            user.battle_state = BATTLE_STATE_UNJOINED;
+        pthread_mutex_init(&control_lock, NULL);
+        resize(BATTLE_W, BATTLE_H);
     }
 
-} battles[USER_CNT];
+};
 
-void load_user_list() {
-    FILE* userlist = fopen(REGISTERED_USER_FILE, "r");
-    if (userlist == NULL) {
-        log("can not find " REGISTERED_USER_FILE "");
-        return;
-    }
-#define LOAD_FAIL                                                                          \
-    log("failed to load users, try to delete " REGISTERED_USER_FILE "."),                \
-        user_list_size = 0, memset(registered_user_list, 0, sizeof(registered_user_list)), \
-        fclose(userlist);
-    for (int i = 0; i < REGISTERED_USER_LIST_SIZE; i++) {
-        if (fgets(registered_user_list[i].user_name, USERNAME_SIZE, userlist) != NULL) {
-            registered_user_list[i].user_name[strlen(registered_user_list[i].user_name) - 1] = 0;
-            for (int j = 0; j < i; j++) {
-                if (strncmp(registered_user_list[i].user_name, registered_user_list[j].user_name, USERNAME_SIZE - 1) != 0)
-                    continue;
-                LOAD_FAIL;
-                return;
-            }
-            user_list_size++;
-        } else {
-            break;
-        }
-        if (fgets(registered_user_list[i].password, PASSWORD_SIZE, userlist) == NULL) {
-            LOAD_FAIL;
-            return;
-        }
-        registered_user_list[i].password[strlen(registered_user_list[i].password) - 1] = 0;
-    }
-#undef LOAD_FAIL
-    //for (int i = 0; i < user_list_size; i++) {
-    //    log("loaded user %s", registered_user_list[i].user_name);
-    //}
-    log("loaded %d user(s) from " REGISTERED_USER_FILE ".", user_list_size);
-    fclose(userlist);
-}
-void save_user_list() {
-    FILE* userlist = fopen(REGISTERED_USER_FILE, "w");
-    for (int i = 0; i < user_list_size; i++) {
-        fprintf(userlist, "%s\n", registered_user_list[i].user_name);
-        fprintf(userlist, "%s\n", registered_user_list[i].password);
+registry_t<battle_t> battles;
+
+/* battles are ticked by a fixed pool of workers. every running battle
+ * has one entry in `due` holding the absolute deadline of its next tick,
+ * idle workers sleep until the earliest one.
+ */
+struct battle_tick_t {
+    uint64_t deadline;  // CLOCK_MONOTONIC, ns
+    int bid;
+    bool operator>(const battle_tick_t& other) const {
+        return deadline > other.deadline;
     }
-    log("saved %d users to " REGISTERED_USER_FILE ".", user_list_size);
-    fclose(userlist);
-}
+};
 
-void save_user(int i) {
-    FILE* userlist = fopen(REGISTERED_USER_FILE, "a");
-    fprintf(userlist, "%s\n", registered_user_list[i].user_name);
-    fprintf(userlist, "%s\n", registered_user_list[i].password);
-    log("saved users %s to " REGISTERED_USER_FILE ".", registered_user_list[i].user_name);
-    fclose(userlist);
-}
+struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  // due changed
+    priority_queue<battle_tick_t, vector<battle_tick_t>, greater<battle_tick_t> > due;
+    bool stopping;  // no ticks from now on, see scheduler_stop
+    int ticking;    // workers in the middle of a tick
+} scheduler;
 
 int query_session_built(uint32_t uid) {
-    assert(uid < USER_CNT);
+    assert((int)uid < sessions.size());
 
     if (sessions[uid].state == USER_STATE_UNUSED
         || sessions[uid].state == USER_STATE_NOT_LOGIN) {
@@ -203,71 +749,86 @@ int query_session_built(uint32_t uid) {
 
 void inform_all_user_battle_player(int bid);
 
+// the slot of a user in battle `bid`, -1 if it has not joined it. for the tick
+int battle_slot(int bid, int uid) {
+    battle_t& b = battles[bid];
+    return uid >= 0 && uid < (int)b.pid_of.size() ? b.pid_of[uid] : -1;
+}
+
+battle_t::user_t* battle_user(int bid, int uid) {
+    int pid = battle_slot(bid, uid);
+    return pid < 0 ? NULL : &battles[bid].users[pid];
+}
+
+void post_battle_control(int bid, int kind, int uid, int arg0 = 0, int arg1 = 0) {
+    battle_control_t c;
+    memset(&c, 0, sizeof(c));
+    c.kind = kind;
+    c.uid = uid;
+    c.account = sessions[uid].account;
+    c.arg[0] = arg0;
+    c.arg[1] = arg1;
+    strncpy(c.user_name, sessions[uid].user_name, USERNAME_SIZE - 1);
+    pthread_mutex_lock(&battles[bid].control_lock);
+    battles[bid].controls.push_back(c);
+    pthread_mutex_unlock(&battles[bid].control_lock);
+}
+
 void user_quit_battle(uint32_t bid, uint32_t uid) {
-    assert(bid < USER_CNT && uid < USER_CNT);
+    assert((int)bid < battles.size() && (int)uid < sessions.size());
 
-    log("user %s\033[2m(%s)\033[0m quit from battle %d(%ld/%ld users)", sessions[uid].user_name, sessions[uid].ip_addr, bid, battles[bid].alive_users, battles[bid].all_users);
-    battles[bid].all_users--;
-    if (battles[bid].users[uid].battle_state == BATTLE_STATE_LIVE) {
-        battles[bid].alive_users--;
-        if (battles[bid].alive_users != 0) {
-            sessions[uid].score = max(sessions[uid].score - 5, 0);
-            sessions[uid].death ++;
-        }
-    }
-    battles[bid].users[uid].battle_state = BATTLE_STATE_UNJOINED;
+    int state = sessions[uid].state;
     sessions[uid].state = USER_STATE_LOGIN;
-    if (battles[bid].all_users == 0) {
-        // disband battle
-        log("disband battle %d", bid);
-        battles[bid].reset();
-    } else {
-        server_message_t sm;
-        sm.message = SERVER_MESSAGE_USER_QUIT_BATTLE;
-        strncpy(sm.friend_name, sessions[uid].user_name, USERNAME_SIZE - 1);
+    if (state != USER_STATE_BATTLE) {
+        // invited only, it never took a slot
+        log("user %s\033[2m(%s)\033[0m gives up the invitation to battle %d", sessions[uid].user_name, sessions[uid].ip_addr, bid);
+        return;
+    }
 
-        for (int i = 0; i < USER_CNT; i++) {
-            if (battles[bid].users[i].battle_state != BATTLE_STATE_UNJOINED) {
-                wrap_send(sessions[i].conn, &sm);
-            }
-        }
+    battles[bid].members--;
+    log("user %s\033[2m(%s)\033[0m quit from battle %d(%d users left)", sessions[uid].user_name, sessions[uid].ip_addr, bid, battles[bid].members);
+    post_battle_control(bid, CONTROL_QUIT, uid);
+    if (battles[bid].members == 0) {
+        // disband battle, its worker resets it in drop_battle
+        log("disband battle %d", bid);
+        pthread_mutex_lock(&scheduler.lock);
+        battles[bid].is_alloced = false;
+        pthread_mutex_unlock(&scheduler.lock);
     }
 }
 
 void user_join_battle_common_part(uint32_t bid, uint32_t uid, uint32_t joined_state) {
     log("user %s\033[2m(%s)\033[0m join in battle %d", sessions[uid].user_name, sessions[uid].ip_addr, bid);
 
-    if (joined_state == USER_STATE_BATTLE) {
-        battles[bid].all_users++;
-        battles[bid].alive_users++;
-        log("now %ld alive of %ld users", battles[bid].alive_users, battles[bid].all_users);
-        battles[bid].users[uid].battle_state = BATTLE_STATE_LIVE;
-    } else if (joined_state == USER_STATE_WAIT_TO_BATTLE) {
-        battles[bid].users[uid].battle_state = BATTLE_STATE_UNJOINED;
-    } else {
+    // an invited user takes a slot only once it accepts, see user_join_battle
+    if (joined_state != USER_STATE_BATTLE && joined_state != USER_STATE_WAIT_TO_BATTLE) {
         loge("check here, other joined_state:%d", joined_state);
     }
 
-    battles[bid].users[uid].life = INIT_LIFE;
-    battles[bid].users[uid].energy = INIT_BULLETS;
+    // the client starts from a blank map, begin with a keyframe
+    sessions[uid].acked_seq = 0;
 
     sessions[uid].state = joined_state;
     sessions[uid].bid = bid;
 }
 
-void user_join_battle(uint32_t bid, uint32_t uid) {
-    int ux = (rand() & 0x7FFF) % BATTLE_W;
-    int uy = (rand() & 0x7FFF) % BATTLE_H;
-    battles[bid].users[uid].pos.x = ux;
-    battles[bid].users[uid].pos.y = uy;
-    log("alloc position (%hhu, %hhu) for launcher #%d %s",
-        ux, uy, uid, sessions[uid].user_name);
-
-    sessions[uid].state = USER_STATE_BATTLE;
-
-    if (battles[bid].users[uid].battle_state == BATTLE_STATE_UNJOINED) {
-        user_join_battle_common_part(bid, uid, USER_STATE_BATTLE);
+// returns -1 if the battle has no free slot
+int user_join_battle(uint32_t bid, uint32_t uid) {
+    battle_t& b = battles[bid];
+    if (b.members >= (int)b.users.size()) {
+        logw("battle #%d is full, user #%d %s can not join", bid, uid, sessions[uid].user_name);
+        return -1;
     }
+    b.members++;
+
+    // the tick may be drawing from the battle's own generator meanwhile,
+    // a record keeps the spawn point instead
+    int ux = spawn_rng.below(b.w);
+    int uy = spawn_rng.below(b.h);
+    log("alloc position (%d, %d) for launcher #%d %s", ux, uy, uid, sessions[uid].user_name);
+    post_battle_control(bid, CONTROL_JOIN, uid, ux, uy);
+    user_join_battle_common_part(bid, uid, USER_STATE_BATTLE);
+    return 0;
 }
 
 void user_invited_to_join_battle(uint32_t bid, uint32_t uid) {
@@ -285,7 +846,7 @@ void user_invited_to_join_battle(uint32_t bid, uint32_t uid) {
 int find_uid_by_user_name(const char* user_name) {
     int ret_uid = -1;
     log("find user %s", user_name);
-    for (int i = 0; i < USER_CNT; i++) {
+    for (int i = 0; i < sessions.size(); i++) {
         if (query_session_built(i)) {
             if (strncmp(user_name, sessions[i].user_name, USERNAME_SIZE - 1) == 0) {
                 ret_uid = i;
@@ -303,20 +864,27 @@ int find_uid_by_user_name(const char* user_name) {
     return ret_uid;
 }
 
+/* battle #0 is kept for ffa. a disbanded battle is handed out again only
+ * once its worker dropped it, which leaves it reset, see drop_battle.
+ * it is alloced by launch_battle.
+ */
 int get_unalloced_battle() {
     int ret_bid = -1;
     pthread_mutex_lock(&battles_lock);
-    for (int i = 1; i < USER_CNT; i++) {
-        if (battles[i].is_alloced == false) {
-            battles[i].reset();
-            battles[i].is_alloced = true;
+    pthread_mutex_lock(&scheduler.lock);
+    for (int i = 1; i < battles.size(); i++) {
+        if (!battles[i].is_alloced && !battles[i].scheduled) {
             ret_bid = i;
             break;
         }
     }
+    pthread_mutex_unlock(&scheduler.lock);
+    if (ret_bid == -1) {
+        ret_bid = battles.grow();
+    }
     pthread_mutex_unlock(&battles_lock);
     if (ret_bid == -1) {
-        loge("check here, returned battle id should not be -1");
+        loge("no more battles can be created");
     } else {
         log("alloc unalloced battle id #%d", ret_bid);
     }
@@ -326,15 +894,21 @@ int get_unalloced_battle() {
 int get_unused_session() {
     int ret_uid = -1;
     pthread_mutex_lock(&sessions_lock);
-    for (int i = 0; i < USER_CNT; i++) {
-        if (sessions[i].state == USER_STATE_UNUSED) {
-            memset(&sessions[i], 0, sizeof(struct session_t));
-            sessions[i].conn = -1;
-            sessions[i].state = USER_STATE_NOT_LOGIN;
+    for (int i = 0; i < sessions.size(); i++) {
+        // a battle may not have applied the quit of the last user yet
+        if (sessions[i].state == USER_STATE_UNUSED && sessions[i].slots == 0) {
             ret_uid = i;
             break;
         }
     }
+    if (ret_uid == -1 && (ret_uid = sessions.grow()) != -1) {
+        outqs.grow();
+        log("sessions grow to %d", sessions.size());
+    }
+    if (ret_uid != -1) {
+        sessions[ret_uid].reset();
+        sessions[ret_uid].state = USER_STATE_NOT_LOGIN;
+    }
     pthread_mutex_unlock(&sessions_lock);
     if (ret_uid == -1) {
         log("fail to alloc session id");
@@ -349,61 +923,102 @@ void inform_friends(int uid, int message) {
     char* user_name = sessions[uid].user_name;
     memset(&sm, 0, sizeof(server_message_t));
     sm.message = message;
-    for (int i = 0; i < USER_CNT; i++) {
+    for (int i = 0; i < sessions.size(); i++) {
         if (i == uid || !query_session_built(i))
             continue;
         strncpy(sm.friend_name, user_name, USERNAME_SIZE - 1);
-        wrap_send(sessions[i].conn, &sm);
-    }
+        wrap_send(i, &sm);
+    }
+}
+
+void link_item(int bid, int slot) {
+    item_pool_t& items = battles[bid].items;
+    int cell = battles[bid].cell(items.x[slot], items.y[slot]);
+    int32_t& tail = battles[bid].cell_tail[cell];
+    items.cell_prev[slot] = tail;
+    items.cell_next[slot] = -1;
+    if (tail >= 0) items.cell_next[tail] = slot;
+    else battles[bid].cell_head[cell] = slot;
+    tail = slot;
+}
+
+// (x, y) is the cell whose chain holds the slot
+void unlink_item(int bid, int slot, int x, int y) {
+    item_pool_t& items = battles[bid].items;
+    int prev = items.cell_prev[slot], next = items.cell_next[slot];
+    if (prev >= 0) items.cell_next[prev] = next;
+    else battles[bid].cell_head[battles[bid].cell(x, y)] = next;
+    if (next >= 0) items.cell_prev[next] = prev;
+    else battles[bid].cell_tail[battles[bid].cell(x, y)] = prev;
+}
+
+/* all insertions and removals of battle items go through these two, which
+ * keep the cell chains in step with `items`.
+ */
+int add_item(int bid, int kind, int x, int y, uint64_t time, int owner = -1, int dir = 0) {
+    item_pool_t& items = battles[bid].items;
+    int slot = items.alloc();
+    items.kind[slot] = kind;
+    items.dir[slot] = dir;
+    items.x[slot] = x;
+    items.y[slot] = y;
+    items.owner[slot] = owner;
+    items.count[slot] = kind == ITEM_MAGMA ? MAGMA_INIT_TIMES : 0;
+    items.id[slot] = ++battles[bid].item_count;
+    items.time[slot] = time;
+    items.timer[slot] = battles[bid].timers.add(time, TIMER_ITEM_EXPIRE, items.handle(slot));
+    link_item(bid, slot);
+    // only the tick adds and erases, a scrape reads
+    atomic<int>& live = battles[bid].item_kinds[kind];
+    live.store(live.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    return slot;
+}
+
+void erase_item(int bid, int slot) {
+    atomic<int>& live = battles[bid].item_kinds[battles[bid].items.kind[slot]];
+    live.store(live.load(memory_order_relaxed) - 1, memory_order_relaxed);
+    if (battles[bid].items.timer[slot] >= 0)
+        battles[bid].timers.cancel(battles[bid].items.timer[slot]);
+    unlink_item(bid, slot, battles[bid].items.x[slot], battles[bid].items.y[slot]);
+    battles[bid].items.release(slot);
+}
+
+void set_item_expiry(int bid, int slot, uint64_t time) {
+    item_pool_t& items = battles[bid].items;
+    battles[bid].timers.cancel(items.timer[slot]);
+    items.time[slot] = time;
+    items.timer[slot] = battles[bid].timers.add(time, TIMER_ITEM_EXPIRE, items.handle(slot));
 }
 
 void forced_generate_items(int bid, int x, int y, int kind, int count, int uid = -1) {
     //if (battles[bid].num_of_other >= MAX_OTHER) return;
-    if (x < 0 || x >= BATTLE_W) return;
-    if (y < 0 || y >= BATTLE_H) return;
-    battles[bid].item_count++;
-    item_t new_item;
-    new_item.id = battles[bid].item_count;
-    new_item.kind = kind;
-    new_item.pos.x = x;
-    new_item.pos.y = y;
-    new_item.time = battles[bid].global_time + count;
-    new_item.owner = uid;
-    if (kind == ITEM_MAGMA) {
-        new_item.count = MAGMA_INIT_TIMES;
-    }
-    battles[bid].items.push_back(new_item);
+    if (x < 0 || x >= battles[bid].w) return;
+    if (y < 0 || y >= battles[bid].h) return;
+    int slot = add_item(bid, kind, x, y, battles[bid].global_time + count, uid);
     log("new %s #%d (%d,%d)",
-        item_s[new_item.kind],
-        new_item.id,
-        new_item.pos.x,
-        new_item.pos.y);
+        item_s[kind],
+        battles[bid].items.id[slot],
+        x,
+        y);
 }
 
 void random_generate_items(int bid) {
     int random_kind;
-    if (!probability(1, 100)) return;
-    if (battles[bid].num_of_other >= MAX_OTHER) return;
-    random_kind = rand() % (ITEM_END - 1) + 1;
-    if (random_kind == ITEM_BLOOD_VIAL && probability(1, 2))
+    rng_t* rng = &battles[bid].rng;
+    if (!probability(rng, 1, 100)) return;
+    if (battles[bid].num_of_other >= MAX_OTHER * battles[bid].screens) return;
+    random_kind = rng->below(ITEM_END - 1) + 1;
+    if (random_kind == ITEM_BLOOD_VIAL && probability(rng, 1, 2))
         random_kind = ITEM_MAGAZINE;
-    battles[bid].item_count++;
-    item_t new_item;
-    new_item.id = battles[bid].item_count;
-    new_item.kind = random_kind;
-    new_item.pos.x = (rand() & 0x7FFF) % BATTLE_W;
-    new_item.pos.y = (rand() & 0x7FFF) % BATTLE_H;
-    new_item.time = battles[bid].global_time + OTHER_ITEM_LASTS_TIME;
+    int x = rng->below(battles[bid].w);
+    int y = rng->below(battles[bid].h);
+    int slot = add_item(bid, random_kind, x, y, battles[bid].global_time + OTHER_ITEM_LASTS_TIME);
     battles[bid].num_of_other++;
     log("new %s #%d (%d,%d)",
-        item_s[new_item.kind],
-        new_item.id,
-        new_item.pos.x,
-        new_item.pos.y);
-    if (random_kind == ITEM_MAGMA) {
-        new_item.count = MAGMA_INIT_TIMES;
-    }
-    battles[bid].items.push_back(new_item);
+        item_s[random_kind],
+        battles[bid].items.id[slot],
+        x,
+        y);
     //for (int i = 0; i < USER_CNT; i++) {
     //    if (battles[bid].users[i].battle_state != BATTLE_STATE_LIVE)
     //        continue;
@@ -412,144 +1027,102 @@ void random_generate_items(int bid) {
 }
 
 void move_bullets(int bid) {
-    for (auto& cur : battles[bid].items) {
-    //for (int i = 0; i < MAX_ITEM; i++) {
-        if (cur.kind != ITEM_BULLET)
-            continue;
-        // log("try to move bullet %d with dir %d", i, cur.dir);
-        switch (cur.dir) {
-            case DIR_UP: {
-                if (cur.pos.y > 0) { (cur.pos.y)--; break; }
-                else { cur.dir = DIR_DOWN; break;}
-            }
-            case DIR_DOWN: {
-                if (cur.pos.y < BATTLE_H - 1) { (cur.pos.y)++; break; }
-                else { cur.dir = DIR_UP; break;}
-            }
-            case DIR_LEFT: {
-                if (cur.pos.x > 0) { (cur.pos.x)--; break; }
-                else { cur.dir = DIR_RIGHT; break;}
-            }
-            case DIR_RIGHT: {
-                if (cur.pos.x < BATTLE_W - 1) { (cur.pos.x)++; break; }
-                else { cur.dir = DIR_LEFT; break; }
-            }
-            case DIR_UP_LEFT: {
-                if (cur.pos.y > 0) { (cur.pos.y)--; }
-                else { cur.dir = DIR_DOWN_LEFT; break; }
-                if (cur.pos.x > 1) { (cur.pos.x) -= 2; }
-                else { cur.dir = DIR_UP_RIGHT; break; }
-                break;
-            }
-            case DIR_UP_RIGHT: {
-                if (cur.pos.y > 0) { (cur.pos.y)--; }
-                else { cur.dir = DIR_DOWN_RIGHT; break;}
-                if (cur.pos.x < BATTLE_W - 2) { (cur.pos.x) += 2; }
-                else { cur.dir = DIR_UP_LEFT; break; }
-                break;
-            }
-            case DIR_DOWN_LEFT: {
-                if (cur.pos.y < BATTLE_H - 2) { (cur.pos.y)++; }
-                else { cur.dir = DIR_UP_LEFT; break; }
-                if (cur.pos.x > 1) { (cur.pos.x) -= 2; }
-                else { cur.dir = DIR_DOWN_RIGHT; break; }
-                break;
-            }
-            case DIR_DOWN_RIGHT: {
-                if (cur.pos.y < BATTLE_H - 2) { (cur.pos.y)++; }
-                else { cur.dir = DIR_UP_RIGHT; break;}
-                if (cur.pos.x < BATTLE_W - 2) { (cur.pos.x) += 2; }
-                else { cur.dir = DIR_DOWN_LEFT; break; }
-                break;
-            }
+    item_pool_t& items = battles[bid].items;
+    int n = (items.end + BULLET_BLOCK - 1) / BULLET_BLOCK * BULLET_BLOCK;
+    bullets_advance(&battles[bid].rules, ITEM_BULLET, items.kind, items.dir,
+                    items.x, items.y, items.prev_x, items.prev_y, items.moved, n);
+    for (int i = 0; i < n / BULLET_BLOCK; i++) {
+        for (uint32_t bits = items.moved[i]; bits; bits &= bits - 1) {
+            int slot = i * BULLET_BLOCK + __builtin_ctz(bits);
+            unlink_item(bid, slot, items.prev_x[slot], items.prev_y[slot]);
+            link_item(bid, slot);
         }
     }
 }
 
-void check_user_status(int uid) {
+void check_user_status(int bid, int pid) {
     //log("checking...");
     //auto start_time = myclock();
-    int bid = sessions[uid].bid;
-    int ux = battles[bid].users[uid].pos.x;
-    int uy = battles[bid].users[uid].pos.y;
-    //for (int i = 0; i < MAX_ITEM; i++) {
-    auto& items = battles[bid].items;
-    if (battles[bid].users[uid].battle_state != BATTLE_STATE_LIVE) {
+    battle_t::user_t& user = battles[bid].users[pid];
+    int uid = user.uid;
+    int ux = user.pos.x;
+    int uy = user.pos.y;
+    if (user.battle_state != BATTLE_STATE_LIVE) {
         return;
     }
-    for (auto it = items.begin(), next = std::next(it); it != items.end(); it = next) {
-
-        next = std::next(it);
-
-        int ix = it->pos.x;
-        int iy = it->pos.y;
-
-        if (ix == ux && iy == uy) {
-            switch (it->kind) {
-                case ITEM_MAGAZINE: {
-                    battles[bid].users[uid].energy += BULLETS_PER_MAGAZINE;
-                    log("user #%d %s\033[2m(%s)\033[0m is got magazine", uid, sessions[uid].user_name, sessions[uid].ip_addr);
-                    if (battles[bid].users[uid].energy > MAX_BULLETS) {
-                        log("user #%d %s\033[2m(%s)\033[0m 's bullets exceeds max value", uid, sessions[uid].user_name, sessions[uid].ip_addr);
-                        battles[bid].users[uid].energy = MAX_BULLETS;
-                    }
-                    send_to_client(uid, SERVER_MESSAGE_YOU_GOT_MAGAZINE);
-                    it = items.erase(it);
-                    //log("current item size: %ld", items.size());
-                    break;
+    item_pool_t& items = battles[bid].items;
+    // items generated here join the tail of the chain and are checked too
+    for (int it = battles[bid].cell_head[battles[bid].cell(ux, uy)], next; it >= 0; it = next) {
+        next = items.cell_next[it];
+
+        int ix = items.x[it];
+        int iy = items.y[it];
+
+        switch (items.kind[it]) {
+            case ITEM_MAGAZINE: {
+                user.energy += BULLETS_PER_MAGAZINE;
+                log("user #%d %s\033[2m(%s)\033[0m is got magazine", uid, sessions[uid].user_name, sessions[uid].ip_addr);
+                if (user.energy > MAX_BULLETS) {
+                    log("user #%d %s\033[2m(%s)\033[0m 's bullets exceeds max value", uid, sessions[uid].user_name, sessions[uid].ip_addr);
+                    user.energy = MAX_BULLETS;
                 }
-                case ITEM_MAGMA: {
-                    if (it->owner != uid) {
-                        battles[bid].users[uid].life = max(battles[bid].users[uid].life - 1, 0);
-                        battles[bid].users[uid].killby = it->owner;
-                        it->count--;
-                        log("user #%d %s\033[2m(%s)\033[0m is trapped in magma", uid, sessions[uid].user_name, sessions[uid].ip_addr);
-                        send_to_client(uid, SERVER_MESSAGE_YOU_ARE_TRAPPED_IN_MAGMA);
-                        if (it->count <= 0) {
-                            log("magma #%d is exhausted", it->id);
-                            battles[bid].num_of_other--;
-                            it = items.erase(it);
-                            //log("current item size: %ld", items.size());
-                        }
+                send_to_client(uid, SERVER_MESSAGE_YOU_GOT_MAGAZINE);
+                erase_item(bid, it);
+                //log("current item size: %ld", items.size());
+                break;
+            }
+            case ITEM_MAGMA: {
+                if (items.owner[it] != uid) {
+                    user.life = max(user.life - 1, 0);
+                    user.killby = items.owner[it];
+                    items.count[it]--;
+                    log("user #%d %s\033[2m(%s)\033[0m is trapped in magma", uid, sessions[uid].user_name, sessions[uid].ip_addr);
+                    send_to_client(uid, SERVER_MESSAGE_YOU_ARE_TRAPPED_IN_MAGMA);
+                    if (items.count[it] <= 0) {
+                        log("magma #%d is exhausted", items.id[it]);
+                        battles[bid].num_of_other--;
+                        erase_item(bid, it);
+                        //log("current item size: %ld", items.size());
                     }
-                    break;
                 }
-                case ITEM_BLOOD_VIAL: {
-                    battles[bid].users[uid].life += LIFE_PER_VIAL;
-                    log("user #%d %s\033[2m(%s)\033[0m got blood vial", uid, sessions[uid].user_name, sessions[uid].ip_addr);
-                    if (battles[bid].users[uid].life > MAX_LIFE) {
-                        log("user #%d %s\033[2m(%s)\033[0m life exceeds max value", uid, sessions[uid].user_name, sessions[uid].ip_addr);
-                        battles[bid].users[uid].life = MAX_LIFE;
-                    }
-                    //log("current item size: %ld", items.size());
-                    battles[bid].num_of_other--;
-                    send_to_client(uid, SERVER_MESSAGE_YOU_GOT_BLOOD_VIAL);
-                    it = items.erase(it);
-                    break;
+                break;
+            }
+            case ITEM_BLOOD_VIAL: {
+                user.life += LIFE_PER_VIAL;
+                log("user #%d %s\033[2m(%s)\033[0m got blood vial", uid, sessions[uid].user_name, sessions[uid].ip_addr);
+                if (user.life > MAX_LIFE) {
+                    log("user #%d %s\033[2m(%s)\033[0m life exceeds max value", uid, sessions[uid].user_name, sessions[uid].ip_addr);
+                    user.life = MAX_LIFE;
                 }
-                case ITEM_BULLET: {
-                    if (it->owner != uid) {
-                        battles[bid].users[uid].life = max(battles[bid].users[uid].life - 1, 0);
-                        battles[bid].users[uid].killby = it->owner;
-                        log("user #%d %s\033[2m(%s)\033[0m is shooted", uid, sessions[uid].user_name, sessions[uid].ip_addr);
-                        //log("current item size: %ld", items.size());
-                        send_to_client(uid, SERVER_MESSAGE_YOU_ARE_SHOOTED);
-                        it = items.erase(it);
-                        break;
-                    }
+                //log("current item size: %ld", items.size());
+                battles[bid].num_of_other--;
+                send_to_client(uid, SERVER_MESSAGE_YOU_GOT_BLOOD_VIAL);
+                erase_item(bid, it);
+                break;
+            }
+            case ITEM_BULLET: {
+                if (items.owner[it] != uid) {
+                    user.life = max(user.life - 1, 0);
+                    user.killby = items.owner[it];
+                    log("user #%d %s\033[2m(%s)\033[0m is shooted", uid, sessions[uid].user_name, sessions[uid].ip_addr);
+                    //log("current item size: %ld", items.size());
+                    send_to_client(uid, SERVER_MESSAGE_YOU_ARE_SHOOTED);
+                    erase_item(bid, it);
                     break;
                 }
-                case ITEM_LANDMINE: {
-					if (it->owner != uid) {
-						it->time = battles[bid].global_time;
-						forced_generate_items(bid, ix, iy, ITEM_MAGMA, 7, it->owner);
-						forced_generate_items(bid, ix - 1, iy, ITEM_MAGMA, 7, it->owner);
-						forced_generate_items(bid, ix + 1, iy, ITEM_MAGMA, 7, it->owner);
-						forced_generate_items(bid, ix, iy - 1, ITEM_MAGMA, 7, it->owner);
-						forced_generate_items(bid, ix, iy + 1, ITEM_MAGMA, 7, it->owner);
+                break;
+            }
+            case ITEM_LANDMINE: {
+					if (items.owner[it] != uid) {
+						set_item_expiry(bid, it, battles[bid].global_time);
+						forced_generate_items(bid, ix, iy, ITEM_MAGMA, 7, items.owner[it]);
+						forced_generate_items(bid, ix - 1, iy, ITEM_MAGMA, 7, items.owner[it]);
+						forced_generate_items(bid, ix + 1, iy, ITEM_MAGMA, 7, items.owner[it]);
+						forced_generate_items(bid, ix, iy - 1, ITEM_MAGMA, 7, items.owner[it]);
+						forced_generate_items(bid, ix, iy + 1, ITEM_MAGMA, 7, items.owner[it]);
+						next = items.cell_next[it];
 					}
-                    break;
-                }
+                break;
             }
         }
     }
@@ -561,27 +1134,30 @@ void check_all_user_status(int bid) {
     //for (int i = 0; i < MAX_ITEM; i++) {
     //log("checking...");
     //log("completed.");
-    for (int i = 0; i < USER_CNT; i++) {
-        if (battles[bid].users[i].battle_state != BATTLE_STATE_LIVE) continue;
-        check_user_status(i);
+    for (int pid = 0; pid < (int)battles[bid].users.size(); pid++) {
+        if (battles[bid].users[pid].battle_state != BATTLE_STATE_LIVE) continue;
+        check_user_status(bid, pid);
     }
 }
 
 void check_who_is_dead(int bid) {
-    for (int i = 0; i < USER_CNT; i++) {
-        if (battles[bid].users[i].battle_state == BATTLE_STATE_LIVE
-            && battles[bid].users[i].life <= 0) {
+    for (auto& user : battles[bid].users) {
+        int i = user.uid;
+        if (user.battle_state == BATTLE_STATE_LIVE
+            && user.life <= 0) {
             log("user #%d %s\033[2m(%s)\033[0m is dead", i, sessions[i].user_name, sessions[i].ip_addr);
-            battles[bid].users[i].battle_state = BATTLE_STATE_DEAD;
+            user.battle_state = BATTLE_STATE_DEAD;
             battles[bid].alive_users--;
             log("send dead info to user #%d %s\033[2m(%s)\033[0m", i, sessions[i].user_name, sessions[i].ip_addr);
             send_to_client(i, SERVER_MESSAGE_YOU_ARE_DEAD);
             sessions[i].death++;
-            log("death of user #%d %s\033[2m(%s)\033[0m: %d", i, sessions[i].user_name, sessions[i].ip_addr, sessions[i].death);
-            if (battles[bid].users[i].killby != -1) {
-                int by = battles[bid].users[i].killby;
+            log("death of user #%d %s\033[2m(%s)\033[0m: %d", i, sessions[i].user_name, sessions[i].ip_addr, sessions[i].death.load());
+            // a killer who left the battle meanwhile may be on another session now
+            battle_t::user_t* killer = user.killby != -1 ? battle_user(bid, user.killby) : NULL;
+            if (killer) {
+                int by = user.killby;
                 sessions[by].kill++;
-                log("kill of user #%d %s\033[2m(%s)\033[0m: %d", i, sessions[by].user_name, sessions[by].ip_addr, sessions[by].kill);
+                log("kill of user #%d %s\033[2m(%s)\033[0m: %d", i, sessions[by].user_name, sessions[by].ip_addr, sessions[by].kill.load());
                 double delta = (double)sessions[i].score / sessions[by].score;
                 delta = delta * delta;
                 if (delta > 4) delta = 4;
@@ -589,14 +1165,16 @@ void check_who_is_dead(int bid) {
                 int d = min(round(5. * delta), sessions[i].score);
                 sessions[i].score -= d;
                 sessions[by].score += d;
-                battles[bid].users[by].energy += battles[bid].users[i].energy;
+                killer->energy += user.energy;
+                save_stats(by);
             } else {
                 sessions[i].score = max(sessions[i].score - 5, 0);
             }
-        } else if (battles[bid].users[i].battle_state == BATTLE_STATE_DEAD) {
-            battles[bid].users[i].battle_state = BATTLE_STATE_WITNESS;
-            battles[bid].users[i].energy = 0;
-            battles[bid].users[i].life = 0;
+            save_stats(i);
+        } else if (user.battle_state == BATTLE_STATE_DEAD) {
+            user.battle_state = BATTLE_STATE_WITNESS;
+            user.energy = 0;
+            user.life = 0;
         }
     }
 }
@@ -617,20 +1195,23 @@ void clear_items(int bid) {
     //    }
     //}
     //log("check completed...");
-    auto& items = battles[bid].items;
+    item_pool_t& items = battles[bid].items;
     size_t cnt[ITEM_SIZE] = {0};
-    for (auto cur = items.begin(), next = std::next(cur);
-              cur != items.end();
-              cur = next) {
-        next = std::next(cur);
-        if (cur->time <= battles[bid].global_time) {
-            if (cur->kind < ITEM_END) {
-                battles[bid].num_of_other--;
+    battles[bid].timers.advance(battles[bid].global_time, [&](int kind, uint32_t arg) {
+        switch (kind) {
+            case TIMER_ITEM_EXPIRE: {
+                int slot = items.resolve(arg);
+                if (slot < 0) break;
+                items.timer[slot] = -1;  // fired already
+                if (items.kind[slot] < ITEM_END) {
+                    battles[bid].num_of_other--;
+                }
+                cnt[items.kind[slot]]++;
+                erase_item(bid, slot);
+                break;
             }
-            cnt[cur->kind]++;
-            next = battles[bid].items.erase(cur);
         }
-    }
+    });
     //int cleared = 0;
     for (int i = 0; i < ITEM_SIZE; i++) {
         if (cnt[i]) {
@@ -641,40 +1222,139 @@ void clear_items(int bid) {
     //if (cleared) log("current item size: %ld", items.size());
 }
 
-void render_map_for_user(int uid, server_message_t* psm) {
-    int bid = sessions[uid].bid;
-    int map[BATTLE_H][BATTLE_W] = {0};
-    int cur, x, y;
-    //for (int i = 0, x, y; i < MAX_ITEM; i++) {
-    for (auto it : battles[bid].items) {
-        x = it.pos.x;
-        y = it.pos.y;
-        switch (it.kind) {
+#define BULLET_OWNER_NONE  -1
+#define BULLET_OWNER_MIXED -2
+
+/* rasterize the map once per tick. players only see it differently in
+ * cells where all bullets are their own (drawn as MY_BULLET unless a
+ * higher item covers them) and where their own landmines lie, those
+ * cells go to a small overlay per player. only the cells painted last
+ * time are cleared, so the cost follows the items and not the arena.
+ */
+void render_battle_layer(int bid) {
+    battle_t& b = battles[bid];
+    item_pool_t& items = b.items;
+    for (int cell : b.painted)
+        b.layer[cell] = 0;
+    for (auto& cell : b.bullet_cells)
+        b.bullet_owner[b.cell(cell.x, cell.y)] = BULLET_OWNER_NONE;
+    b.painted.clear();
+    b.bullet_cells.clear();
+    b.landmines.clear();
+    for (auto& overlay : b.overlay)
+        overlay.clear();
+
+    for (int i = 0; i < items.end; i++) {
+        int x = items.x[i], y = items.y[i];
+        switch (items.kind[i]) {
+            case ITEM_NONE:
+                break;
             case ITEM_BULLET: {
-                if (it.owner == uid) {
-                    map[y][x] = max(map[y][x], MAP_ITEM_MY_BULLET);
-                } else {
-                    map[y][x] = max(map[y][x], MAP_ITEM_OTHER_BULLET);
+                int32_t& owner = b.bullet_owner[b.cell(x, y)];
+                if (owner == BULLET_OWNER_NONE) {
+                    pos_t cell = { (uint16_t)x, (uint16_t)y };
+                    b.bullet_cells.push_back(cell);
+                    owner = items.owner[i];
+                } else if (owner != items.owner[i]) {
+                    owner = BULLET_OWNER_MIXED;
                 }
                 break;
             }
-            case ITEM_LANDMINE: {
-                if (it.owner != uid) break;
-                map[y][x] = max(map[y][x], item_to_map[ITEM_LANDMINE]);
-            }
+            case ITEM_LANDMINE:
+                b.landmines.push_back(i);
+                break;
             default: {
-                cur = item_to_map[it.kind];
-                map[y][x] = max(map[y][x], cur);
+                uint8_t& cur = b.layer[b.cell(x, y)];
+                if (!cur) b.painted.push_back(b.cell(x, y));
+                cur = max(cur, item_to_map[items.kind[i]]);
             }
         }
-        //sm.item_kind[i] = it.kind;
-        //sm.item_pos[i].x = it.pos.x;
-        //sm.item_pos[i].y = it.pos.y;
     }
+
+    for (auto& cell : b.bullet_cells) {
+        uint8_t& cur = b.layer[b.cell(cell.x, cell.y)];
+        if (!cur) b.painted.push_back(b.cell(cell.x, cell.y));
+        cur = max(cur, MAP_ITEM_OTHER_BULLET);
+        int owner = b.bullet_owner[b.cell(cell.x, cell.y)];
+        if (cur != MAP_ITEM_OTHER_BULLET || owner < 0) continue;
+        int pid = battle_slot(bid, owner);
+        if (pid >= 0) {
+            overlay_cell_t mine = { cell.x, cell.y, MAP_ITEM_MY_BULLET };
+            b.overlay[pid].push_back(mine);
+        }
+    }
+    // after the bullets, a landmine shows over anything
+    for (int i : b.landmines) {
+        int pid = battle_slot(bid, items.owner[i]);
+        if (pid < 0) continue;
+        overlay_cell_t mine = { items.x[i], items.y[i], (uint8_t)item_to_map[ITEM_LANDMINE] };
+        b.overlay[pid].push_back(mine);
+    }
+}
+
+// the window of the arena shown to a player at `pos`, kept inside the arena
+pos_t view_of(int bid, pos_t pos) {
+    pos_t view;
+    view.x = min(max(pos.x - BATTLE_W / 2, 0), battles[bid].w - BATTLE_W);
+    view.y = min(max(pos.y - BATTLE_H / 2, 0), battles[bid].h - BATTLE_H);
+    return view;
+}
+
+void render_map_for_user(int bid, int pid, pos_t view, uint8_t map[BATTLE_H][BATTLE_W]) {
+    battle_t& b = battles[bid];
+    for (int i = 0; i < BATTLE_H; i++)
+        memcpy(map[i], &b.layer[b.cell(view.x, view.y + i)], BATTLE_W);
+    for (auto& cell : b.overlay[pid]) {
+        int x = cell.x - view.x, y = cell.y - view.y;
+        if (x < 0 || x >= BATTLE_W || y < 0 || y >= BATTLE_H) continue;
+        map[y][x] = cell.item;
+    }
+}
+
+/* render the next battle frame of the user in slot `pid` and encode it
+ * against the last frame the client acknowledged, fall back to a keyframe
+ * if that frame is too old, too different or it's time for a periodic
+ * keyframe.
+ */
+void encode_battle_frame(int bid, int pid, server_message_t* psm) {
+    int uid = battles[bid].users[pid].uid;
+    uint32_t seq = ++sessions[uid].frame_seq;
+    uint32_t base_seq = sessions[uid].acked_seq;
+    uint8_t (*map)[BATTLE_W] = frame_history_store(&sessions[uid].frames, seq);
+    uint8_t (*base)[BATTLE_W] = NULL;
+
+    render_map_for_user(bid, pid, psm->view, map);
+
+    if (base_seq != 0 && seq - base_seq < FRAME_HISTORY
+        && seq % KEYFRAME_INTERVAL != 0) {
+        base = frame_history_find(&sessions[uid].frames, base_seq);
+    }
+
+    psm->frame_seq = seq;
+    if (base != NULL) {
+        int cnt = 0;
+        for (int i = 0; i < BATTLE_H && cnt <= MAX_DELTA_CELLS; i++) {
+            if (memcmp(map[i], base[i], BATTLE_W) == 0) continue;
+            for (int j = 0; j < BATTLE_W; j++) {
+                if (map[i][j] == base[i][j]) continue;
+                if (cnt == MAX_DELTA_CELLS) { cnt++; break; }
+                psm->cells[cnt].x = j;
+                psm->cells[cnt].y = i;
+                psm->cells[cnt].item = map[i][j];
+                cnt++;
+            }
+        }
+        if (cnt <= MAX_DELTA_CELLS) {
+            psm->base_seq = base_seq;
+            psm->nr_cells = cnt;
+            return;
+        }
+    }
+
+    psm->base_seq = 0;
+    psm->nr_cells = 0;
     for (int i = 0; i < BATTLE_H; i++) {
         for (int j = 0; j < BATTLE_W; j += 2) {
-            //psm->map[i][j] = map[i][j];
-            //if (psm->map[i][j] != 0) log("set item #%d", psm->map[i][j]);
             psm->map[i][j >> 1] = (map[i][j]) | (map[i][j + 1] << 4);
         }
     }
@@ -683,35 +1363,67 @@ void render_map_for_user(int uid, server_message_t* psm) {
 void inform_all_user_battle_player(int bid) {
     server_message_t sm;
     sm.message = SERVER_MESSAGE_BATTLE_PLAYER;
-    for (int i = 0; i < USER_CNT; i++) {
-        if (battles[bid].users[i].battle_state == BATTLE_STATE_LIVE &&
-            battles[bid].users[i].life > 0) {
-            strncpy(sm.users[i].name, sessions[i].user_name, USERNAME_SIZE - 1);
-            sm.users[i].namecolor = i % color_s_size + 1;
-            sm.users[i].life = battles[bid].users[i].life;
-            sm.users[i].score = sessions[i].score;
-            sm.users[i].death = sessions[i].death;
-            sm.users[i].kill = sessions[i].kill;
-        } else {
-            strcpy(sm.users[i].name, (char*)"");
-            sm.users[i].namecolor = 0;
-            sm.users[i].life = 0;
-            sm.users[i].score = 0;
-            sm.users[i].death = 0;
-            sm.users[i].kill = 0;
-        }
-    }
-    for (int i = 0; i < USER_CNT; i++) {
-        for (int j = i + 1; j < USER_CNT; j++) {
-            if (sm.users[i].score < sm.users[j].score) {
-                std::swap(sm.users[i], sm.users[j]);
-            }
+    sm.nr_users = 0;
+    for (int pid = 0; pid < (int)battles[bid].users.size(); pid++) {
+        battle_t::user_t& user = battles[bid].users[pid];
+        if (user.battle_state != BATTLE_STATE_LIVE || user.life <= 0)
+            continue;
+        player_score_t& score = sm.users[sm.nr_users++];
+        memset(&score, 0, sizeof(score));
+        strncpy(score.name, sessions[user.uid].user_name, USERNAME_SIZE - 1);
+        score.namecolor = pid % color_s_size + 1;
+        score.life = user.life;
+        score.score = sessions[user.uid].score;
+        score.death = sessions[user.uid].death;
+        score.kill = sessions[user.uid].kill;
+    }
+    std::stable_sort(sm.users, sm.users + sm.nr_users,
+                     [](const player_score_t& a, const player_score_t& b) {
+                         return a.score > b.score;
+                     });
+    for (auto& user : battles[bid].users) {
+        if (user.battle_state != BATTLE_STATE_UNJOINED) {
+            wrap_send(user.uid, &sm);
         }
     }
-    for (int i = 0; i < USER_CNT; i++) {
-        if (battles[bid].users[i].battle_state != BATTLE_STATE_UNJOINED) {
-            wrap_send(sessions[i].conn, &sm);
-            //log("inform user #%d %s\033[2m(%s)\033[0m", i, sessions[i].user_name, sessions[i].ip_addr);
+}
+
+/* move the players whose block changed between `buckets`, players
+ * who died or left drop out of them.
+ */
+void update_interest(int bid) {
+    battle_t& b = battles[bid];
+    for (int pid = 0; pid < (int)b.users.size(); pid++) {
+        battle_t::user_t& user = b.users[pid];
+        int bucket = user.battle_state == BATTLE_STATE_LIVE ? b.bucket_of(user.pos) : -1;
+        if (bucket == user.bucket) continue;
+        if (user.bucket >= 0) {
+            vector<int>& old = b.buckets[user.bucket];
+            old.erase(find(old.begin(), old.end(), pid));
+        }
+        if (bucket >= 0) b.buckets[bucket].push_back(pid);
+        user.bucket = bucket;
+    }
+}
+
+// the live players inside the window `view`
+void list_visible_users(int bid, pos_t view, server_message_t* psm) {
+    battle_t& b = battles[bid];
+    int bx = view.x / BATTLE_W, by = view.y / BATTLE_H;
+    psm->nr_visible = 0;
+    for (int j = by; j <= by + 1 && j < b.buckets_h; j++) {
+        for (int i = bx; i <= bx + 1 && i < b.buckets_w; i++) {
+            for (int pid : b.buckets[j * b.buckets_w + i]) {
+                battle_t::user_t& user = b.users[pid];
+                int x = user.pos.x - view.x, y = user.pos.y - view.y;
+                if (user.battle_state != BATTLE_STATE_LIVE) continue;
+                if (x < 0 || x >= BATTLE_W || y < 0 || y >= BATTLE_H) continue;
+                psm->visible[psm->nr_visible].index = pid;
+                psm->visible[psm->nr_visible].pos.x = x;
+                psm->visible[psm->nr_visible].pos.y = y;
+                psm->visible[psm->nr_visible].color = pid % color_s_size + 1;
+                psm->nr_visible++;
+            }
         }
     }
 }
@@ -719,120 +1431,736 @@ void inform_all_user_battle_player(int bid) {
 void inform_all_user_battle_state(int bid) {
     server_message_t sm;
     sm.message = SERVER_MESSAGE_BATTLE_INFORMATION;
-    for (int i = 0; i < USER_CNT; i++) {
-        if (battles[bid].users[i].battle_state == BATTLE_STATE_LIVE) {
-            sm.user_pos[i].x = battles[bid].users[i].pos.x;
-            sm.user_pos[i].y = battles[bid].users[i].pos.y;
-            sm.user_color[i] = i % color_s_size + 1;
-        } else {
-            sm.user_pos[i].x = -1;
-            sm.user_pos[i].y = -1;
-            sm.user_color[i] = 0;
+
+    update_interest(bid);
+    render_battle_layer(bid);
+    for (int pid = 0; pid < (int)battles[bid].users.size(); pid++) {
+        battle_t::user_t& user = battles[bid].users[pid];
+        if (user.battle_state != BATTLE_STATE_UNJOINED) {
+            sm.view = view_of(bid, user.pos);
+            sm.arena_w = battles[bid].w;
+            sm.arena_h = battles[bid].h;
+            sm.input_seq = sessions[user.uid].input_seq;
+            list_visible_users(bid, sm.view, &sm);
+            encode_battle_frame(bid, pid, &sm);
+            sm.index = pid;
+            sm.life = user.life;
+            sm.bullets_num = user.energy;
+            sm.color = pid % color_s_size + 1;
+            wrap_send(user.uid, &sm);
         }
     }
+}
 
-    for (int i = 0; i < USER_CNT; i++) {
-        if (battles[bid].users[i].battle_state != BATTLE_STATE_UNJOINED) {
-            render_map_for_user(i, &sm);
-            sm.index = i;
-            sm.life = battles[bid].users[i].life;
-            sm.bullets_num = battles[bid].users[i].energy;
-            sm.color = i % color_s_size + 1;
-            wrap_send(sessions[i].conn, &sm);
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* a record holds what it takes to play a battle again: its seed, the
+ * players who joined and left and every input its tick applied, each
+ * stamped with the tick it was applied in. a digest of the battle every
+ * RECORD_DIGEST_TICKS tells a replay whether it still agrees, see
+ * tickbench.cpp.
+ *
+ *     stg-record <version>
+ *     seed <seed> arena <w> <h> players <slots>
+ *     <tick> join <pid> <uid> <x> <y> <life> <energy>
+ *     <tick> quit <pid>
+ *     <tick> input <uid> <command>
+ *     <tick> digest <hash>
+ *
+ * players are seen joining and leaving as the tick starts, see
+ * apply_battle_controls. admin commands change a battle behind the
+ * record's back.
+ */
+void close_record(int bid) {
+    battle_t& b = battles[bid];
+    if (b.record == NULL) return;
+    fclose(b.record);
+    b.record = NULL;
+}
+
+void start_record(int bid) {
+    battle_t& b = battles[bid];
+    close_record(bid);
+    if (record_dir == NULL) return;
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/battle%d-%016lx.rec", record_dir, bid, b.seed);
+    if ((b.record = fopen(path, "w")) == NULL) {
+        logw("fail to record battle #%d to %s", bid, path);
+        return;
+    }
+    log("record battle #%d to %s", bid, path);
+    fprintf(b.record, "stg-record %d\n", RECORD_VERSION);
+    fprintf(b.record, "seed %lu arena %d %d players %d\n", b.seed, b.w, b.h, (int)b.users.size());
+}
+
+// FNV-1a over the state the simulation carries from tick to tick
+uint64_t battle_digest(int bid) {
+    battle_t& b = battles[bid];
+    item_pool_t& items = b.items;
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](uint64_t v) { hash = (hash ^ v) * 1099511628211ull; };
+    mix(b.global_time);
+    mix(b.item_count);
+    mix(b.num_of_other);
+    for (auto& user : b.users) {
+        if (user.battle_state == BATTLE_STATE_UNJOINED) continue;
+        mix(user.uid);
+        mix(user.battle_state);
+        mix(user.pos.x);
+        mix(user.pos.y);
+        mix(user.dir);
+        mix(user.life);
+        mix(user.energy);
+    }
+    for (int i = 0; i < items.end; i++) {
+        if (items.kind[i] == ITEM_NONE) continue;
+        mix(i);
+        mix(items.kind[i]);
+        mix(items.x[i]);
+        mix(items.y[i]);
+        mix(items.owner[i]);
+        mix(items.time[i]);
+    }
+    return hash;
+}
+
+static int (*battle_handler[256])(int bid, int pid);
+
+// the reactor counted the user in, so a slot is free for it
+void apply_join(int bid, const battle_control_t& c) {
+    battle_t& b = battles[bid];
+    int pid = 0;
+    while (pid < (int)b.users.size() && b.users[pid].battle_state != BATTLE_STATE_UNJOINED)
+        pid++;
+    if (pid == (int)b.users.size()) {
+        loge("battle #%d has no slot left for user #%d %s", bid, c.uid, c.user_name);
+        return;
+    }
+    battle_t::user_t& user = b.users[pid];
+    user.uid = c.uid;
+    user.dir = DIR_UP;
+    user.pos.x = c.arg[0];
+    user.pos.y = c.arg[1];
+    user.life = INIT_LIFE;
+    user.energy = INIT_BULLETS;
+    user.killby = -1;
+    user.battle_state = BATTLE_STATE_LIVE;
+    if (c.uid >= (int)b.pid_of.size())
+        b.pid_of.resize(c.uid + 1, -1);
+    b.pid_of[c.uid] = pid;
+    sessions[c.uid].slots++;
+    b.all_users++;
+    b.alive_users++;
+    log("user #%d %s takes slot %d of battle #%d, now %ld alive of %ld users",
+        c.uid, c.user_name, pid, bid, b.alive_users, b.all_users);
+    if (b.record)
+        fprintf(b.record, "%lu join %d %d %d %d %d %d\n", b.global_time,
+                pid, c.uid, user.pos.x, user.pos.y, user.life, user.energy);
+}
+
+void apply_quit(int bid, const battle_control_t& c) {
+    battle_t& b = battles[bid];
+    int pid = battle_slot(bid, c.uid);
+    if (pid < 0) return;
+    battle_t::user_t& user = b.users[pid];
+    b.all_users--;
+    if (user.battle_state == BATTLE_STATE_LIVE) {
+        b.alive_users--;
+        // leaving a fight that goes on costs a death, the session may have
+        // logged out meanwhile and then its account pays
+        if (b.alive_users != 0 && c.account >= 0) {
+            if (sessions[c.uid].account == c.account) {
+                sessions[c.uid].score = max(sessions[c.uid].score - 5, 0);
+                sessions[c.uid].death++;
+                save_stats(c.uid);
+            } else {
+                account_charge_quit(c.account);
+            }
+        }
+    }
+    user.battle_state = BATTLE_STATE_UNJOINED;
+    b.pid_of[c.uid] = -1;
+    log("user #%d %s leaves slot %d of battle #%d, now %ld alive of %ld users",
+        c.uid, c.user_name, pid, bid, b.alive_users, b.all_users);
+    if (b.record)
+        fprintf(b.record, "%lu quit %d\n", b.global_time, pid);
+
+    server_message_t sm;
+    sm.message = SERVER_MESSAGE_USER_QUIT_BATTLE;
+    strncpy(sm.friend_name, c.user_name, USERNAME_SIZE - 1);
+    for (auto& other : b.users) {
+        if (other.battle_state != BATTLE_STATE_UNJOINED) {
+            wrap_send(other.uid, &sm);
         }
     }
+    b.left.push_back(c.uid);
+}
+
+/* apply what the reactor posted since the last tick in the order it was
+ * posted, a user who quit and joined again leaves its old slot first.
+ */
+void apply_battle_controls(int bid) {
+    battle_t& b = battles[bid];
+    pthread_mutex_lock(&b.control_lock);
+    b.applying.swap(b.controls);
+    pthread_mutex_unlock(&b.control_lock);
+    for (auto& c : b.applying) {
+        battle_t::user_t* user = battle_user(bid, c.uid);
+        switch (c.kind) {
+            case CONTROL_JOIN: apply_join(bid, c); break;
+            case CONTROL_QUIT: apply_quit(bid, c); break;
+            case CONTROL_ENERGY: if (user) user->energy = c.arg[0]; break;
+            case CONTROL_LIFE: if (user) user->life = c.arg[0]; break;
+            case CONTROL_POS: {
+                if (user) {
+                    user->pos.x = c.arg[0];
+                    user->pos.y = c.arg[1];
+                }
+                break;
+            }
+        }
+    }
+    b.applying.clear();
+}
+
+/* the client of `uid` counts its moves up to `seq` as done, whether a
+ * tick applied them or they were dropped on the way. the reactor and
+ * the tick both get here, so it only ever moves forward.
+ */
+void mark_input_done(int uid, uint32_t seq) {
+    atomic<uint32_t>& done = sessions[uid].input_seq;
+    uint32_t cur = done.load();
+    while ((int32_t)(seq - cur) > 0 && !done.compare_exchange_weak(cur, seq)) {
+    }
+}
+
+/* run the inputs queued since the last tick, the tick is the only
+ * thread that moves players or adds their items. an input that was
+ * queued before its user left the battle is dropped. the sequence of
+ * the last move goes back with the next frame, so the client knows
+ * which of its predicted moves the frame already holds.
+ */
+void apply_battle_inputs(int bid) {
+    battle_t& b = battles[bid];
+    int uid, command;
+    uint32_t input_seq;
+    while (b.inputs.pop(&uid, &command, &input_seq)) {
+        int pid = battle_slot(bid, uid);
+        if (pid >= 0) {
+            if (b.record)
+                fprintf(b.record, "%lu input %d %d\n", b.global_time, uid, command);
+            battle_handler[command](bid, pid);
+        }
+        if (input_seq != 0)
+            mark_input_done(uid, input_seq);
+    }
+    // the inputs queued before a quit are drained, the session may be reused
+    for (int left : b.left)
+        sessions[left].slots--;
+    b.left.clear();
 }
 
-void* battle_ruler(void* args) {
-    int bid = (int)(uintptr_t)args;
-    log("battle ruler for battle #%d", bid);
-    // FIXME: battle re-alloced before exiting loop 
-    for (int i = 0; i < INIT_GRASS; i++) {
+// all a battle draws comes from its seed, starting with the grass
+void seed_battle(int bid, uint64_t seed) {
+    battles[bid].seed = seed;
+    battles[bid].rng.seed(seed);
+    for (int i = 0; i < INIT_GRASS * battles[bid].screens; i++) {
         forced_generate_items(bid,
-                              (rand() & 0x7FFF) % BATTLE_W,
-                              (rand() & 0x7FFF) % BATTLE_H,
+                              battles[bid].rng.below(battles[bid].w),
+                              battles[bid].rng.below(battles[bid].h),
                               ITEM_GRASS,
                               10000);
     }
-    uint64_t  t[2];
-    while (battles[bid].is_alloced) {
-        battles[bid].global_time++;
-        t[0] = myclock();
-        move_bullets(bid);
-        check_all_user_status(bid);
-        check_who_is_dead(bid);
-        inform_all_user_battle_state(bid);
-        if (battles[bid].global_time % 10 == 0) {
-            inform_all_user_battle_player(bid);
-        }
-        clear_items(bid);
-        random_generate_items(bid);
-        t[1] = myclock();
-        if (t[1] - t[0] >= 5) logw("current delay %lums", t[1] - t[0]);
-        //sum_delay_time += t[1] - t[0];
-        while (myclock() < t[0] + GLOBAL_SPEED) usleep(1000);
-    }
-    return NULL;
 }
 
-int check_user_registered(char* user_name, char* password) {
-    for (int i = 0; i < REGISTERED_USER_LIST_SIZE; i++) {
-        if (strncmp(user_name, registered_user_list[i].user_name, USERNAME_SIZE - 1) != 0)
+// the phases of one tick as they end, a phase that did not run stays 0
+struct tick_laps_t {
+    uint64_t start, last;
+    uint64_t ns[NR_PHASES];
+    bool ran[NR_PHASES];
+
+    void lap(int phase) {
+        uint64_t now = monotonic_ns();
+        ns[phase] = now - last;
+        ran[phase] = true;
+        last = now;
+    }
+
+    tick_laps_t() {
+        memset(this, 0, sizeof(*this));
+        start = last = monotonic_ns();
+    }
+};
+
+void profile_tick(int bid, tick_laps_t* laps) {
+    laps->ns[PHASE_TICK] = laps->last - laps->start;
+    laps->ran[PHASE_TICK] = true;
+    tick_profile_t& profile = battles[bid].profile;
+    pthread_mutex_lock(&profile.lock);
+    for (int i = 0; i < NR_PHASES; i++) {
+        if (laps->ran[i]) hist_record(&profile.phases[i], laps->ns[i]);
+    }
+    pthread_mutex_unlock(&profile.lock);
+
+    metric_add(METRIC_TICKS);
+    if (laps->ns[PHASE_TICK] >= BATTLE_TICK_NS)
+        metric_add(METRIC_TICK_OVERRUNS);
+    if (laps->ns[PHASE_TICK] >= SLOW_TICK_NS) {
+        int slowest = 0;
+        for (int i = 1; i < PHASE_TICK; i++) {
+            if (laps->ns[i] > laps->ns[slowest]) slowest = i;
+        }
+        logw("tick %lu of battle #%d took %luus, %luus in %s", battles[bid].global_time, bid,
+             laps->ns[PHASE_TICK] / 1000, laps->ns[slowest] / 1000, phase_s[slowest]);
+    }
+}
+
+/* one tick of a battle, run by whichever worker found it due. tickbench
+ * replays the same steps but the frames, keep the two in step.
+ */
+void battle_tick(int bid) {
+    if (battles[bid].global_time == 0) {
+        seed_battle(bid, monotonic_ns() * 0x9E3779B97F4A7C15ull ^ bid);
+        start_record(bid);
+        battles[bid].profile.reset();
+    }
+    tick_laps_t laps;
+    battles[bid].global_time++;
+    apply_battle_controls(bid);
+    apply_battle_inputs(bid);
+    laps.lap(PHASE_INPUTS);
+    move_bullets(bid);
+    laps.lap(PHASE_BULLETS);
+    check_all_user_status(bid);
+    laps.lap(PHASE_STATUS);
+    check_who_is_dead(bid);
+    laps.lap(PHASE_DEATH);
+    inform_all_user_battle_state(bid);
+    laps.lap(PHASE_STATE);
+    if (battles[bid].global_time % 10 == 0) {
+        inform_all_user_battle_player(bid);
+        laps.lap(PHASE_PLAYERS);
+    }
+    clear_items(bid);
+    laps.lap(PHASE_CLEAR);
+    for (int i = 0; i < battles[bid].screens; i++)
+        random_generate_items(bid);
+    laps.lap(PHASE_GENERATE);
+    if (battles[bid].record && battles[bid].global_time % RECORD_DIGEST_TICKS == 0)
+        fprintf(battles[bid].record, "%lu digest %016lx\n", battles[bid].global_time, battle_digest(bid));
+    profile_tick(bid, &laps);
+}
+
+/* the last user left battle `bid`, called with scheduler.lock held so
+ * that it is not launched again halfway through. the quits still queued
+ * are applied first, leaving a fight that goes on still costs a death,
+ * and the inputs left behind are drained.
+ */
+void drop_battle(int bid) {
+    log("battle #%d is no longer scheduled", bid);
+    apply_battle_controls(bid);
+    apply_battle_inputs(bid);
+    close_record(bid);
+    battles[bid].reset();
+    battles[bid].scheduled = false;
+}
+
+void* battle_worker(void* args) {
+    pthread_mutex_lock(&scheduler.lock);
+    for (;;) {
+        if (scheduler.stopping || scheduler.due.empty()) {
+            pthread_cond_wait(&scheduler.cond, &scheduler.lock);
+            continue;
+        }
+        battle_tick_t next = scheduler.due.top();
+        if (monotonic_ns() < next.deadline) {
+            struct timespec ts;
+            ts.tv_sec = next.deadline / NS_PER_SEC;
+            ts.tv_nsec = next.deadline % NS_PER_SEC;
+            pthread_cond_timedwait(&scheduler.cond, &scheduler.lock, &ts);
             continue;
+        }
+        scheduler.due.pop();
+        if (!battles[next.bid].is_alloced) {
+            drop_battle(next.bid);
+            continue;
+        }
+        // let another worker take the next battle meanwhile
+        if (!scheduler.due.empty())
+            pthread_cond_signal(&scheduler.cond);
+        scheduler.ticking++;
+        pthread_mutex_unlock(&scheduler.lock);
+
+        battle_tick(next.bid);
+        uint64_t end = monotonic_ns();
+
+        // stay on the grid of the first deadline, skip the ticks that
+        // were missed rather than run them back to back
+        next.deadline += BATTLE_TICK_NS;
+        if (next.deadline <= end) {
+            uint64_t missed = (end - next.deadline) / BATTLE_TICK_NS + 1;
+            logw("battle #%d skips %lu ticks", next.bid, missed);
+            metric_add(METRIC_TICKS_SKIPPED, missed);
+            next.deadline += missed * BATTLE_TICK_NS;
+        }
 
-        if (strncmp(password, registered_user_list[i].password, PASSWORD_SIZE - 1) != 0) {
-            logi("user name %s sent error password", user_name);
-            return SERVER_RESPONSE_LOGIN_FAIL_ERROR_PASSWORD;
+        pthread_mutex_lock(&scheduler.lock);
+        if (--scheduler.ticking == 0 && scheduler.stopping)
+            pthread_cond_broadcast(&scheduler.cond);
+        if (battles[next.bid].is_alloced) {
+            scheduler.due.push(next);
         } else {
-            return SERVER_RESPONSE_LOGIN_SUCCESS;
+            drop_battle(next.bid);
         }
     }
+    return NULL;
+}
+
+void init_scheduler(int workers) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&scheduler.lock, NULL);
+    pthread_cond_init(&scheduler.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    for (int i = 0; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, battle_worker, NULL) != 0) {
+            eprintf("fail to start battle worker");
+        }
+        pthread_detach(thread);
+    }
+    log("%d battle workers", workers);
+}
+
+// park the workers, returns once the ticks they were running have finished
+void scheduler_stop() {
+    pthread_mutex_lock(&scheduler.lock);
+    scheduler.stopping = true;
+    while (scheduler.ticking)
+        pthread_cond_wait(&scheduler.cond, &scheduler.lock);
+    pthread_mutex_unlock(&scheduler.lock);
+}
+
+/* changes of accounts on their way to USERS_LOG_FILE. any thread posts
+ * them, the account writer appends what piled up while it waited for
+ * the disk with one write and one fdatasync, so a burst of changes shares
+ * a flush. it keeps its own copy of the accounts, which it folds the log
+ * into as a new snapshot every now and then.
+ */
+struct account_stats_t {
+    int32_t score;
+    int32_t kill;
+    int32_t death;
+};
 
-    logi("user name %s hasn't been registered", user_name);
-    return SERVER_RESPONSE_LOGIN_FAIL_UNREGISTERED_USERID;
+struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  // posted to, or asked to stop
+    vector<wal_entry_t> pending;
+    uint64_t lsn;  // of the newest entry posted
+    bool running;  // nothing is posted before the writer starts
+    bool stop;
+    atomic<bool> stopped;
+    int fd;
+    vector<user_record_t> accounts;  // as of the last entry written
+    // as of the last entry posted, what a login starts from
+    vector<account_stats_t> stats;
+} account_log;
+
+// under account_log.lock
+void append_account_change(int kind, int id, const user_record_t& user) {
+    wal_entry_t e;
+    wal_entry_init(&e, kind, id, user);
+    e.lsn = ++account_log.lsn;
+    e.sum = wal_sum(e);
+    account_log.pending.push_back(e);
+    pthread_cond_signal(&account_log.cond);
+
+    account_stats_t stats = { user.score, user.kill, user.death };
+    if (kind == WAL_REGISTER && id == (int)account_log.stats.size())
+        account_log.stats.push_back(stats);
+    else if (kind == WAL_STATS && id < (int)account_log.stats.size())
+        account_log.stats[id] = stats;
+}
+
+void post_account_change(int kind, int id, const user_record_t& user) {
+    if (!account_log.running) return;
+    pthread_mutex_lock(&account_log.lock);
+    append_account_change(kind, id, user);
+    pthread_mutex_unlock(&account_log.lock);
+}
+
+// log the score, kills and deaths of the account logged in on session `uid`
+void save_stats(int uid) {
+    int id = sessions[uid].account;
+    if (id < 0) return;
+    user_record_t user;
+    memset(&user, 0, sizeof(user));
+    user.score = sessions[uid].score;
+    user.kill = sessions[uid].kill;
+    user.death = sessions[uid].death;
+    post_account_change(WAL_STATS, id, user);
+}
+
+// a battle charges account `id` for a quit after its session logged out
+void account_charge_quit(int id) {
+    if (!account_log.running) return;
+    pthread_mutex_lock(&account_log.lock);
+    account_stats_t& stats = account_log.stats[id];
+    user_record_t user;
+    memset(&user, 0, sizeof(user));
+    user.score = max(stats.score - 5, 0);
+    user.kill = stats.kill;
+    user.death = stats.death + 1;
+    append_account_change(WAL_STATS, id, user);
+    pthread_mutex_unlock(&account_log.lock);
+}
+
+// session `uid` starts from the stats last posted for account `id`
+void account_login(int uid, int id) {
+    pthread_mutex_lock(&account_log.lock);
+    sessions[uid].account = id;
+    sessions[uid].score = account_log.stats[id].score;
+    sessions[uid].kill = account_log.stats[id].kill;
+    sessions[uid].death = account_log.stats[id].death;
+    pthread_mutex_unlock(&account_log.lock);
+}
+
+// every change of the stats was posted as it happened, see save_stats
+void account_logout(int uid) {
+    sessions[uid].account = -1;
+}
+
+// the snapshot takes the place of every entry written, the log starts over
+bool compact_accounts(uint64_t lsn) {
+    const char* error;
+    uint64_t start = monotonic_ns();
+    vector<user_record_t>& accounts = account_log.accounts;
+    if (!userdb_save(USERS_FILE, accounts.data(), accounts.size(), lsn, &error)) {
+        loge("can not write %s: %s, keep %s", USERS_FILE, error, USERS_LOG_FILE);
+        return false;
+    }
+    if (ftruncate(account_log.fd, 0) < 0)
+        logw("can not truncate %s: %s", USERS_LOG_FILE, strerror(errno));
+    log("compacted %lu account(s) into %s in %.1fms", accounts.size(), USERS_FILE,
+        (monotonic_ns() - start) / 1e6);
+    return true;
+}
+
+void* account_writer(void* args) {
+    vector<wal_entry_t> batch;
+    uint64_t committed = account_log.lsn;
+    uint64_t compacted_at = monotonic_ns();
+    size_t logged = 0;  // entries in the log since the last snapshot
+    off_t log_size = 0;
+
+    pthread_mutex_lock(&account_log.lock);
+    for (;;) {
+        bool due = false;
+        while (account_log.pending.empty() && !account_log.stop && !due) {
+            if (logged == 0) {
+                pthread_cond_wait(&account_log.cond, &account_log.lock);
+                continue;
+            }
+            uint64_t deadline = compacted_at + USERS_COMPACT_SEC * NS_PER_SEC;
+            struct timespec ts;
+            ts.tv_sec = deadline / NS_PER_SEC;
+            ts.tv_nsec = deadline % NS_PER_SEC;
+            due = pthread_cond_timedwait(&account_log.cond, &account_log.lock, &ts) == ETIMEDOUT;
+        }
+        batch.swap(account_log.pending);
+        bool stop = account_log.stop;
+        pthread_mutex_unlock(&account_log.lock);
+
+        if (!batch.empty()) {
+            size_t bytes = batch.size() * sizeof(wal_entry_t);
+            ssize_t n = write(account_log.fd, batch.data(), bytes);
+            if (n != (ssize_t)bytes || fdatasync(account_log.fd) < 0) {
+                // the entries live on in the copy, a snapshot of it is taken at once
+                loge("can not write %s: %s", USERS_LOG_FILE, n < 0 ? strerror(errno) : "short write");
+                if (ftruncate(account_log.fd, log_size) < 0)
+                    logw("can not cut the partial write off %s", USERS_LOG_FILE);
+                due = true;
+            } else {
+                log_size += bytes;
+                metric_add(METRIC_ACCOUNT_COMMITS);
+                metric_add(METRIC_ACCOUNT_CHANGES, batch.size());
+            }
+            vector<user_record_t>& accounts = account_log.accounts;
+            for (auto& e : batch) {
+                if (e.kind == WAL_REGISTER && e.id == (int)accounts.size())
+                    accounts.push_back(e.user);
+                else if (e.kind == WAL_STATS && e.id < (int)accounts.size())
+                    user_copy_stats(&accounts[e.id], e.user);
+            }
+            committed = batch.back().lsn;
+            logged += batch.size();
+            batch.clear();
+        }
+        if (logged && (due || stop || logged >= USERS_COMPACT_ENTRIES)) {
+            if (compact_accounts(committed)) {
+                logged = 0;
+                log_size = 0;
+            }
+            compacted_at = monotonic_ns();
+        }
+        if (stop) {
+            account_log.stopped = true;
+            return NULL;
+        }
+        pthread_mutex_lock(&account_log.lock);
+    }
 }
 
-void launch_battle(int bid) {
-    pthread_t thread;
+// take over the accounts loaded into `userdb` and start writing changes of them
+void accounts_start() {
+    account_log.fd = open(USERS_LOG_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (account_log.fd < 0)
+        eprintf("can not open %s: %s", USERS_LOG_FILE, strerror(errno));
+    account_log.accounts = userdb.users;
+    account_log.lsn = userdb.lsn;
+    for (auto& user : userdb.users) {
+        account_stats_t stats = { user.score, user.kill, user.death };
+        account_log.stats.push_back(stats);
+    }
 
-    log("try to create battle_ruler thread");
-    if (pthread_create(&thread, NULL, battle_ruler, (void*)(uintptr_t)bid) == -1) {
-        eprintf("fail to launch battle");
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&account_log.lock, NULL);
+    pthread_cond_init(&account_log.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, account_writer, NULL) != 0) {
+        eprintf("fail to start account writer");
+    }
+    pthread_detach(thread);
+    account_log.running = true;
+}
+
+// let the writer flush what is pending and take a last snapshot, for at most a second
+void accounts_stop() {
+    if (!account_log.running) return;
+    pthread_mutex_lock(&account_log.lock);
+    account_log.stop = true;
+    pthread_cond_signal(&account_log.cond);
+    pthread_mutex_unlock(&account_log.lock);
+    for (int i = 0; i < 100 && !account_log.stopped; i++)
+        usleep(10000);
+    if (!account_log.stopped)
+        logw("account writer has not finished, %s will be replayed", USERS_LOG_FILE);
+}
+
+/* accounts of REGISTERED_USER_FILE, a name line and a password line
+ * each. the old file is left where it is.
+ */
+int import_user_list() {
+    FILE* userlist = fopen(REGISTERED_USER_FILE, "r");
+    if (userlist == NULL) return 0;
+    char name[USERNAME_SIZE + 1], password[PASSWORD_SIZE + 1];
+    int imported = 0, skipped = 0;
+    while (fgets(name, sizeof(name), userlist) && fgets(password, sizeof(password), userlist)) {
+        name[strcspn(name, "\n")] = password[strcspn(password, "\n")] = 0;
+        user_record_t user;
+        user_record_init(&user, name, password);
+        if (user.name[0] == 0 || userdb.add(user) < 0) {
+            skipped++;
+        } else {
+            imported++;
+        }
     }
+    fclose(userlist);
+    logw("moved %d user(s) of " REGISTERED_USER_FILE " to %s, skipped %d", imported, USERS_FILE, skipped);
+    return imported;
+}
+
+/* the snapshot, then the log entries a crash kept from being folded into
+ * it. the result becomes the new snapshot, so the writer starts on an
+ * empty log.
+ */
+void load_users() {
+    int skipped;
+    int n = userdb_load(&userdb, USERS_FILE, &skipped);
+    bool fresh = n < 0 && errno == ENOENT;
+    if (n < 0 && !fresh)
+        eprintf("can not load %s: %s", USERS_FILE, userdb.error);
+    if (skipped) logw("skipped %d duplicated or empty account(s) of %s", skipped, USERS_FILE);
+
+    size_t end;
+    int replayed = userdb_replay(&userdb, USERS_LOG_FILE, &end);
+    if (replayed < 0)
+        eprintf("can not replay %s: %s", USERS_LOG_FILE, userdb.error);
+    if (replayed) logw("replayed %d change(s) of %s up to byte %lu", replayed, USERS_LOG_FILE, end);
+    if (fresh && replayed == 0) import_user_list();
+    log("loaded %d user(s) from %s", userdb.size(), USERS_FILE);
+
+    const char* error;
+    if ((fresh || replayed) && !userdb_save(USERS_FILE, userdb.users.data(), userdb.size(), userdb.lsn, &error))
+        eprintf("can not write %s: %s", USERS_FILE, error);
+}
+
+// `account` is set to the id of the account the name belongs to
+int check_user_registered(char* user_name, char* password, int* account) {
+    int id = *account = userdb.find(user_name);
+    if (id < 0) {
+        logi("user name %s hasn't been registered", user_name);
+        return SERVER_RESPONSE_LOGIN_FAIL_UNREGISTERED_USERID;
+    }
+    if (strncmp(password, userdb.users[id].password, PASSWORD_SIZE - 1) != 0) {
+        logi("user name %s sent error password", user_name);
+        return SERVER_RESPONSE_LOGIN_FAIL_ERROR_PASSWORD;
+    }
+    return SERVER_RESPONSE_LOGIN_SUCCESS;
+}
+
+/* a battle disbanded and launched again before its entry came up keeps
+ * that entry, so it never ticks on two workers at once. it is launched
+ * before anyone joins, a join posted to a battle being dropped would be
+ * lost to its reset.
+ */
+void launch_battle(int bid) {
+    pthread_mutex_lock(&scheduler.lock);
+    battles[bid].is_alloced = true;
+    if (!battles[bid].scheduled) {
+        log("schedule battle #%d", bid);
+        battles[bid].scheduled = true;
+        battle_tick_t first = { monotonic_ns() + BATTLE_TICK_NS, bid };
+        scheduler.due.push(first);
+        pthread_cond_signal(&scheduler.cond);
+    }
+    pthread_mutex_unlock(&scheduler.lock);
 }
 
 int client_command_user_register(int uid) {
-    int ul_index = -1;
     char* user_name = sessions[uid].cm.user_name;
     char* password = sessions[uid].cm.password;
     log("user %s tries to register with password %s", user_name, password);
 
-    for (int i = 0; i < REGISTERED_USER_LIST_SIZE; i++) {
-        if (strncmp(user_name, registered_user_list[i].user_name, USERNAME_SIZE - 1) != 0)
-            continue;
-
+    if (userdb.find(user_name) >= 0) {
         log("user %s&%s has been registered", user_name, password);
         send_to_client(uid, SERVER_RESPONSE_YOU_HAVE_REGISTERED);
         return 0;
     }
 
-    pthread_mutex_lock(&userlist_lock);
-    if (user_list_size < REGISTERED_USER_LIST_SIZE)
-        ul_index = user_list_size++;
-    pthread_mutex_unlock(&userlist_lock);
-
-    log("fetch empty user list index #%d", ul_index);
-    if (ul_index == -1) {
-        log("user %s registers fail", user_name);
+    // the account writer puts it on disk, logins find it from now on
+    user_record_t user;
+    user_record_init(&user, user_name, password);
+    int id = userdb.add(user);
+    if (id < 0) {
+        logw("user %s registers fail, %d accounts at most", user_name, USERDB_MAX_USERS);
         send_to_client(uid, SERVER_RESPONSE_REGISTER_FAIL);
     } else {
-        log("user %s registers success", user_name);
-        strncpy(registered_user_list[ul_index].user_name,
-                user_name, USERNAME_SIZE - 1);
-        strncpy(registered_user_list[ul_index].password,
-                password, PASSWORD_SIZE - 1);
+        log("user %s registers success as account #%d", user_name, id);
+        post_account_change(WAL_REGISTER, id, user);
         send_to_client(uid, SERVER_RESPONSE_REGISTER_SUCCESS);
-        save_user(ul_index);
     }
     return 0;
 }
@@ -844,7 +2172,8 @@ int client_command_user_login(int uid) {
     char* password = pcm->password;
     char* ip_addr = sessions[uid].ip_addr;
     log("user #%d %s\033[2m(%s)\033[0m try to login", uid, user_name, ip_addr);
-    int message = check_user_registered(user_name, password);
+    int account;
+    int message = check_user_registered(user_name, password, &account);
 
     if (query_session_built(uid)) {
         log("user #%d %s\033[2m(%s)\033[0m has logined", uid, sessions[uid].user_name, sessions[uid].ip_addr);
@@ -852,7 +2181,7 @@ int client_command_user_login(int uid) {
         return 0;
     }
 
-    for (int i = 0; i < USER_CNT; i++) {
+    for (int i = 0; i < sessions.size(); i++) {
         if (query_session_built(i)) {
             logi("check dup user id: %s vs. %s", user_name, sessions[i].user_name);
             if (strncmp(user_name, sessions[i].user_name, USERNAME_SIZE - 1) == 0) {
@@ -876,6 +2205,7 @@ int client_command_user_login(int uid) {
             SERVER_RESPONSE_LOGIN_SUCCESS,
             sformat("Welcome to multiplayer shooting game! server \033[0;32m%s%s", version, color_s[0]));
         strncpy(sessions[uid].user_name, user_name, USERNAME_SIZE - 1);
+        account_login(uid, account);
         inform_friends(uid, SERVER_MESSAGE_FRIEND_LOGIN);
     } else {
         send_to_client(uid, message);
@@ -892,18 +2222,22 @@ int client_command_user_logout(int uid) {
     }
 
     log("user #%d %s\033[2m(%s)\033[0m logout", uid, sessions[uid].user_name, sessions[uid].ip_addr);
+    account_logout(uid);
     sessions[uid].state = USER_STATE_NOT_LOGIN;
     inform_friends(uid, SERVER_MESSAGE_FRIEND_LOGOUT);
     return 0;
 }
 
-void list_all_users(server_message_t* psm) {
-    for (int i = 0; i < USER_CNT; i++) {
-        if (query_session_built(i)) {
+// lists logined users other than `exclude`, at most MAX_LIST_USERS of them
+void list_all_users(server_message_t* psm, int exclude) {
+    psm->nr_all_users = 0;
+    for (int i = 0; i < sessions.size() && psm->nr_all_users < MAX_LIST_USERS; i++) {
+        if (i != exclude && query_session_built(i)) {
             log("%s: found %s %s", __func__, sessions[i].user_name,
                 sessions[i].state == USER_STATE_BATTLE ? "in battle" : "");
-            psm->all_users[i].user_state = sessions[i].state;
-            strncpy(psm->all_users[i].user_name, sessions[i].user_name, USERNAME_SIZE - 1);
+            psm->all_users[psm->nr_all_users].user_state = sessions[i].state;
+            strncpy(psm->all_users[psm->nr_all_users].user_name, sessions[i].user_name, USERNAME_SIZE - 1);
+            psm->nr_all_users++;
         }
     }
 }
@@ -920,10 +2254,10 @@ int client_command_fetch_all_users(int uid) {
 
     server_message_t sm;
     memset(&sm, 0, sizeof(server_message_t));
-    list_all_users(&sm);
+    list_all_users(&sm, -1);
     sm.response = SERVER_RESPONSE_ALL_USERS_INFO;
 
-    wrap_send(sessions[uid].conn, &sm);
+    wrap_send(uid, &sm);
 
     return 0;
 }
@@ -940,11 +2274,10 @@ int client_command_fetch_all_friends(int uid) {
 
     server_message_t sm;
     memset(&sm, 0, sizeof(server_message_t));
-    list_all_users(&sm);
-    sm.all_users[uid].user_state = USER_STATE_UNUSED;
+    list_all_users(&sm, uid);
     sm.response = SERVER_RESPONSE_ALL_FRIENDS_INFO;
 
-    wrap_send(sessions[uid].conn, &sm);
+    wrap_send(uid, &sm);
 
     return 0;
 }
@@ -997,10 +2330,10 @@ int client_command_launch_battle(int uid) {
         return 0;
     } else {
         logi("launch battle %d for %s, invite %s", bid, sessions[uid].user_name, pcm->user_name);
+        launch_battle(bid);
         user_join_battle(bid, uid);
         if (strcmp(pcm->user_name, ""))
             invite_friend_to_battle(bid, uid, pcm->user_name);
-        launch_battle(bid);
         send_to_client(uid, SERVER_RESPONSE_LAUNCH_BATTLE_SUCCESS);
     }
 
@@ -1044,10 +2377,9 @@ int client_command_send_message(int uid) {
     strncpy(sm.msg, pcm->message, MSG_SIZE);
     if (pcm->user_name[0] == '\0') {
         logi("user %d:%s\033[2m(%s)\033[0m yells at all users: %s", uid, sessions[uid].user_name, sessions[uid].ip_addr, pcm->message);
-        int i;
-        for (i = 0; i < USER_CNT; i++) {
+        for (int i = 0; i < sessions.size(); i++) {
             if (uid == i) continue;
-            wrap_send(sessions[i].conn, &sm);
+            wrap_send(i, &sm);
         }
     } else {
         int friend_id = find_uid_by_user_name(pcm->user_name);
@@ -1055,7 +2387,7 @@ int client_command_send_message(int uid) {
             logi("user %d:%s\033[2m(%s)\033[0m fails to speak to %s:`%s`", uid, sessions[uid].user_name, sessions[uid].ip_addr, pcm->user_name, pcm->message);
         } else {
             logi("user %d:%s\033[2m(%s)\033[0m speaks to %d:%s : `%s`", uid, sessions[uid].user_name, sessions[uid].ip_addr, friend_id, pcm->user_name, pcm->message);
-            wrap_send(sessions[friend_id].conn, &sm);
+            wrap_send(friend_id, &sm);
         }
     }
     return 0;
@@ -1081,11 +2413,10 @@ int client_command_create_ffa(int uid) {
         return 0;
     } else {
         logi("launch battle #0 for ffa");
-        battles[bid].is_alloced = true;
+        launch_battle(bid);
         user_join_battle(bid, uid);
         if (strcmp(pcm->user_name, ""))
             invite_friend_to_battle(bid, uid, pcm->user_name);
-        launch_battle(bid);
         send_to_client(uid, SERVER_RESPONSE_LAUNCH_BATTLE_SUCCESS);
     }
 
@@ -1102,7 +2433,10 @@ int client_command_launch_ffa(int uid) {
         int bid = 0;
 
         if (battles[bid].is_alloced) {
-            user_join_battle(bid, uid);
+            if (user_join_battle(bid, uid) < 0) {
+                send_to_client(uid, SERVER_RESPONSE_LAUNCH_BATTLE_FAIL);
+                return 0;
+            }
             logi("accept success");
         } else {
             logi("user %s created ffa session #0", sessions[uid].user_name);
@@ -1123,8 +2457,12 @@ int client_command_accept_battle(int uid) {
         int bid = sessions[uid].bid;
 
         if (battles[bid].is_alloced) {
+            if (user_join_battle(bid, uid) < 0) {
+                sessions[uid].state = USER_STATE_LOGIN;
+                send_to_client(uid, SERVER_RESPONSE_LAUNCH_BATTLE_FAIL);
+                return 0;
+            }
             send_to_client_with_username(inviter_id, SERVER_MESSAGE_FRIEND_ACCEPT_BATTLE, sessions[inviter_id].user_name);
-            user_join_battle(bid, uid);
             logi("accept success");
         } else {
             logi("user %s\033[2m(%s)\033[0m accept battle which didn't exist", sessions[uid].user_name, sessions[uid].ip_addr);
@@ -1146,10 +2484,8 @@ int client_command_reject_battle(int uid) {
         send_to_client(uid, SERVER_RESPONSE_YOURE_ALREADY_IN_BATTLE);
     } else if (sessions[uid].state == USER_STATE_WAIT_TO_BATTLE) {
         logi("reject success");
-        int bid = sessions[uid].bid;
         send_to_client(sessions[uid].inviter_id, SERVER_MESSAGE_FRIEND_REJECT_BATTLE);
         sessions[uid].state = USER_STATE_LOGIN;
-        battles[bid].users[uid].battle_state = BATTLE_STATE_UNJOINED;
     } else {
         logi("hasn't been invited");
         send_to_client(uid, SERVER_RESPONSE_NOBODY_INVITE_YOU);
@@ -1164,174 +2500,168 @@ int client_command_quit(int uid) {
         log("user #%d %s tries to quit client was in battle", uid, sessions[uid].user_name);
         user_quit_battle(sessions[uid].bid, uid);
     }
+    account_logout(uid);
 
     if (sessions[uid].conn >= 0) {
         sessions[uid].conn = -1;
         log("user #%d %s quit", uid, sessions[uid].user_name);
         sessions[uid].state = USER_STATE_UNUSED;
+        outq_close(uid);
         close(conn);
     }
     return -1;
 }
 
-int client_command_move_up(int uid) {
+int client_command_move_up(int bid, int pid) {
+    battle_t::user_t& user = battles[bid].users[pid];
+    int uid = user.uid;
     log("user #%d %s\033[2m(%s)\033[0m move up", uid, sessions[uid].user_name, sessions[uid].ip_addr);
-    int bid = sessions[uid].bid;
-    battles[bid].users[uid].dir = DIR_UP;
-    if (battles[bid].users[uid].pos.y > 0) {
-        battles[bid].users[uid].pos.y--;
-        check_user_status(uid);
+    user.dir = DIR_UP;
+    if (user.pos.y > 0) {
+        user.pos.y--;
+        check_user_status(bid, pid);
     }
     return 0;
 }
 
-int client_command_move_down(int uid) {
+int client_command_move_down(int bid, int pid) {
+    battle_t::user_t& user = battles[bid].users[pid];
+    int uid = user.uid;
     log("user #%d %s\033[2m(%s)\033[0m move down", uid, sessions[uid].user_name, sessions[uid].ip_addr);
-    int bid = sessions[uid].bid;
-    battles[bid].users[uid].dir = DIR_DOWN;
-    if (battles[bid].users[uid].pos.y < BATTLE_H - 1) {
-        battles[bid].users[uid].pos.y++;
-        check_user_status(uid);
+    user.dir = DIR_DOWN;
+    if (user.pos.y < battles[bid].h - 1) {
+        user.pos.y++;
+        check_user_status(bid, pid);
     }
     return 0;
 }
 
-int client_command_move_left(int uid) {
+int client_command_move_left(int bid, int pid) {
+    battle_t::user_t& user = battles[bid].users[pid];
+    int uid = user.uid;
     log("user #%d %s\033[2m(%s)\033[0m move left", uid, sessions[uid].user_name, sessions[uid].ip_addr);
-    int bid = sessions[uid].bid;
-    battles[bid].users[uid].dir = DIR_LEFT;
-    if (battles[bid].users[uid].pos.x > 0) {
-        battles[bid].users[uid].pos.x--;
-        check_user_status(uid);
+    user.dir = DIR_LEFT;
+    if (user.pos.x > 0) {
+        user.pos.x--;
+        check_user_status(bid, pid);
     }
     return 0;
 }
 
-int client_command_move_right(int uid) {
+int client_command_move_right(int bid, int pid) {
+    battle_t::user_t& user = battles[bid].users[pid];
+    int uid = user.uid;
     log("user #%d %s\033[2m(%s)\033[0m move right", uid, sessions[uid].user_name, sessions[uid].ip_addr);
-    int bid = sessions[uid].bid;
-    battles[bid].users[uid].dir = DIR_RIGHT;
-    if (battles[bid].users[uid].pos.x < BATTLE_W - 1) {
-        battles[bid].users[uid].pos.x++;
-        check_user_status(uid);
+    user.dir = DIR_RIGHT;
+    if (user.pos.x < battles[bid].w - 1) {
+        user.pos.x++;
+        check_user_status(bid, pid);
     }
     return 0;
 }
 
-int client_command_put_landmine(int uid) {
-    int bid = sessions[uid].bid;
+int client_command_put_landmine(int bid, int pid) {
+    battle_t::user_t& user = battles[bid].users[pid];
+    int uid = user.uid;
 
-    if (battles[bid].users[uid].energy < LANDMINE_COST) {
+    if (user.energy < LANDMINE_COST) {
         send_to_client(uid, SERVER_MESSAGE_YOUR_MAGAZINE_IS_EMPTY);
         return 0;
     }
-    int x = battles[bid].users[uid].pos.x;
-    int y = battles[bid].users[uid].pos.y;
-    if (x < 0 || x >= BATTLE_W) return 1;
-    if (y < 0 || y >= BATTLE_H) return 1;
+    int x = user.pos.x;
+    int y = user.pos.y;
+    if (x < 0 || x >= battles[bid].w) return 1;
+    if (y < 0 || y >= battles[bid].h) return 1;
     log("user #%d %s\033[2m(%s)\033[0m put at (%d, %d)", uid, sessions[uid].user_name, sessions[uid].ip_addr, x, y);
-    item_t new_item;
-    new_item.id = ++battles[bid].item_count;
-    new_item.kind = ITEM_LANDMINE;
-    new_item.owner = uid;
-    new_item.pos.x = x;
-    new_item.pos.y = y;
-    new_item.time = battles[bid].global_time + INF;
-    battles[bid].users[uid].energy -= LANDMINE_COST;
-    battles[bid].items.push_back(new_item);
+    user.energy -= LANDMINE_COST;
+    add_item(bid, ITEM_LANDMINE, x, y, battles[bid].global_time + INF, uid);
     //log("current item size: %ld", battles[bid].items.size());
     return 0;
 }
 
-int client_command_fire(int uid, int delta_x, int delta_y, int dir) {
-    int bid = sessions[uid].bid;
+int client_command_fire(int bid, int pid, int delta_x, int delta_y, int dir) {
+    battle_t::user_t& user = battles[bid].users[pid];
+    int uid = user.uid;
 
-    if (battles[bid].users[uid].energy <= 0) {
+    if (user.energy <= 0) {
         send_to_client(uid, SERVER_MESSAGE_YOUR_MAGAZINE_IS_EMPTY);
         return 0;
     }
-    int x = battles[bid].users[uid].pos.x + delta_x;
-    int y = battles[bid].users[uid].pos.y + delta_y;
-    if (x < 0 || x >= BATTLE_W) return 1;
-    if (y < 0 || y >= BATTLE_H) return 1;
+    int x = user.pos.x + delta_x;
+    int y = user.pos.y + delta_y;
+    if (x < 0 || x >= battles[bid].w) return 1;
+    if (y < 0 || y >= battles[bid].h) return 1;
     log("user #%d %s\033[2m(%s)\033[0m fire %s", uid, sessions[uid].user_name, sessions[uid].ip_addr, dir_s[dir]);
-    item_t new_item;
-    new_item.id = ++battles[bid].item_count;
-    new_item.kind = ITEM_BULLET;
-    new_item.dir = dir;
-    new_item.owner = uid;
-    new_item.pos.x = x;
-    new_item.pos.y = y;
-    new_item.time = battles[bid].global_time + BULLETS_LASTS_TIME;
-    battles[bid].users[uid].energy--;
-    battles[bid].items.push_back(new_item);
+    user.energy--;
+    add_item(bid, ITEM_BULLET, x, y, battles[bid].global_time + BULLETS_LASTS_TIME, uid, dir);
     //log("current item size: %ld", battles[bid].items.size());
     return 0;
 }
 
-int client_command_fire_up(int uid) {
+int client_command_fire_up(int bid, int pid) {
     logi("client_command_fire");
-    client_command_fire(uid, 0, 0, DIR_UP);
+    client_command_fire(bid, pid, 0, 0, DIR_UP);
     return 0;
 }
-int client_command_fire_down(int uid) {
+int client_command_fire_down(int bid, int pid) {
     logi("client_command_fire");
-    client_command_fire(uid, 0, 0, DIR_DOWN);
+    client_command_fire(bid, pid, 0, 0, DIR_DOWN);
     return 0;
 }
-int client_command_fire_left(int uid) {
+int client_command_fire_left(int bid, int pid) {
     logi("client_command_fire");
-    client_command_fire(uid, 0, 0, DIR_LEFT);
+    client_command_fire(bid, pid, 0, 0, DIR_LEFT);
     return 0;
 }
-int client_command_fire_right(int uid) {
+int client_command_fire_right(int bid, int pid) {
     logi("client_command_fire");
-    client_command_fire(uid, 0, 0, DIR_RIGHT);
+    client_command_fire(bid, pid, 0, 0, DIR_RIGHT);
     return 0;
 }
 
-int client_command_fire_up_left(int uid) {
+int client_command_fire_up_left(int bid, int pid) {
     logi("client_command_fire");
-    client_command_fire(uid, 0, 0, DIR_UP_LEFT);
+    client_command_fire(bid, pid, 0, 0, DIR_UP_LEFT);
     return 0;
 }
-int client_command_fire_up_right(int uid) {
+int client_command_fire_up_right(int bid, int pid) {
     logi("client_command_fire");
-    client_command_fire(uid, 0, 0, DIR_UP_RIGHT);
+    client_command_fire(bid, pid, 0, 0, DIR_UP_RIGHT);
     return 0;
 }
-int client_command_fire_down_left(int uid) {
+int client_command_fire_down_left(int bid, int pid) {
     logi("client_command_fire");
-    client_command_fire(uid, 0, 0, DIR_DOWN_LEFT);
+    client_command_fire(bid, pid, 0, 0, DIR_DOWN_LEFT);
     return 0;
 }
-int client_command_fire_down_right(int uid) {
+int client_command_fire_down_right(int bid, int pid) {
     logi("client_command_fire");
-    client_command_fire(uid, 0, 0, DIR_DOWN_RIGHT);
+    client_command_fire(bid, pid, 0, 0, DIR_DOWN_RIGHT);
     return 0;
 }
 
-int client_command_fire_aoe(int uid, int dir) {
+int client_command_fire_aoe(int bid, int pid, int dir) {
+    int uid = battles[bid].users[pid].uid;
     log("user #%d %s\033[2m(%s)\033[0m fire(aoe) %s", uid, sessions[uid].user_name, sessions[uid].ip_addr, dir_s[dir]);
     logi("call client_command_fire");
-    int limit = battles[sessions[uid].bid].users[uid].energy / 2, cnt = 0;
+    int limit = battles[bid].users[pid].energy / 2, cnt = 0;
     for (int i = 0; limit; i++) {
         for (int j = -i; j <= i && limit; j++) {
             switch (dir) {
                 case DIR_UP: {
-                    if (client_command_fire(uid, j, -i + abs(j), dir) == 0) cnt++;
+                    if (client_command_fire(bid, pid, j, -i + abs(j), dir) == 0) cnt++;
                     break;
                 }
                 case DIR_DOWN: {
-                    if (client_command_fire(uid, j, i - abs(j), dir) == 0) cnt++;
+                    if (client_command_fire(bid, pid, j, i - abs(j), dir) == 0) cnt++;
                     break;
                 }
                 case DIR_LEFT: {
-                    if (client_command_fire(uid, -i + abs(j), j, dir) == 0) cnt++;
+                    if (client_command_fire(bid, pid, -i + abs(j), j, dir) == 0) cnt++;
                     break;
                 }
                 case DIR_RIGHT: {
-                    if (client_command_fire(uid, i - abs(j), j, dir) == 0) cnt++;
+                    if (client_command_fire(bid, pid, i - abs(j), j, dir) == 0) cnt++;
                     break;
                 }
             }
@@ -1342,29 +2672,30 @@ int client_command_fire_aoe(int uid, int dir) {
     return 0;
 }
 
-int client_command_fire_aoe_up(int uid) {
+int client_command_fire_aoe_up(int bid, int pid) {
     logi("call client_command_fire_aoe");
-    return client_command_fire_aoe(uid, DIR_UP);
+    return client_command_fire_aoe(bid, pid, DIR_UP);
 }
-int client_command_fire_aoe_down(int uid) {
+int client_command_fire_aoe_down(int bid, int pid) {
     logi("call client_command_fire_aoe");
-    return client_command_fire_aoe(uid, DIR_DOWN);
+    return client_command_fire_aoe(bid, pid, DIR_DOWN);
 }
-int client_command_fire_aoe_left(int uid) {
+int client_command_fire_aoe_left(int bid, int pid) {
     logi("call client_command_fire_aoe");
-    return client_command_fire_aoe(uid, DIR_LEFT);
+    return client_command_fire_aoe(bid, pid, DIR_LEFT);
 }
-int client_command_fire_aoe_right(int uid) {
+int client_command_fire_aoe_right(int bid, int pid) {
     logi("call client_command_fire_aoe");
-    return client_command_fire_aoe(uid, DIR_RIGHT);
+    return client_command_fire_aoe(bid, pid, DIR_RIGHT);
 }
 
-int client_command_melee(int uid) {
-    int bid = sessions[uid].bid;
-    if (battles[bid].users[uid].life <= 0) return 0;
-    int dir = battles[bid].users[uid].dir;
-    int x = battles[bid].users[uid].pos.x;
-    int y = battles[bid].users[uid].pos.y;
+int client_command_melee(int bid, int pid) {
+    battle_t::user_t& user = battles[bid].users[pid];
+    int uid = user.uid;
+    if (user.life <= 0) return 0;
+    int dir = user.dir;
+    int x = user.pos.x;
+    int y = user.pos.y;
     log("user #%d %s\033[2m(%s)\033[0m melee %s", uid, sessions[uid].user_name, sessions[uid].ip_addr, dir_s[dir]);
     for (int i = 1; i <= 3; i++) {
         forced_generate_items(bid, 
@@ -1377,16 +2708,42 @@ int client_command_melee(int uid) {
     return 0;
 }
 
-int admin_set_admin(int argc, char** argv) {
+// handler of every command in battle_handler, defers it to the next tick
+int client_command_battle_input(int uid) {
+    if (sessions[uid].state != USER_STATE_BATTLE) {
+        return 0;
+    }
+    int bid = sessions[uid].bid;
+    int command = sessions[uid].cm.command;
+    uint32_t input_seq = client_payload_kind(command) == PAYLOAD_INPUT_SEQ ? sessions[uid].cm.input_seq : 0;
+    if (!battles[bid].inputs.push(uid, command, input_seq)) {
+        logw("inputs of battle #%d overflow, drop command %d of user #%d", bid, command, uid);
+        // or the client would replay the move on every frame from now on
+        if (input_seq != 0)
+            mark_input_done(uid, input_seq);
+    }
+    return 0;
+}
+
+int client_command_ack_frame(int uid) {
+    uint32_t seq = sessions[uid].cm.frame_seq;
+    // acknowledging frame 0 asks for a keyframe
+    if (seq == 0 || seq > sessions[uid].acked_seq) {
+        sessions[uid].acked_seq = seq;
+    }
+    return 0;
+}
+
+int admin_set_admin(int caller, int argc, char** argv) {
     if (argc < 3) return -1;
     int uid = find_uid_by_user_name(argv[1]), status = atoi(argv[2]);
-    if (uid < 0 || uid >= USER_CNT || sessions[uid].conn < 0) {
+    if (uid < 0 || uid >= sessions.size() || sessions[uid].conn < 0) {
         return -1;
     }
     if (status) log("admin set user #%d admin", uid);
     else log("admin set user #%d non-admin", uid);
     sessions[uid].is_admin = status;
-    for (int i = 0; i < USER_CNT; i++) {
+    for (int i = 0; i < sessions.size(); i++) {
         if (sessions[i].conn >= 0) {
             if (status) {
                 say_to_client(i, sformat("admin set user #%d %s to admin", uid, sessions[uid].user_name));
@@ -1398,16 +2755,17 @@ int admin_set_admin(int argc, char** argv) {
     return 0;
 }
 
-int admin_set_energy(int argc, char** argv) {
+int admin_set_energy(int caller, int argc, char** argv) {
     if (argc < 3) return -1;
     int uid = find_uid_by_user_name(argv[1]), energy = atoi(argv[2]);
     log("admin set user #%d's energy", uid);
-    if (uid < 0 || uid >= USER_CNT || sessions[uid].conn < 0 || energy < 0) {
+    if (uid < 0 || uid >= sessions.size() || sessions[uid].conn < 0 || energy < 0) {
         return -1;
     }
+    if (sessions[uid].state != USER_STATE_BATTLE) return -1;
     log("admin set user #%d %s's energy to %d", uid, sessions[uid].user_name, energy);
-    battles[sessions[uid].bid].users[uid].energy = energy;
-    for (int i = 0; i < USER_CNT; i++) {
+    post_battle_control(sessions[uid].bid, CONTROL_ENERGY, uid, energy);
+    for (int i = 0; i < sessions.size(); i++) {
         if (sessions[i].conn >= 0) {
             say_to_client(i, sformat("admin set user #%d %s's energy to %d", uid, sessions[uid].user_name, energy));
         }
@@ -1415,15 +2773,16 @@ int admin_set_energy(int argc, char** argv) {
     return 0;
 }
 
-int admin_set_hp(int argc, char** argv) {
+int admin_set_hp(int caller, int argc, char** argv) {
     if (argc < 3) return -1;
     int uid = find_uid_by_user_name(argv[1]), hp = atoi(argv[2]);
-    if (uid < 0 || uid >= USER_CNT || sessions[uid].conn < 0 || hp < 0) {
+    if (uid < 0 || uid >= sessions.size() || sessions[uid].conn < 0 || hp < 0) {
         return -1;
     }
+    if (sessions[uid].state != USER_STATE_BATTLE) return -1;
     log("admin set user #%d %s's hp to %d", uid, sessions[uid].user_name, hp);
-    battles[sessions[uid].bid].users[uid].life = hp;
-    for (int i = 0; i < USER_CNT; i++) {
+    post_battle_control(sessions[uid].bid, CONTROL_LIFE, uid, hp);
+    for (int i = 0; i < sessions.size(); i++) {
         if (sessions[i].conn >= 0) {
             say_to_client(i, sformat("admin set user #%d %s's hp to %d", uid, sessions[uid].user_name, hp));
         }
@@ -1431,26 +2790,26 @@ int admin_set_hp(int argc, char** argv) {
     return 0;
 }
 
-int admin_set_pos(int argc, char** argv) {
+int admin_set_pos(int caller, int argc, char** argv) {
     if (argc < 4) return -1;
     int uid = find_uid_by_user_name(argv[1]);
-    uint8_t x = atoi(argv[2]), y = atoi(argv[3]);
-    if (uid < 0 || uid >= USER_CNT || sessions[uid].conn < 0) {
+    int x = atoi(argv[2]), y = atoi(argv[3]);
+    if (uid < 0 || uid >= sessions.size() || sessions[uid].conn < 0) {
         return -1;
     }
-    if (x < 0 || x >= BATTLE_W) return -1;
-    if (y < 0 || y >= BATTLE_H) return -1;
+    if (x < 0 || x >= battles[sessions[uid].bid].w) return -1;
+    if (y < 0 || y >= battles[sessions[uid].bid].h) return -1;
+    if (sessions[uid].state != USER_STATE_BATTLE) return -1;
     log("admin set user #%d %s's pos to (%d, %d)", uid, sessions[uid].user_name, x, y);
-    battles[sessions[uid].bid].users[uid].pos.x = x;
-    battles[sessions[uid].bid].users[uid].pos.y = y;
+    post_battle_control(sessions[uid].bid, CONTROL_POS, uid, x, y);
     return 0;
 }
 
-int admin_ban_user(int argc, char** argv) {
+int admin_ban_user(int caller, int argc, char** argv) {
     if (argc < 2) return -1;
     int uid = find_uid_by_user_name(argv[1]);
     log("admin ban user #%d", uid);
-    if (uid < 0 || uid >= USER_CNT) {
+    if (uid < 0 || uid >= sessions.size()) {
         logi("fail");
         return -1;
     }
@@ -1460,7 +2819,7 @@ int admin_ban_user(int argc, char** argv) {
             uid, SERVER_STATUS_QUIT,
             (char*)" (you were banned by admin)");
         client_command_quit(uid);
-        for (int i = 0; i < USER_CNT; i++) {
+        for (int i = 0; i < sessions.size(); i++) {
             if (sessions[i].conn >= 0) {
                 say_to_client(i, sformat("admin banned user #%d %s\033[2m(%s)\033[0m", uid, sessions[uid].user_name, sessions[uid].ip_addr));
             }
@@ -1469,9 +2828,61 @@ int admin_ban_user(int argc, char** argv) {
     return 0;
 }
 
+/* prof [battle [phase|reset]]: how long the tick phases of a battle
+ * take, #0 by default. the caller is told about one phase, the whole
+ * tick unless named, and the table of all goes to the log.
+ */
+int admin_prof(int caller, int argc, char** argv) {
+    int bid = argc >= 2 ? atoi(argv[1]) : 0;
+    if (bid < 0 || bid >= battles.size()) return -1;
+    tick_profile_t& profile = battles[bid].profile;
+    if (argc >= 3 && strcmp(argv[2], "reset") == 0) {
+        profile.reset();
+        say_to_client(caller, sformat("tick profile of battle #%d is reset", bid));
+        return 0;
+    }
+    int shown = PHASE_TICK;
+    if (argc >= 3) {
+        for (shown = 0; shown < NR_PHASES && strcmp(argv[2], phase_s[shown]); shown++);
+        if (shown == NR_PHASES) return -1;
+    }
+
+    // only the reactor gets here, and it is too large for the stack
+    static histogram_t phases[NR_PHASES];
+    pthread_mutex_lock(&profile.lock);
+    memcpy(phases, profile.phases, sizeof(phases));
+    pthread_mutex_unlock(&profile.lock);
+
+    log("tick phases of battle #%d in us", bid);
+    log("%-10s %8s %8s %8s %8s %8s %8s", "phase", "count", "mean", "p50", "p99", "p99.9", "max");
+    int worst = 0;
+    for (int i = 0; i < NR_PHASES; i++) {
+        histogram_t* h = &phases[i];
+        log("%-10s %8lu %8.1f %8.1f %8.1f %8.1f %8.1f", phase_s[i], h->count,
+            hist_mean(h) / 1e3, hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+            hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+        if (i < PHASE_TICK && hist_percentile(h, 99) > hist_percentile(&phases[worst], 99))
+            worst = i;
+    }
+
+    histogram_t* h = &phases[shown];
+    if (h->count == 0) {
+        say_to_client(caller, sformat("battle #%d has not run %s yet", bid, phase_s[shown]));
+        return 0;
+    }
+    char worst_s[32] = "";
+    if (shown == PHASE_TICK)
+        snprintf(worst_s, sizeof(worst_s), ", most in %s", phase_s[worst]);
+    say_to_client(caller, sformat("#%d %s n=%lu: p50 %luus p99 %luus p99.9 %luus max %luus%s",
+                                  bid, phase_s[shown], h->count,
+                                  hist_percentile(h, 50) / 1000, hist_percentile(h, 99) / 1000,
+                                  hist_percentile(h, 99.9) / 1000, h->max / 1000, worst_s));
+    return 0;
+}
+
 static struct {
     const char* cmd;
-    int (*func)(int argc, char** argv);
+    int (*func)(int caller, int argc, char** argv);
 } admin_handler[] = {
     {"ban", admin_ban_user},
     {"eng", admin_set_energy},
@@ -1479,6 +2890,7 @@ static struct {
     {"hp", admin_set_hp},
     {"setadmin", admin_set_admin},
     {"pos", admin_set_pos},
+    {"prof", admin_prof},
 };
 
 #define NR_HANDLER ((int)sizeof(admin_handler) / (int)sizeof(admin_handler[0]))
@@ -1508,7 +2920,7 @@ int client_command_admin_control(int uid) {
         argv[argc] = NULL;
         for (int i = 0; i < NR_HANDLER; i++) {
             if (strcmp(argv[0], admin_handler[i].cmd) == 0) {
-                if (admin_handler[i].func(argc, argv)) {
+                if (admin_handler[i].func(uid, argc, argv)) {
                     say_to_client(uid, (char*)"invalid command!");
                 }
                 return 0;
@@ -1521,7 +2933,7 @@ int client_command_admin_control(int uid) {
 
 int client_message_fatal(int uid) {
     loge("received FATAL from user #%d %s\033[2m(%s)\033[0m ", uid, sessions[uid].user_name, sessions[uid].ip_addr);
-    for (int i = 0; i < USER_CNT; i++) {
+    for (int i = 0; i < sessions.size(); i++) {
         if (sessions[i].conn >= 0) {
             send_to_client(i, SERVER_STATUS_FATAL);
             log("send FATAL to user #%d %s\033[2m(%s)\033[0m", i, sessions[i].user_name, sessions[i].ip_addr);
@@ -1553,56 +2965,189 @@ void init_handler() {
 
     handler[CLIENT_COMMAND_SEND_MESSAGE] = client_command_send_message,
 
-    handler[CLIENT_COMMAND_MOVE_UP] = client_command_move_up,
-    handler[CLIENT_COMMAND_MOVE_DOWN] = client_command_move_down,
-    handler[CLIENT_COMMAND_MOVE_LEFT] = client_command_move_left,
-    handler[CLIENT_COMMAND_MOVE_RIGHT] = client_command_move_right,
+    battle_handler[CLIENT_COMMAND_MOVE_UP] = client_command_move_up,
+    battle_handler[CLIENT_COMMAND_MOVE_DOWN] = client_command_move_down,
+    battle_handler[CLIENT_COMMAND_MOVE_LEFT] = client_command_move_left,
+    battle_handler[CLIENT_COMMAND_MOVE_RIGHT] = client_command_move_right,
 
-    handler[CLIENT_COMMAND_PUT_LANDMINE] = client_command_put_landmine,
+    battle_handler[CLIENT_COMMAND_PUT_LANDMINE] = client_command_put_landmine,
     
-    handler[CLIENT_COMMAND_MELEE] = client_command_melee,
+    battle_handler[CLIENT_COMMAND_MELEE] = client_command_melee,
+
+    handler[CLIENT_COMMAND_ACK_FRAME] = client_command_ack_frame,
 
-    handler[CLIENT_COMMAND_FIRE_UP] = client_command_fire_up,
-    handler[CLIENT_COMMAND_FIRE_DOWN] = client_command_fire_down,
-    handler[CLIENT_COMMAND_FIRE_LEFT] = client_command_fire_left,
-    handler[CLIENT_COMMAND_FIRE_RIGHT] = client_command_fire_right,
+    battle_handler[CLIENT_COMMAND_FIRE_UP] = client_command_fire_up,
+    battle_handler[CLIENT_COMMAND_FIRE_DOWN] = client_command_fire_down,
+    battle_handler[CLIENT_COMMAND_FIRE_LEFT] = client_command_fire_left,
+    battle_handler[CLIENT_COMMAND_FIRE_RIGHT] = client_command_fire_right,
 
-    handler[CLIENT_COMMAND_FIRE_UP_LEFT] = client_command_fire_up_left,
-    handler[CLIENT_COMMAND_FIRE_UP_RIGHT] = client_command_fire_up_right,
-    handler[CLIENT_COMMAND_FIRE_DOWN_LEFT] = client_command_fire_down_left,
-    handler[CLIENT_COMMAND_FIRE_DOWN_RIGHT] = client_command_fire_down_right,
+    battle_handler[CLIENT_COMMAND_FIRE_UP_LEFT] = client_command_fire_up_left,
+    battle_handler[CLIENT_COMMAND_FIRE_UP_RIGHT] = client_command_fire_up_right,
+    battle_handler[CLIENT_COMMAND_FIRE_DOWN_LEFT] = client_command_fire_down_left,
+    battle_handler[CLIENT_COMMAND_FIRE_DOWN_RIGHT] = client_command_fire_down_right,
 
-    handler[CLIENT_COMMAND_FIRE_AOE_UP] = client_command_fire_aoe_up,
-    handler[CLIENT_COMMAND_FIRE_AOE_DOWN] = client_command_fire_aoe_down,
-    handler[CLIENT_COMMAND_FIRE_AOE_LEFT] = client_command_fire_aoe_left,
-    handler[CLIENT_COMMAND_FIRE_AOE_RIGHT] = client_command_fire_aoe_right;
+    battle_handler[CLIENT_COMMAND_FIRE_AOE_UP] = client_command_fire_aoe_up,
+    battle_handler[CLIENT_COMMAND_FIRE_AOE_DOWN] = client_command_fire_aoe_down,
+    battle_handler[CLIENT_COMMAND_FIRE_AOE_LEFT] = client_command_fire_aoe_left,
+    battle_handler[CLIENT_COMMAND_FIRE_AOE_RIGHT] = client_command_fire_aoe_right;
 
     handler[CLIENT_COMMAND_ADMIN_CONTROL] = client_command_admin_control;
 
+    for (int i = 0; i < 256; i++) {
+        if (battle_handler[i]) handler[i] = client_command_battle_input;
+    }
+
 }
 
-void wrap_recv(int conn, client_message_t* pcm) {
-    size_t total_len = 0;
-    while (total_len < sizeof(client_message_t)) {
-        size_t len = recv(conn, pcm + total_len, sizeof(client_message_t) - total_len, 0);
-        if (len < 0) {
-            loge("broken pipe");
+void outq_open(int uid, int conn) {
+    outq_t* q = &outqs[uid];
+    pthread_mutex_lock(&q->lock);
+    q->conn = conn;
+    q->head = q->tail = q->last_pos = 0;
+    q->last_message = -1;
+    q->want_write = q->doomed = 0;
+    q->dropped = 0;
+    pthread_mutex_unlock(&q->lock);
+}
+
+// caller holds q->lock
+void outq_watch(int uid, int want_write) {
+    outq_t* q = &outqs[uid];
+    if (q->want_write == want_write) return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+    ev.data.u32 = uid;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, q->conn, &ev) == -1) {
+        loge("fail to watch conn:%d of session #%d", q->conn, uid);
+    }
+    q->want_write = want_write;
+}
+
+// caller holds q->lock, ask the reactor to close the session
+void outq_doom(int uid) {
+    outq_t* q = &outqs[uid];
+    if (q->doomed) return;
+    q->doomed = 1;
+    shutdown(q->conn, SHUT_RDWR);
+}
+
+// caller holds q->lock, send as much as the socket takes without blocking
+void outq_flush(int uid) {
+    outq_t* q = &outqs[uid];
+    while (q->head < q->tail && !q->doomed) {
+        size_t off = q->head % OUTQ_SIZE;
+        size_t len = min(q->tail - q->head, OUTQ_SIZE - off);
+        ssize_t sent = send(q->conn, q->buf + off, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            loge("broken pipe of session #%d", uid);
+            outq_doom(uid);
+            break;
         }
+        q->head += sent;
+        metric_add(METRIC_BYTES_SENT, sent);
+    }
+    if (q->head == q->tail) {
+        q->head = q->tail = 0;
+    }
+    if (!q->doomed) {
+        outq_watch(uid, q->head < q->tail);
+    }
+}
 
-        total_len += len;
+void outq_close(int uid) {
+    outq_t* q = &outqs[uid];
+    pthread_mutex_lock(&q->lock);
+    if (q->conn >= 0 && !q->doomed) {
+        outq_flush(uid);
+    }
+    if (q->dropped) {
+        log("session #%d dropped %lu stale frame(s)", uid, q->dropped);
     }
+    q->conn = -1;
+    q->head = q->tail = 0;
+    pthread_mutex_unlock(&q->lock);
 }
 
-void wrap_send(int conn, server_message_t* psm) {
-    size_t total_len = 0;
-    while (total_len < sizeof(server_message_t)) {
-        size_t len = send(conn, psm + total_len, sizeof(server_message_t) - total_len, 0);
-        if (len < 0) {
-            loge("broken pipe");
+void session_writable(int uid) {
+    outq_t* q = &outqs[uid];
+    pthread_mutex_lock(&q->lock);
+    if (q->conn >= 0) {
+        outq_flush(uid);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* queue a message for a session, never blocks.
+ *
+ * battle frames are superseded by the next tick, so when the client
+ * falls behind they are handled by `outq_policy`. other messages are
+ * never dropped, a client who can not take them any more is closed.
+ */
+void wrap_send(int uid, server_message_t* psm) {
+    outq_t* q = &outqs[uid];
+    uint8_t frame[MAX_FRAME_SIZE];
+    size_t len = encode_server_message(psm, frame);
+    if (len == 0) {
+        loge("message %d to session #%d does not fit in a frame", psm->message, uid);
+        return;
+    }
+    int stale = psm->message == SERVER_MESSAGE_BATTLE_INFORMATION
+             || psm->message == SERVER_MESSAGE_BATTLE_PLAYER;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->conn < 0 || q->doomed) {
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+
+    uint64_t pending = q->tail - q->head;
+    if (stale && pending > 0) {
+        if (outq_policy == OUTQ_POLICY_COALESCE
+            && q->last_message == psm->message
+            && q->last_pos >= q->head) {
+            // the newest frame is not on the wire yet, overwrite it
+            q->tail = q->last_pos;
+            q->dropped++;
+            metric_add(METRIC_FRAMES_DROPPED);
+        } else if (pending >= OUTQ_HIGH_WATER) {
+            if (outq_policy == OUTQ_POLICY_DISCONNECT) {
+                logw("session #%d falls behind (%luB pending), disconnect", uid, pending);
+                outq_doom(uid);
+                metric_add(METRIC_SLOW_CLOSES);
+            } else {
+                q->dropped++;
+                metric_add(METRIC_FRAMES_DROPPED);
+            }
+            pthread_mutex_unlock(&q->lock);
+            return;
         }
+    }
 
-        total_len += len;
+    if (q->tail - q->head + len > OUTQ_SIZE) {
+        logw("outbound queue of session #%d is full, disconnect", uid);
+        outq_doom(uid);
+        metric_add(METRIC_SLOW_CLOSES);
+        pthread_mutex_unlock(&q->lock);
+        return;
     }
+
+    q->last_pos = q->tail;
+    q->last_message = psm->message;
+    for (size_t copied = 0; copied < len; ) {
+        size_t off = q->tail % OUTQ_SIZE;
+        size_t n = min(len - copied, OUTQ_SIZE - off);
+        memcpy(q->buf + off, frame + copied, n);
+        copied += n;
+        q->tail += n;
+    }
+    metric_add(METRIC_MESSAGES_SENT);
+
+    if (!q->want_write) {
+        outq_flush(uid);
+    }
+    pthread_mutex_unlock(&q->lock);
 }
 
 void send_to_client(int uid, int message) {
@@ -1611,7 +3156,7 @@ void send_to_client(int uid, int message) {
     server_message_t sm;
     memset(&sm, 0, sizeof(server_message_t));
     sm.response = message;
-    wrap_send(conn, &sm);
+    wrap_send(uid, &sm);
 }
 
 void send_to_client(int uid, int message, char* str) {
@@ -1621,7 +3166,7 @@ void send_to_client(int uid, int message, char* str) {
     memset(&sm, 0, sizeof(server_message_t));
     sm.response = message;
     strncpy(sm.msg, str, MSG_SIZE - 1);
-    wrap_send(conn, &sm);
+    wrap_send(uid, &sm);
 }
 
 void say_to_client(int uid, char *message) {
@@ -1632,7 +3177,7 @@ void say_to_client(int uid, char *message) {
     memset(&sm, 0, sizeof(server_message_t));
     sm.message = SERVER_MESSAGE;
     strncpy(sm.msg, message, MSG_SIZE - 1);
-    wrap_send(conn, &sm);
+    wrap_send(uid, &sm);
 }
 
 void send_to_client_with_username(int uid, int message, char* user_name) {
@@ -1642,53 +3187,339 @@ void send_to_client_with_username(int uid, int message, char* user_name) {
     memset(&sm, 0, sizeof(server_message_t));
     sm.response = message;
     strncpy(sm.friend_name, user_name, USERNAME_SIZE - 1);
-    wrap_send(conn, &sm);
+    wrap_send(uid, &sm);
 }
 
+// reject a connection which has no session, best effort only
 void close_session(int conn, int message) {
-    send_to_client(conn, message);
+    server_message_t sm;
+    uint8_t frame[MAX_FRAME_SIZE];
+    memset(&sm, 0, sizeof(server_message_t));
+    sm.response = message;
+    send(conn, frame, encode_server_message(&sm, frame), MSG_NOSIGNAL | MSG_DONTWAIT);
     close(conn);
 }
 
-void* session_start(void* args) {
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+void session_start(int conn, const char* ip_addr) {
     int uid = -1;
-    session_args_t info = *(session_args_t*)(uintptr_t)args;
-    client_message_t* pcm = NULL;
     if ((uid = get_unused_session()) < 0) {
-        close_session(info.conn, SERVER_RESPONSE_LOGIN_FAIL_SERVER_LIMITS);
-        return NULL;
-    } else {
-        sessions[uid].conn = info.conn;
-        strncpy(sessions[uid].user_name, "<unknown>", USERNAME_SIZE - 1);
-        strncpy(sessions[uid].ip_addr, info.ip_addr, IPADDR_SIZE - 1);
-        if (strncmp(sessions[uid].ip_addr, "", IPADDR_SIZE) == 0) {
-            strncpy(sessions[uid].ip_addr, "unknown", IPADDR_SIZE - 1);
+        close_session(conn, SERVER_RESPONSE_LOGIN_FAIL_SERVER_LIMITS);
+        return;
+    }
+
+    int sndbuf = SESSION_SNDBUF;
+    if (setsockopt(conn, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == -1) {
+        logw("fail to limit send buffer of conn:%d", conn);
+    }
+    // a frame is written at once, its last segment must not wait for
+    // the ack of the ones before it
+    int one = 1;
+    if (setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+        logw("fail to disable nagle of conn:%d", conn);
+    }
+
+    sessions[uid].conn = conn;
+    sessions[uid].rbuf_len = 0;
+    outq_open(uid, conn);
+    strncpy(sessions[uid].user_name, "<unknown>", USERNAME_SIZE - 1);
+    strncpy(sessions[uid].ip_addr, ip_addr, IPADDR_SIZE - 1);
+    if (strncmp(sessions[uid].ip_addr, "", IPADDR_SIZE) == 0) {
+        strncpy(sessions[uid].ip_addr, "unknown", IPADDR_SIZE - 1);
+    }
+    memset(&sessions[uid].cm, 0, sizeof(client_message_t));
+    log("build session #%d", uid);
+    if (strncmp(ip_addr, "127.0.0.1", IPADDR_SIZE) == 0) {
+        log("admin login!");
+        sessions[uid].is_admin = 1;
+    }
+    sessions[uid].death = sessions[uid].kill = 0;
+    sessions[uid].score = INIT_SCORE;
+    sessions[uid].account = -1;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u32 = uid;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn, &ev) == -1) {
+        loge("fail to watch conn:%d of session #%d", conn, uid);
+        client_command_quit(uid);
+    }
+}
+
+/* read what the client sent and dispatch every complete frame. frames
+ * may arrive split or batched, leftover bytes stay in `rbuf`.
+ */
+void session_readable(int uid) {
+    session_t* s = &sessions[uid];
+    int conn = s->conn;
+    if (conn < 0) return;
+
+    for (int round = 0; round < SESSION_RECV_BATCH; round++) {
+        ssize_t len = recv(conn, s->rbuf + s->rbuf_len, sizeof(s->rbuf) - s->rbuf_len, 0);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            loge("broken pipe of session #%d", uid);
         }
-        pcm = &sessions[uid].cm;
-        memset(pcm, 0, sizeof(client_message_t));
-        log("build session #%d", uid);
-        if (strncmp(info.ip_addr, "127.0.0.1", IPADDR_SIZE) == 0) {
-            log("admin login!");
-            sessions[uid].is_admin = 1;
+        if (len <= 0) {
+            log("session #%d disconnected", uid);
+            client_command_quit(uid);
+            return;
         }
-        sessions[uid].death = sessions[uid].kill = 0;
-        sessions[uid].score = 50;
+        s->rbuf_len += len;
+        metric_add(METRIC_BYTES_RECEIVED, len);
+
+        size_t off = 0;
+        int size;
+        while ((size = frame_size(s->rbuf + off, s->rbuf_len - off)) > 0) {
+            if (!decode_client_message(s->rbuf + off, size, &s->cm)) {
+                size = -1;
+                break;
+            }
+            off += size;
+            metric_add(METRIC_MESSAGES_RECEIVED);
+            if (s->cm.command >= CLIENT_COMMAND_END)
+                continue;
+
+            int ret_code = handler[s->cm.command](uid);
+            if (ret_code < 0 || s->conn != conn) {
+                log("close session #%d", uid);
+                return;
+            }
+        }
+        if (size < 0) {
+            logw("malformed frame from session #%d, disconnect", uid);
+            client_command_quit(uid);
+            return;
+        }
+        memmove(s->rbuf, s->rbuf + off, s->rbuf_len - off);
+        s->rbuf_len -= off;
     }
+}
+
+// the listener is left out of epoll until then after an accept failed, 0 if watched
+static uint64_t accept_resume_ns = 0;
 
+void watch_listener() {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = EPOLL_LISTEN_TOKEN;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
+        eprintf("fail to watch server fd.");
+    }
+}
+
+void accept_clients() {
+    struct sockaddr_in client_addr;
+    socklen_t length = sizeof(client_addr);
+    char ip_addr[IPADDR_SIZE];
     while (1) {
-        wrap_recv(info.conn, pcm);
-        if (pcm->command >= CLIENT_COMMAND_END)
-            continue;
+        length = sizeof(client_addr);
+        int conn = accept4(server_fd, (struct sockaddr*)&client_addr, &length, SOCK_NONBLOCK);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // the listener stays readable while such errors last, so
+                // stop watching it for a while instead of failing in a loop
+                loge("fail to accept client: %s", strerror(errno));
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_fd, NULL) == 0)
+                    accept_resume_ns = monotonic_ns() + ACCEPT_RETRY_MS * NS_PER_MS;
+            }
+            return;
+        }
+        metric_add(METRIC_ACCEPTS);
+        memset(ip_addr, 0, sizeof(ip_addr));
+        strncpy(ip_addr, inet_ntoa(client_addr.sin_addr), IPADDR_SIZE - 1);
+        log("connected by %s:%d , conn:%d", ip_addr, client_addr.sin_port, conn);
+        session_start(conn, ip_addr);
+    }
+}
 
-        int ret_code = handler[pcm->command](uid);
-        if (ret_code < 0) {
-            log("close session #%d", uid);
-            break;
+void run_reactor() {
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        eprintf("fail to create epoll instance.");
+    }
+
+    if (set_nonblocking(server_fd) == -1) {
+        eprintf("fail to watch server fd.");
+    }
+    watch_listener();
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = EPOLL_SIGNAL_TOKEN;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_pipe[0], &ev) == -1) {
+        eprintf("fail to watch signal pipe.");
+    }
+
+    while (1) {
+        int timeout = -1;
+        if (accept_resume_ns) {
+            uint64_t now = monotonic_ns();
+            if (now >= accept_resume_ns) {
+                accept_resume_ns = 0;
+                watch_listener();
+            } else {
+                timeout = (accept_resume_ns - now + NS_PER_MS - 1) / NS_PER_MS;
+            }
+        }
+        int nr_events = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, timeout);
+        if (nr_events < 0) {
+            if (errno == EINTR) continue;
+            eprintf("epoll_wait failed.");
+        }
+        for (int i = 0; i < nr_events; i++) {
+            if (events[i].data.u32 == EPOLL_LISTEN_TOKEN) {
+                accept_clients();
+            } else if (events[i].data.u32 == EPOLL_SIGNAL_TOKEN) {
+                handle_signal();
+            } else {
+                if (events[i].events & EPOLLOUT)
+                    session_writable(events[i].data.u32);
+                if (events[i].events & ~EPOLLOUT)
+                    session_readable(events[i].data.u32);
+            }
         }
     }
+}
+
+/* gauges are read from the tables as they are, the values of a scrape
+ * need not be from one instant.
+ */
+void compose_metrics(std::string* out) {
+    static const char* state_s[] = { "unused", "not_login", "login", "battle", "wait_to_battle" };
+    int states[5] = {0};
+    uint64_t pending = 0, deepest = 0;
+    for (int uid = 0; uid < sessions.size(); uid++) {
+        int state = sessions[uid].state;
+        if (state >= 0 && state < 5) states[state]++;
+        outq_t* q = &outqs[uid];
+        pthread_mutex_lock(&q->lock);
+        uint64_t depth = q->conn >= 0 ? q->tail - q->head : 0;
+        pthread_mutex_unlock(&q->lock);
+        pending += depth;
+        if (depth > deepest) deepest = depth;
+    }
+
+    metrics_counters(out);
+    metrics_describe(out, "stg_sessions", "gauge", "Sessions by state.");
+    for (int i = 0; i < 5; i++)
+        metrics_printf(out, "stg_sessions{state=\"%s\"} %d\n", state_s[i], states[i]);
+    metrics_describe(out, "stg_outq_pending_bytes", "gauge", "Bytes queued for clients.");
+    metrics_printf(out, "stg_outq_pending_bytes %lu\n", pending);
+    metrics_describe(out, "stg_outq_deepest_bytes", "gauge", "Bytes queued for the client furthest behind.");
+    metrics_printf(out, "stg_outq_deepest_bytes %lu\n", deepest);
+
+    vector<int> running;
+    pthread_mutex_lock(&scheduler.lock);
+    for (int bid = 0; bid < battles.size(); bid++) {
+        if (battles[bid].is_alloced) running.push_back(bid);
+    }
+    pthread_mutex_unlock(&scheduler.lock);
+    metrics_describe(out, "stg_battles", "gauge", "Battles running.");
+    metrics_printf(out, "stg_battles %lu\n", running.size());
+    metrics_describe(out, "stg_battle_players", "gauge", "Players in a battle.");
+    for (int bid : running)
+        metrics_printf(out, "stg_battle_players{battle=\"%d\"} %lu\n", bid, battles[bid].all_users);
+    metrics_describe(out, "stg_battle_items", "gauge", "Items in a battle by kind.");
+    for (int bid : running) {
+        for (int kind = ITEM_NONE + 1; kind < ITEM_SIZE; kind++) {
+            if (kind == ITEM_END) continue;
+            metrics_printf(out, "stg_battle_items{battle=\"%d\",kind=\"%s\"} %d\n", bid, item_s[kind],
+                           battles[bid].item_kinds[kind].load(memory_order_relaxed));
+        }
+    }
+
+    // only the scraper gets here, and it is too large for the stack
+    static histogram_t tick;
+    metrics_describe(out, "stg_tick_seconds", "summary", "Time of a battle tick, see admin prof.");
+    for (int bid : running) {
+        tick_profile_t& profile = battles[bid].profile;
+        pthread_mutex_lock(&profile.lock);
+        memcpy(&tick, &profile.phases[PHASE_TICK], sizeof(tick));
+        pthread_mutex_unlock(&profile.lock);
+        for (double q : { 50., 99., 99.9 })
+            metrics_printf(out, "stg_tick_seconds{battle=\"%d\",quantile=\"%g\"} %.9f\n",
+                           bid, q / 100, hist_percentile(&tick, q) / 1e9);
+        metrics_printf(out, "stg_tick_seconds_sum{battle=\"%d\"} %.9f\n", bid, tick.sum / 1e9);
+        metrics_printf(out, "stg_tick_seconds_count{battle=\"%d\"} %lu\n", bid, tick.count);
+    }
+}
+
+/* the metrics socket, served by a thread of its own. a scraper connects
+ * and gets compose_metrics in the prometheus text format, then the
+ * connection closes. a request that starts with GET gets an http header
+ * first, so that `curl --unix-socket` works as well as `nc -U`.
+ */
+void* serve_metrics(void* args) {
+    int fd = (int)(intptr_t)args;
+    std::string out;
+    while (1) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno != EINTR) {
+                // such errors persist a while, retrying at once would spin
+                loge("fail to accept on the metrics socket: %s", strerror(errno));
+                usleep(ACCEPT_RETRY_MS * 1000);
+            }
+            continue;
+        }
+        struct timeval timeout = { 1, 0 };
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        char request[512];
+        struct pollfd pfd = { conn, POLLIN, 0 };
+        ssize_t len = poll(&pfd, 1, METRICS_REQUEST_MS) > 0 ? recv(conn, request, sizeof(request), MSG_DONTWAIT) : 0;
+        bool http = len >= 4 && memcmp(request, "GET ", 4) == 0;
+
+        out.clear();
+        compose_metrics(&out);
+        if (http) {
+            char header[128];
+            snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %lu\r\n\r\n", out.size());
+            out.insert(0, header);
+        }
+        for (size_t sent = 0; sent < out.size(); ) {
+            ssize_t n = send(conn, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            sent += n;
+        }
+        close(conn);
+    }
     return NULL;
 }
 
+void metrics_start(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        eprintf("metrics socket path `%s` is too long", path);
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);  // left over by a server that did not exit cleanly
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+        || listen(fd, SOMAXCONN) == -1) {
+        eprintf("fail to listen on metrics socket %s", path);
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_metrics, (void*)(intptr_t)fd) != 0) {
+        eprintf("fail to start metrics thread");
+    }
+    pthread_detach(thread);
+    log("metrics on %s", path);
+}
+
 void* run_battle(void* args) {
     // TODO:
     return NULL;
@@ -1721,7 +3552,7 @@ int server_start() {
         eprintf("can not start server.");
     }
 
-    if (listen(sockfd, USER_CNT) == -1) {
+    if (listen(sockfd, SOMAXCONN) == -1) {
         eprintf("fail to listen on socket.");
     } else {
         log("listen on port %d.", port);
@@ -1731,7 +3562,7 @@ int server_start() {
 }
 
 void terminate_process(int signum) {
-    for (int i = 0; i < USER_CNT; i++) {
+    for (int i = 0; i < sessions.size(); i++) {
         if (sessions[i].conn >= 0) {
             log("send quit to user #%d %s\033[2m(%s)\033[0m", i, sessions[i].user_name, sessions[i].ip_addr);
             if (signum) {
@@ -1742,6 +3573,7 @@ void terminate_process(int signum) {
                 send_to_client(i, SERVER_STATUS_QUIT);
             }
             log("close conn:%d", sessions[i].conn);
+            outq_close(i);
             close(sessions[i].conn);
             sessions[i].conn = -1;
         }
@@ -1751,75 +3583,153 @@ void terminate_process(int signum) {
         close(server_fd);
         log("close server fd:%d", server_fd);
     }
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    if (metrics_path) {
+        unlink(metrics_path);
+    }
+    // no battle changes an account past the last snapshot
+    scheduler_stop();
+    accounts_stop();
 
     pthread_mutex_destroy(&sessions_lock);
     pthread_mutex_destroy(&battles_lock);
-    for (int i = 0; i < USER_CNT; i++) {
-        pthread_mutex_destroy(&items_lock[i]);
-    }
 
     log("exit(%d)", signum);
     exit(signum);
 }
 
+/* SIGINT and SIGTERM. the handler may have interrupted the reactor or a
+ * worker holding any lock, so it only wakes the reactor up, which then
+ * shuts down in handle_signal.
+ */
 void terminate_entrance(int signum) {
-    loge("received signal %s, terminate.", signal_name_s[signum]);
-    terminate_process(signum == SIGINT ? 0 : signum);
+    int saved_errno = errno;
+    uint8_t byte = signum;
+    // a full pipe already has a shutdown on the way
+    ssize_t n = write(signal_pipe[1], &byte, 1);
+    (void)n;
+    errno = saved_errno;
+}
+
+void handle_signal() {
+    uint8_t byte;
+    if (read(signal_pipe[0], &byte, 1) != 1) return;
+    loge("received signal %s, terminate.", signal_name_s[byte]);
+    terminate_process(byte == SIGINT ? 0 : byte);
+}
+
+/* SIGSEGV, SIGABRT and SIGTRAP. the process can not be trusted to shut
+ * down in order, so it dies the default way. the account changes already
+ * in USERS_LOG_FILE are replayed at the next start.
+ */
+void crash_entrance(int signum) {
+    const char* name = signal_name_s[signum];
+    ssize_t n = write(STDERR_FILENO, "received signal ", 16);
+    n = write(STDERR_FILENO, name, strlen(name));
+    n = write(STDERR_FILENO, ", abort.\n", 9);
+    (void)n;
+    signal(signum, SIG_DFL);
+    raise(signum);
+}
+
+int parse_outq_policy(const char* name) {
+    if (strcmp(name, "drop") == 0) return OUTQ_POLICY_DROP;
+    if (strcmp(name, "coalesce") == 0) return OUTQ_POLICY_COALESCE;
+    if (strcmp(name, "disconnect") == 0) return OUTQ_POLICY_DISCONNECT;
+    return -1;
 }
 
+// tickbench.cpp takes the rest of the server for its own main
+#ifndef SERVER_NO_MAIN
 int main(int argc, char* argv[]) {
+    logger_start();
     init_constants();
     init_handler();
-    if (argc == 2) {
-        port = atoi(argv[1]);
+    int opt, workers = BATTLE_WORKERS;
+    int ffa_w = FFA_MAP_W, ffa_h = FFA_MAP_H;
+    while ((opt = getopt(argc, argv, "q:w:p:m:r:s:")) != -1) {
+        switch (opt) {
+            case 'q': {
+                outq_policy = parse_outq_policy(optarg);
+                if (outq_policy < 0)
+                    eprintf("unknown policy `%s`, use drop, coalesce or disconnect", optarg);
+                break;
+            }
+            case 'w': {
+                workers = atoi(optarg);
+                if (workers < 1)
+                    eprintf("battle workers should be at least 1");
+                break;
+            }
+            case 'p': {
+                battle_capacity = atoi(optarg);
+                if (battle_capacity < 1 || battle_capacity > MAX_BATTLE_PLAYERS)
+                    eprintf("players per battle should be within 1..%d", MAX_BATTLE_PLAYERS);
+                break;
+            }
+            case 'm': {
+                if (sscanf(optarg, "%dx%d", &ffa_w, &ffa_h) != 2
+                    || ffa_w < BATTLE_W || ffa_w > MAX_ARENA_SIZE
+                    || ffa_h < BATTLE_H || ffa_h > MAX_ARENA_SIZE)
+                    eprintf("ffa arena should be WxH within %dx%d..%dx%d",
+                            BATTLE_W, BATTLE_H, MAX_ARENA_SIZE, MAX_ARENA_SIZE);
+                break;
+            }
+            case 'r': {
+                record_dir = optarg;
+                break;
+            }
+            case 's': {
+                metrics_path = optarg;
+                break;
+            }
+            default:
+                eprintf("usage: %s [-q drop|coalesce|disconnect] [-w workers] [-p players] [-m WxH] [-r record_dir] [-s metrics_socket] [port]", argv[0]);
+        }
     }
-    srand(time(NULL));
-
-    pthread_t thread;
+    if (optind < argc) {
+        port = atoi(argv[optind]);
+    }
+    spawn_rng.seed(time(NULL));
 
+    if (pipe2(signal_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        eprintf("fail to create signal pipe.");
+    }
     if (signal(SIGINT, terminate_entrance) == SIG_ERR) {
         eprintf("an error occurred while setting a signal handler.");
     }
-    if (signal(SIGSEGV, terminate_entrance) == SIG_ERR) {
+    if (signal(SIGSEGV, crash_entrance) == SIG_ERR) {
         eprintf("an error occurred while setting a signal handler.");
     }
-    if (signal(SIGABRT, terminate_entrance) == SIG_ERR) {
+    if (signal(SIGABRT, crash_entrance) == SIG_ERR) {
         eprintf("an error occurred while setting a signal handler.");
     }
     if (signal(SIGTERM, terminate_entrance) == SIG_ERR) {
         eprintf("an error occurred while setting a signal handler.");
     }
-    if (signal(SIGTRAP, terminate_entrance) == SIG_ERR) {
+    if (signal(SIGTRAP, crash_entrance) == SIG_ERR) {
         eprintf("an error occurred while setting a signal handler.");
     }
 
-    for (int i = 0; i < USER_CNT; i++) {
-        pthread_mutex_init(&items_lock[i], NULL);
-    }
     log("server %s", version);
     if (sizeof(server_message_t) >= 1000)
         logw("message_size = %ldB", sizeof(server_message_t));
 
     server_fd = server_start();
-    load_user_list();
+    load_users();
+    accounts_start();
 
-    for (int i = 0; i < USER_CNT; i++)
-        sessions[i].conn = -1;
+    // battle #0 is kept for ffa, the tables grow from here on demand
+    battles.grow();
+    battles[0].resize(ffa_w, ffa_h);
+    init_scheduler(workers);
+    if (metrics_path)
+        metrics_start(metrics_path);
 
-    struct sockaddr_in client_addr;
-    socklen_t length = sizeof(client_addr);
-    while (1) {
-        static session_args_t info;
-        info.conn = accept(server_fd, (struct sockaddr*)&client_addr, &length);
-        strncpy(info.ip_addr, inet_ntoa(client_addr.sin_addr), IPADDR_SIZE - 1);
-        log("connected by %s:%d , conn:%d", info.ip_addr, client_addr.sin_port, info.conn);
-        if (info.conn < 0) {
-            loge("fail to accept client.");
-        } else if (pthread_create(&thread, NULL, session_start, (void*)(uintptr_t)&info) != 0) {
-            loge("fail to create thread.");
-        }
-        logi("bind thread #%lu", thread);
-    }
+    run_reactor();
 
     return 0;
 }
+#endif
@@ -20,6 +20,12 @@ static int BULLETS_LASTS_TIME = 100;
 static int OTHER_ITEM_LASTS_TIME = 1000;
 
 #define GLOBAL_SPEED 20
+// threads ticking the battles, see the -w option
+#define BATTLE_WORKERS 4
+// players per battle, see the -p option
+#define BATTLE_CAPACITY 64
+// largest side of the ffa arena, see the -m option
+#define MAX_ARENA_SIZE 2048
 #define BULLET_SPEED 2
 
 #define ADMIN_COMMAND_LEN 32
@@ -0,0 +1,254 @@
+// replays battle records of `server -r` through the simulation of the
+// server as fast as it goes: no sockets, no sleeps and no frames. every
+// digest in a record is checked, so a replay that goes another way than
+// the battle did is reported instead of timed quietly
+//
+//     make tickbench && ./tickbench [-n rounds] record...
+
+// the simulation logs every move, it is timed without them
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_WARN
+#endif
+#define SERVER_NO_MAIN
+#include "server.cpp"
+#include "histogram.h"
+
+#define NR_ROUNDS 5
+
+enum {
+    EVENT_JOIN,
+    EVENT_QUIT,
+    EVENT_INPUT,
+    EVENT_DIGEST,
+};
+
+struct record_event_t {
+    uint64_t tick;
+    int kind;
+    int arg[6];
+    uint64_t digest;
+};
+
+struct record_t {
+    const char* path;
+    uint64_t seed;
+    int w, h, players;
+    int max_uid;
+    uint64_t ticks;  // of the last line
+    size_t inputs;
+    vector<record_event_t> events;
+};
+
+// false with a message if `path` is not a record this build can play
+bool load_record(const char* path, record_t* r) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    r->path = path;
+    r->max_uid = -1;
+    r->ticks = 0;
+    r->inputs = 0;
+
+    char line[256], kind[16];
+    int version = -1, nr = 0;
+    bool ok = fgets(line, sizeof(line), fp) && sscanf(line, "stg-record %d", &version) == 1
+           && version == RECORD_VERSION
+           && fgets(line, sizeof(line), fp)
+           && sscanf(line, "seed %lu arena %d %d players %d", &r->seed, &r->w, &r->h, &r->players) == 4
+           && r->players >= 1 && r->players <= MAX_BATTLE_PLAYERS
+           && r->w >= BATTLE_W && r->w <= MAX_ARENA_SIZE
+           && r->h >= BATTLE_H && r->h <= MAX_ARENA_SIZE;
+    for (nr = 3; ok && fgets(line, sizeof(line), fp); nr++) {
+        record_event_t e;
+        int n;
+        memset(&e, 0, sizeof(e));
+        if (sscanf(line, "%lu %15s %n", &e.tick, kind, &n) != 2 || e.tick < r->ticks) {
+            ok = false;
+        } else if (strcmp(kind, "join") == 0) {
+            e.kind = EVENT_JOIN;
+            ok = sscanf(line + n, "%d %d %d %d %d %d", &e.arg[0], &e.arg[1], &e.arg[2],
+                        &e.arg[3], &e.arg[4], &e.arg[5]) == 6
+              && e.arg[0] >= 0 && e.arg[0] < r->players && e.arg[1] >= 0
+              && e.arg[2] >= 0 && e.arg[2] < r->w && e.arg[3] >= 0 && e.arg[3] < r->h;
+            r->max_uid = max(r->max_uid, e.arg[1]);
+        } else if (strcmp(kind, "quit") == 0) {
+            e.kind = EVENT_QUIT;
+            ok = sscanf(line + n, "%d", &e.arg[0]) == 1 && e.arg[0] >= 0 && e.arg[0] < r->players;
+        } else if (strcmp(kind, "input") == 0) {
+            e.kind = EVENT_INPUT;
+            ok = sscanf(line + n, "%d %d", &e.arg[0], &e.arg[1]) == 2
+              && e.arg[0] >= 0 && e.arg[1] >= 0 && e.arg[1] < 256 && battle_handler[e.arg[1]];
+            r->inputs++;
+        } else if (strcmp(kind, "digest") == 0) {
+            e.kind = EVENT_DIGEST;
+            ok = sscanf(line + n, "%lx", &e.digest) == 1;
+        } else {
+            ok = false;
+        }
+        r->ticks = e.tick;
+        r->events.push_back(e);
+    }
+    fclose(fp);
+    if (!ok) {
+        fprintf(stderr, "%s:%d: not a record of version %d\n", path, nr - 1, RECORD_VERSION);
+        return false;
+    }
+    // inputs of users who never joined are dropped by the tick anyway
+    for (auto& e : r->events) {
+        if (e.kind == EVENT_INPUT) r->max_uid = max(r->max_uid, e.arg[0]);
+    }
+    return true;
+}
+
+// apply_join as the tick saw its outcome
+void replay_join(const record_event_t& e) {
+    int pid = e.arg[0], uid = e.arg[1];
+    battle_t& b = battles[0];
+    battle_t::user_t& user = b.users[pid];
+    user.uid = uid;
+    user.dir = DIR_UP;
+    user.pos.x = e.arg[2];
+    user.pos.y = e.arg[3];
+    user.life = e.arg[4];
+    user.energy = e.arg[5];
+    user.killby = -1;
+    sessions[uid].state = USER_STATE_BATTLE;
+    sessions[uid].bid = 0;
+    if (uid >= (int)b.pid_of.size())
+        b.pid_of.resize(uid + 1, -1);
+    b.pid_of[uid] = pid;
+    b.all_users++;
+    b.alive_users++;
+    user.battle_state = BATTLE_STATE_LIVE;
+}
+
+void replay_quit(const record_event_t& e) {
+    battle_t::user_t& user = battles[0].users[e.arg[0]];
+    if (user.battle_state == BATTLE_STATE_UNJOINED) return;
+    battles[0].all_users--;
+    if (user.battle_state == BATTLE_STATE_LIVE)
+        battles[0].alive_users--;
+    user.battle_state = BATTLE_STATE_UNJOINED;
+    sessions[user.uid].state = USER_STATE_LOGIN;
+    battles[0].pid_of[user.uid] = -1;
+}
+
+/* play the record once into battle #0, recording the time of every
+ * tick. returns the tick whose digest disagrees, 0 if all agree.
+ */
+uint64_t replay(const record_t& r, histogram_t* tick_ns, uint64_t* elapsed_ns, int* digests) {
+    battle_t& b = battles[0];
+    for (auto& user : b.users)
+        user.battle_state = BATTLE_STATE_UNJOINED;
+    b.resize(r.w, r.h);
+    b.is_alloced = true;
+    for (int uid = 0; uid <= r.max_uid; uid++)
+        sessions[uid].reset();
+    seed_battle(0, r.seed);
+
+    uint64_t diverged = 0;
+    size_t next = 0;
+    *digests = 0;
+    *elapsed_ns = 0;
+    for (uint64_t tick = 1; tick <= r.ticks; tick++) {
+        uint64_t start = monotonic_ns();
+        b.global_time++;
+        for (; next < r.events.size() && r.events[next].tick == tick; next++) {
+            const record_event_t& e = r.events[next];
+            if (e.kind == EVENT_DIGEST) break;
+            switch (e.kind) {
+                case EVENT_JOIN: replay_join(e); break;
+                case EVENT_QUIT: replay_quit(e); break;
+                case EVENT_INPUT: {
+                    int pid = battle_slot(0, e.arg[0]);
+                    if (pid >= 0)
+                        battle_handler[e.arg[1]](0, pid);
+                    break;
+                }
+            }
+        }
+        move_bullets(0);
+        check_all_user_status(0);
+        check_who_is_dead(0);
+        clear_items(0);
+        for (int i = 0; i < b.screens; i++)
+            random_generate_items(0);
+        uint64_t end = monotonic_ns();
+        hist_record(tick_ns, end - start);
+        *elapsed_ns += end - start;
+
+        // the digest closes the lines of its tick
+        if (next < r.events.size() && r.events[next].tick == tick) {
+            (*digests)++;
+            if (!diverged && battle_digest(0) != r.events[next].digest)
+                diverged = tick;
+            next++;
+        }
+    }
+    return diverged;
+}
+
+int main(int argc, char* argv[]) {
+    init_constants();
+    init_handler();
+    int opt, rounds = NR_ROUNDS;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n': {
+                rounds = atoi(optarg);
+                if (rounds < 1)
+                    eprintf("rounds should be at least 1");
+                break;
+            }
+            default:
+                eprintf("usage: %s [-n rounds] record...", argv[0]);
+        }
+    }
+    if (optind == argc)
+        eprintf("usage: %s [-n rounds] record...", argv[0]);
+
+    vector<record_t> records(argc - optind);
+    int players = 1, max_uid = 0;
+    for (int i = optind; i < argc; i++) {
+        if (!load_record(argv[i], &records[i - optind])) return 1;
+        players = max(players, records[i - optind].players);
+        max_uid = max(max_uid, records[i - optind].max_uid);
+    }
+    // one battle with room for the players of every record
+    battle_capacity = players;
+    battles.grow();
+    while (sessions.size() <= max_uid) {
+        if (sessions.grow() < 0) eprintf("uid %d is beyond the sessions", max_uid);
+    }
+
+    int failed = 0;
+    static histogram_t tick_ns;
+    printf("%d rounds per record, tick times in us\n", rounds);
+    printf("%-32s %8s %8s %10s %8s %8s %8s %8s\n",
+           "record", "ticks", "inputs", "ticks/s", "mean", "p50", "p99", "p99.9");
+    for (auto& r : records) {
+        hist_reset(&tick_ns);
+        uint64_t best = UINT64_MAX, diverged = 0;
+        int digests = 0;
+        for (int round = 0; round < rounds; round++) {
+            uint64_t elapsed;
+            uint64_t at = replay(r, &tick_ns, &elapsed, &digests);
+            if (at && !diverged) diverged = at;
+            if (elapsed < best) best = elapsed;
+        }
+        const char* name = strrchr(r.path, '/') ? strrchr(r.path, '/') + 1 : r.path;
+        printf("%-32s %8lu %8lu %10.0f %8.1f %8.1f %8.1f %8.1f\n", name, r.ticks, r.inputs,
+               best ? r.ticks * 1e9 / best : 0.,
+               hist_mean(&tick_ns) / 1e3, hist_percentile(&tick_ns, 50) / 1e3,
+               hist_percentile(&tick_ns, 99) / 1e3, hist_percentile(&tick_ns, 99.9) / 1e3);
+        if (diverged) {
+            printf("    replay diverges by tick %lu, the numbers are not the battle's\n", diverged);
+            failed = 1;
+        } else if (digests == 0) {
+            printf("    no digest to check, record shorter than %d ticks\n", RECORD_DIGEST_TICKS);
+        }
+    }
+    return failed;
+}
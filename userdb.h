@@ -0,0 +1,335 @@
+// registered accounts of the server and the files they are kept in
+
+#ifndef USERDB_H
+#define USERDB_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "constants.h"
+
+/* accounts are kept in two files. the snapshot is a header and then one
+ * fixed-size record per account in the order they registered. the log
+ * holds every change made since, one checksummed entry each, numbered
+ * on from the `lsn` of the snapshot. loading reads the snapshot and
+ * replays the log up to the first entry that is cut short or damaged.
+ */
+#define USERDB_MAGIC "stgusers"
+#define USERDB_VERSION 2
+
+// slots of the index, a power of two. it doubles past half full
+#define USERDB_INIT_SLOTS 1024
+#define USERDB_MAX_USERS (1 << 24)
+
+#define INIT_SCORE 50
+
+struct userdb_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t lsn;  // of the last log entry folded in, absent in version 1
+};
+
+// version 1 had names and passwords only, and no lsn
+#define USERDB_V1_HEADER_SIZE 16
+#define USERDB_V1_RECORD_SIZE (USERNAME_SIZE + PASSWORD_SIZE)
+
+struct user_record_t {
+    char name[USERNAME_SIZE];  // zero padded
+    char password[PASSWORD_SIZE];
+    int32_t score;
+    int32_t kill;
+    int32_t death;
+};
+
+enum {
+    WAL_REGISTER,  // `user` is account `id`, the next one
+    WAL_STATS,     // account `id` has the score, kill and death of `user`
+};
+
+struct wal_entry_t {
+    uint64_t lsn;
+    uint32_t kind;
+    int32_t id;
+    user_record_t user;
+    uint32_t sum;  // FNV-1a over the fields above
+};
+
+/* accounts in memory, indexed by name with open addressing and linear
+ * probing. a slot keeps the hash of its name beside the id, so a probe
+ * only compares names when the hashes agree. accounts are never removed,
+ * so the index needs no tombstones.
+ */
+class userdb_t { public:
+    struct slot_t {
+        uint32_t hash;
+        int32_t id;  // into `users`, -1 if the slot is empty
+    };
+
+    std::vector<user_record_t> users;
+    slot_t* slots;
+    uint32_t mask;
+    uint64_t lsn;       // of the last change loaded
+    const char* error;  // why the last load failed
+
+    static uint32_t hash(const char* name) {
+        uint32_t h = 2166136261u;
+        for (int i = 0; i < USERNAME_SIZE - 1 && name[i]; i++)
+            h = (h ^ (uint8_t)name[i]) * 16777619u;
+        return h;
+    }
+
+    int size() const {
+        return users.size();
+    }
+
+    // the id of the account called `name`, -1 if there is none
+    int find(const char* name) const {
+        uint32_t h = hash(name);
+        for (uint32_t i = h & mask;; i = (i + 1) & mask) {
+            if (slots[i].id < 0) return -1;
+            if (slots[i].hash == h
+                && strncmp(users[slots[i].id].name, name, USERNAME_SIZE - 1) == 0)
+                return slots[i].id;
+        }
+    }
+
+    void resize(uint32_t nr_slots) {
+        free(slots);
+        slots = (slot_t*)malloc(nr_slots * sizeof(slot_t));
+        memset(slots, -1, nr_slots * sizeof(slot_t));
+        mask = nr_slots - 1;
+        for (int id = 0; id < size(); id++) {
+            uint32_t i = hash(users[id].name) & mask;
+            while (slots[i].id >= 0) i = (i + 1) & mask;
+            slots[i].hash = hash(users[id].name);
+            slots[i].id = id;
+        }
+    }
+
+    // returns the id of the new account, -1 if the name is taken or the table is full
+    int add(const user_record_t& user) {
+        if (size() >= USERDB_MAX_USERS) return -1;
+        uint32_t h = hash(user.name);
+        uint32_t i = h & mask;
+        for (; slots[i].id >= 0; i = (i + 1) & mask) {
+            if (slots[i].hash == h
+                && strncmp(users[slots[i].id].name, user.name, USERNAME_SIZE - 1) == 0)
+                return -1;
+        }
+        slots[i].hash = h;
+        slots[i].id = size();
+        users.push_back(user);
+        if ((uint32_t)size() * 2 > mask + 1)
+            resize((mask + 1) * 2);
+        return size() - 1;
+    }
+
+    // make room in the index for `n` accounts at once
+    void reserve(size_t n) {
+        users.reserve(n);
+        uint32_t nr_slots = mask + 1;
+        while (nr_slots < n * 2 && nr_slots < 2u * USERDB_MAX_USERS)
+            nr_slots *= 2;
+        if (nr_slots != mask + 1)
+            resize(nr_slots);
+    }
+
+    userdb_t() : slots(NULL), lsn(0), error(NULL) {
+        resize(USERDB_INIT_SLOTS);
+    }
+};
+
+inline void user_record_init(user_record_t* user, const char* name, const char* password) {
+    memset(user, 0, sizeof(*user));
+    strncpy(user->name, name, USERNAME_SIZE - 1);
+    strncpy(user->password, password, PASSWORD_SIZE - 1);
+    user->score = INIT_SCORE;
+}
+
+inline void user_copy_stats(user_record_t* to, const user_record_t& from) {
+    to->score = from.score;
+    to->kill = from.kill;
+    to->death = from.death;
+}
+
+inline uint32_t wal_sum(const wal_entry_t& e) {
+    const uint8_t* p = (const uint8_t*)&e;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < offsetof(wal_entry_t, sum); i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+inline void wal_entry_init(wal_entry_t* e, int kind, int id, const user_record_t& user) {
+    memset(e, 0, sizeof(*e));
+    e->kind = kind;
+    e->id = id;
+    e->user = user;
+}
+
+// the whole file at `path` mapped for reading, NULL with errno set if it can not be
+const uint8_t* userdb_map(const char* path, size_t* size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    *size = st.st_size;
+    if (st.st_size == 0) {
+        close(fd);
+        return (const uint8_t*)"";
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int err = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = err;
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    return (const uint8_t*)map;
+}
+
+void userdb_unmap(const uint8_t* map, size_t size) {
+    if (size) munmap((void*)map, size);
+}
+
+/* read every account of the snapshot at `path` into `db` in one pass
+ * over a mapping of it. returns the number of records, or -1 with
+ * `db->error` set. a name seen twice keeps its first record, `skipped`
+ * counts the records left out.
+ */
+int userdb_load(userdb_t* db, const char* path, int* skipped) {
+    *skipped = 0;
+    size_t size;
+    const uint8_t* map = userdb_map(path, &size);
+    if (map == NULL) {
+        db->error = strerror(errno);
+        return -1;
+    }
+    if (size == 0) return 0;
+
+    userdb_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(&header, map, size < sizeof(header) ? size : sizeof(header));
+    size_t header_size = header.version == 1 ? USERDB_V1_HEADER_SIZE : sizeof(header);
+    size_t record_size = header.version == 1 ? USERDB_V1_RECORD_SIZE : sizeof(user_record_t);
+    if (memcmp(header.magic, USERDB_MAGIC, sizeof(header.magic)) != 0 || size < header_size
+        || (header.version != 1 && header.version != USERDB_VERSION) || header.record_size != record_size) {
+        db->error = "not an account file of a known version";
+        userdb_unmap(map, size);
+        return -1;
+    }
+    if (header.version == 1) header.lsn = 0;
+
+    size_t n = (size - header_size) / record_size;
+    db->reserve(db->users.size() + n);
+    for (size_t i = 0; i < n; i++) {
+        user_record_t user;
+        memset(&user, 0, sizeof(user));
+        user.score = INIT_SCORE;
+        memcpy(&user, map + header_size + i * record_size, record_size);
+        user.name[USERNAME_SIZE - 1] = user.password[PASSWORD_SIZE - 1] = 0;
+        if (user.name[0] == 0 || db->add(user) < 0) (*skipped)++;
+    }
+    db->lsn = header.lsn;
+    userdb_unmap(map, size);
+    return n;
+}
+
+/* apply the entries of the log at `path` that come after `db->lsn`.
+ * returns how many were applied, or -1 with `db->error` set. `end` is
+ * where the entries that make sense stop, the rest is a torn write.
+ */
+int userdb_replay(userdb_t* db, const char* path, size_t* end) {
+    *end = 0;
+    size_t size;
+    const uint8_t* map = userdb_map(path, &size);
+    if (map == NULL) {
+        if (errno == ENOENT) return 0;
+        db->error = strerror(errno);
+        return -1;
+    }
+    int applied = 0;
+    for (size_t off = 0; off + sizeof(wal_entry_t) <= size; off += sizeof(wal_entry_t)) {
+        wal_entry_t e;
+        memcpy(&e, map + off, sizeof(e));
+        if (e.sum != wal_sum(e)) break;
+        if (e.lsn > db->lsn) {
+            if (e.lsn != db->lsn + 1) break;
+            if (e.kind == WAL_REGISTER) {
+                e.user.name[USERNAME_SIZE - 1] = e.user.password[PASSWORD_SIZE - 1] = 0;
+                if (e.id != db->size() || db->add(e.user) != e.id) break;
+            } else if (e.kind == WAL_STATS) {
+                if (e.id < 0 || e.id >= db->size()) break;
+                user_copy_stats(&db->users[e.id], e.user);
+            } else {
+                break;
+            }
+            db->lsn = e.lsn;
+            applied++;
+        }
+        *end = off + sizeof(wal_entry_t);
+    }
+    userdb_unmap(map, size);
+    return applied;
+}
+
+/* write `n` accounts as a snapshot that has folded in the log up to
+ * `lsn`. the snapshot replaces the one at `path` only once it is on
+ * disk, so a crash leaves either of them whole.
+ */
+bool userdb_save(const char* path, const user_record_t* users, size_t n, uint64_t lsn, const char** error) {
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "w");
+    if (fp == NULL) {
+        *error = strerror(errno);
+        return false;
+    }
+    userdb_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, USERDB_MAGIC, sizeof(header.magic));
+    header.version = USERDB_VERSION;
+    header.record_size = sizeof(user_record_t);
+    header.lsn = lsn;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+           && fwrite(users, sizeof(user_record_t), n, fp) == n
+           && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (!ok) *error = strerror(errno);
+    if (fclose(fp) != 0 && ok) {
+        *error = strerror(errno);
+        ok = false;
+    }
+    if (ok && rename(tmp.c_str(), path) < 0) {
+        *error = strerror(errno);
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    // the rename itself lives in the directory
+    std::string dir = strrchr(path, '/') ? std::string(path, strrchr(path, '/') - path + 1) : ".";
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    return true;
+}
+
+#endif